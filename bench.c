@@ -0,0 +1,1771 @@
+/*
+ * Headless octree benchmark.
+ *
+ * Made by Folkert van Verseveld
+ *
+ * Copyright Folkert van Verseveld. All rights reserved.
+ *
+ * Usage: bench [root_size...]
+ *
+ * Prints one `root_size,metric,value' line per measurement, so results of
+ * different commits can be compared with standard tools. Latencies are in
+ * nanoseconds and have the timer overhead subtracted.
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+
+#include "dag.h"
+#include "gen.h"
+#include "mesh.h"
+#include "mesher.h"
+#include "net.h"
+#include "ot.h"
+#include "world.h"
+
+#define ARRAY_SIZE(a) (sizeof(a)/sizeof(a[0]))
+
+// side of cube that is filled in raster order
+#define BENCH_SEQ 64
+// number of random sets, gets and latency samples
+#define BENCH_SETS (1 << 16)
+#define BENCH_GETS (1 << 20)
+#define BENCH_SAMPLES (1 << 16)
+// number of split/unsplit rounds
+#define BENCH_SPLITS (1 << 18)
+// edits arrive in batches in small boxes
+#define BENCH_REGION 16
+#define BENCH_BATCH 4096
+#define BENCH_BATCHES 64
+// meshing all chunks of bigger worlds takes too long
+#define BENCH_MESH_MAX 512
+// jobs in flight per mesh worker
+#define BENCH_INFLIGHT 4
+
+// largest world to save and load, and to replay cell by cell unless --replay is given
+#define BENCH_WORLD_MAX 1024
+#define BENCH_REPLAY_MAX 512
+// thickness of the slabs that are copied out at once
+#define BENCH_SLAB 16
+// largest world to generate with the terrain generator
+#define BENCH_GEN_MAX 512
+#define BENCH_SEED 1234
+
+// largest world to visit cell by cell
+#define BENCH_CELLS_MAX 256
+
+// largest chunk size to stream and how many chunks to walk away and back
+#define BENCH_STREAM_MAX 64
+#define BENCH_STREAM_DIST 16
+#define BENCH_STREAM_RADIUS 2
+// less than the area around the player takes, so everything else is evicted
+#define BENCH_STREAM_BUDGET ((size_t)1 << 20)
+// ticks per chunk walked and time between ticks in nanoseconds
+#define BENCH_STREAM_TICKS 32
+#define BENCH_STREAM_SLEEP 5000000
+
+// largest world to replicate, ticks to run per number of clients and edits per tick
+#define BENCH_NET_MAX 256
+#define BENCH_NET_TICKS 100
+#define BENCH_NET_RATE 100
+#define BENCH_NET_EDITS 64
+// edge of the box that is filled each tick
+#define BENCH_NET_BOX 4
+
+// largest world to snapshot, ticks per run, edits per tick and cells read per snapshot
+#define BENCH_SNAP_MAX 256
+#define BENCH_SNAP_TICKS 256
+#define BENCH_SNAP_EDITS 256
+#define BENCH_SNAP_READS 4096
+
+static const unsigned sizes[] = {32, 64, 128, 256, 512, 1024, 2048, 4096};
+
+// replaying bigger worlds takes minutes, so it is opt-in
+static unsigned replay_max = BENCH_REPLAY_MAX;
+
+static uint64_t seed = 0x9e3779b97f4a7c15;
+
+static uint32_t rnd(void)
+{
+	// xorshift64*
+	seed ^= seed >> 12;
+	seed ^= seed << 25;
+	seed ^= seed >> 27;
+	return (uint32_t)((seed * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(unsigned size, const char *metric, double value)
+{
+	printf("%u,%s,%.9g\n", size, metric, value);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double*)a, y = *(const double*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double timer_overhead;
+
+/* Sort samples and report p50 and p99 in nanoseconds. */
+static void report_latency(unsigned size, const char *metric, double *samples, size_t n)
+{
+	char buf[64];
+
+	qsort(samples, n, sizeof *samples, cmp_double);
+
+	for (size_t i = 0; i < n; ++i)
+		samples[i] = samples[i] > timer_overhead ? samples[i] - timer_overhead : 0;
+
+	snprintf(buf, sizeof buf, "%s_p50_ns", metric);
+	report(size, buf, samples[n / 2] * 1e9);
+	snprintf(buf, sizeof buf, "%s_p99_ns", metric);
+	report(size, buf, samples[n * 99 / 100] * 1e9);
+}
+
+static void calibrate(void)
+{
+	double samples[1024];
+
+	for (unsigned i = 0; i < ARRAY_SIZE(samples); ++i) {
+		double t0 = now();
+		samples[i] = now() - t0;
+	}
+
+	qsort(samples, ARRAY_SIZE(samples), sizeof *samples, cmp_double);
+	timer_overhead = samples[ARRAY_SIZE(samples) / 2];
+}
+
+static int bench_seq(struct ot_pool *o, unsigned size)
+{
+	int half = (int)(size >> 1), side = size < BENCH_SEQ ? (int)size : BENCH_SEQ;
+	size_t n = (size_t)side * side * side;
+	unsigned long sum = 0;
+	double t0, t1, t2;
+	int error;
+
+	t0 = now();
+	for (int z = -half; z < -half + side; ++z)
+		for (int y = -half; y < -half + side; ++y)
+			for (int x = -half; x < -half + side; ++x)
+				if ((error = ot_set_cell(o, x, y, z, ID_STONE + ((x ^ y ^ z) & 1))))
+					return error;
+	t1 = now();
+	for (int z = -half; z < -half + side; ++z)
+		for (int y = -half; y < -half + side; ++y)
+			for (int x = -half; x < -half + side; ++x)
+				sum += ot_get_cell(o, x, y, z);
+	t2 = now();
+
+	if (sum != n * ID_STONE + n / 2)
+		return EINVAL;
+
+	report(size, "seq_set_per_sec", n / (t1 - t0));
+	report(size, "seq_get_per_sec", n / (t2 - t1));
+	return 0;
+}
+
+static int bench_rand(struct ot_pool *o, unsigned size, struct ot_cell *cells, double *samples)
+{
+	int half = (int)(size >> 1), error;
+	unsigned long sum = 0;
+	uint32_t *idx;
+	double t0, t1, t2, bytes;
+
+	if (!(idx = malloc(BENCH_GETS * sizeof *idx)))
+		return ENOMEM;
+
+	for (unsigned i = 0; i < BENCH_SETS; ++i) {
+		cells[i].x = (int)(rnd() & (size - 1)) - half;
+		cells[i].y = (int)(rnd() & (size - 1)) - half;
+		cells[i].z = (int)(rnd() & (size - 1)) - half;
+		cells[i].id = 1 + rnd() % 2;
+	}
+
+	// gets pick random cells that have been set, so they go all the way down
+	for (unsigned i = 0; i < BENCH_GETS; ++i)
+		idx[i] = rnd() % BENCH_SETS;
+
+	t0 = now();
+	for (unsigned i = 0; i < BENCH_SETS; ++i)
+		if ((error = ot_set_cell(o, cells[i].x, cells[i].y, cells[i].z, cells[i].id)))
+			goto fail;
+	t1 = now();
+	for (unsigned i = 0; i < BENCH_GETS; ++i) {
+		const struct ot_cell *c = &cells[idx[i]];
+		sum += ot_get_cell(o, c->x, c->y, c->z);
+	}
+	t2 = now();
+
+	report(size, "rand_set_per_sec", BENCH_SETS / (t1 - t0));
+	report(size, "rand_get_per_sec", BENCH_GETS / (t2 - t1));
+
+	for (unsigned i = 0; i < BENCH_SAMPLES; ++i) {
+		const struct ot_cell *c = &cells[idx[i]];
+
+		t0 = now();
+		sum += ot_get_cell(o, c->x, c->y, c->z);
+		samples[i] = now() - t0;
+	}
+	report_latency(size, "rand_get", samples, BENCH_SAMPLES);
+
+	// swap stone and grass, so the tree shape stays the same
+	for (unsigned i = 0; i < BENCH_SAMPLES; ++i) {
+		const struct ot_cell *c = &cells[idx[i]];
+		block_t id = ot_get_cell(o, c->x, c->y, c->z);
+
+		t0 = now();
+		error = ot_set_cell(o, c->x, c->y, c->z, id == ID_STONE ? ID_GRASS : ID_STONE);
+		samples[i] = now() - t0;
+
+		if (error)
+			goto fail;
+	}
+	report_latency(size, "rand_set", samples, BENCH_SAMPLES);
+
+	// including the per group parents, generations and epochs
+	bytes = o->cap * (sizeof(struct ot_node) + (sizeof *o->parents + sizeof *o->gens + sizeof *o->epochs) / 8.0)
+		+ o->rcap * sizeof *o->rpop;
+
+	report(size, "blocks", o->blocks);
+	report(size, "nodes", o->count - (o->rcount << 3));
+	report(size, "bytes", bytes);
+	report(size, "bytes_per_block", bytes / o->blocks);
+	report(size, "checksum", sum);
+
+	error = 0;
+fail:
+	free(idx);
+	return error;
+}
+
+/*
+ * Split nodes breadth first down to just above the leaves and then unsplit
+ * them all in reverse, which also exercises recycling of free groups.
+ */
+static int bench_split(unsigned size)
+{
+	struct ot_pool o;
+	size_t *queue, n, done = 0;
+	double split = 0, unsplit = 0, t0;
+	unsigned levels = 0;
+	int error;
+
+	while ((2u << levels) < size)
+		++levels;
+
+	if ((error = ot_init(&o, OT_CAP, OT_RCAP, size)))
+		return error;
+
+	if (!(queue = malloc(BENCH_SPLITS * sizeof *queue))) {
+		ot_free(&o);
+		return ENOMEM;
+	}
+
+	while (done < BENCH_SPLITS) {
+		size_t begin = 0, end = 1;
+
+		queue[0] = o.root;
+		n = 1;
+
+		t0 = now();
+		// split all nodes from begin to end, queue their children
+		for (unsigned d = 0; d < levels && n < BENCH_SPLITS; ++d) {
+			for (size_t i = begin; i < end && n < BENCH_SPLITS; ++i) {
+				if ((error = ot_split(&o, queue[i])))
+					goto fail;
+
+				for (unsigned j = 0; j < 8 && n < BENCH_SPLITS; ++j)
+					queue[n++] = ((size_t)o.nodes[queue[i]].data.children << 3) + j;
+			}
+
+			begin = end;
+			end = n;
+		}
+		split += now() - t0;
+
+		t0 = now();
+		for (size_t i = n; i-- > 0;) {
+			if ((o.nodes[queue[i]].type & ONT_TYPE_MASK) != ONT_SPLIT)
+				continue;
+
+			if ((error = ot_unsplit(&o, queue[i])))
+				goto fail;
+
+			++done;
+		}
+		unsplit += now() - t0;
+	}
+
+	report(size, "split_per_sec", done / split);
+	report(size, "unsplit_per_sec", done / unsplit);
+fail:
+	free(queue);
+	ot_free(&o);
+	return error;
+}
+
+/* Compare the per-cell loop against ot_set_cells/ot_get_cells. */
+static int bench_batch(unsigned size, struct ot_cell *cells)
+{
+	struct ot_pool o;
+	int error, half = (int)(size >> 1);
+	size_t n = (size_t)BENCH_BATCH * BENCH_BATCHES;
+	double t0, t1, t2, t3, t4, t5;
+	unsigned long sum = 0;
+
+	for (unsigned b = 0; b < BENCH_BATCHES; ++b) {
+		int x = (int)(rnd() % (size - BENCH_REGION + 1)) - half;
+		int y = (int)(rnd() % (size - BENCH_REGION + 1)) - half;
+		int z = (int)(rnd() % (size - BENCH_REGION + 1)) - half;
+
+		for (unsigned i = 0; i < BENCH_BATCH; ++i) {
+			struct ot_cell *c = &cells[b * BENCH_BATCH + i];
+
+			c->x = x + (int)(rnd() % BENCH_REGION);
+			c->y = y + (int)(rnd() % BENCH_REGION);
+			c->z = z + (int)(rnd() % BENCH_REGION);
+			c->id = rnd() % 3;
+		}
+	}
+
+	if ((error = ot_init(&o, OT_CAP, OT_RCAP, size)))
+		return error;
+
+	t0 = now();
+	for (size_t i = 0; i < n; ++i)
+		if ((error = ot_set_cell(&o, cells[i].x, cells[i].y, cells[i].z, cells[i].id)))
+			goto fail;
+	t1 = now();
+	for (size_t i = 0; i < n; ++i)
+		sum += ot_get_cell(&o, cells[i].x, cells[i].y, cells[i].z);
+	t2 = now();
+
+	ot_free(&o);
+
+	if ((error = ot_init(&o, OT_CAP, OT_RCAP, size)))
+		return error;
+
+	t3 = now();
+	for (size_t i = 0; i < n; i += BENCH_BATCH)
+		if ((error = ot_set_cells(&o, &cells[i], BENCH_BATCH)))
+			goto fail;
+	t4 = now();
+	for (size_t i = 0; i < n; i += BENCH_BATCH)
+		if ((error = ot_get_cells(&o, &cells[i], BENCH_BATCH)))
+			goto fail;
+	t5 = now();
+
+	for (size_t i = 0; i < n; ++i)
+		sum -= cells[i].id;
+
+	if (sum) {
+		error = EINVAL;
+		goto fail;
+	}
+
+	report(size, "loop_set_per_sec", n / (t1 - t0));
+	report(size, "loop_get_per_sec", n / (t2 - t1));
+	report(size, "batch_set_per_sec", n / (t4 - t3));
+	report(size, "batch_get_per_sec", n / (t5 - t4));
+fail:
+	ot_free(&o);
+	return error;
+}
+
+static uint32_t lattice(int x, int y)
+{
+	uint32_t h = (uint32_t)x * 0x8da6b343u ^ (uint32_t)y * 0xd8163841u;
+
+	h ^= h >> 15;
+	h *= 0x2c1b3c6du;
+	h ^= h >> 12;
+	return h;
+}
+
+/* Smoothed value noise in [0,1) with lattice spacing of scale blocks. */
+static double noise(int x, int y, int scale)
+{
+	int x0 = x >= 0 ? x / scale : -((-x - 1) / scale) - 1;
+	int y0 = y >= 0 ? y / scale : -((-y - 1) / scale) - 1;
+	double fx = (double)(x - x0 * scale) / scale, fy = (double)(y - y0 * scale) / scale;
+	double v00 = lattice(x0, y0) / 4294967296.0, v10 = lattice(x0 + 1, y0) / 4294967296.0;
+	double v01 = lattice(x0, y0 + 1) / 4294967296.0, v11 = lattice(x0 + 1, y0 + 1) / 4294967296.0;
+
+	fx = fx * fx * (3 - 2 * fx);
+	fy = fy * fy * (3 - 2 * fy);
+
+	return (v00 * (1 - fx) + v10 * fx) * (1 - fy) + (v01 * (1 - fx) + v11 * fx) * fy;
+}
+
+/* Rolling hills of stone with a layer of grass on top. */
+static int terrain(struct ot_pool *o, unsigned size)
+{
+	int half = (int)(size >> 1), error;
+
+	for (int y = -half; y < half; ++y)
+		for (int x = -half; x < half; ++x) {
+			double n = noise(x, y, 64) * 0.75 + noise(x, y, 16) * 0.25;
+			int h = (int)((n - 0.5) * size / 4);
+			int min[3] = {x, y, -half}, max[3] = {x + 1, y + 1, h};
+
+			if ((error = ot_fill_box(o, min, max, ID_STONE)))
+				return error;
+
+			min[2] = h;
+			max[2] = h + 1;
+
+			if ((error = ot_fill_box(o, min, max, ID_GRASS)))
+				return error;
+		}
+
+	return 0;
+}
+
+static int mesh_all(struct mesh *m, const struct ot_pool *o, unsigned size, int greedy, struct mesh_stats *s, size_t *vertices)
+{
+	int half = (int)(size >> 1), error;
+
+	*vertices = 0;
+
+	for (int z = -half; z < half; z += MESH_CHUNK)
+		for (int y = -half; y < half; y += MESH_CHUNK)
+			for (int x = -half; x < half; x += MESH_CHUNK) {
+				int pos[3] = {x, y, z};
+
+				mesh_clear(m);
+
+				if ((error = (greedy ? mesh_chunk_greedy : mesh_chunk)(m, o, pos, MESH_CHUNK, s)))
+					return error;
+
+				*vertices += m->count;
+			}
+
+	return 0;
+}
+
+/* Greedy mesh all chunks with the worker pool, the main thread only copies cells. */
+static int mesh_workers(const struct ot_pool *o, unsigned size, unsigned threads, double *dt)
+{
+	struct mesher w;
+	int half = (int)(size >> 1), error;
+	size_t inflight = 0, max = (size_t)(threads ? threads : 1) * BENCH_INFLIGHT;
+	double t0;
+
+	if ((error = mesher_init(&w, threads, 1)))
+		return error;
+
+	t0 = now();
+
+	for (int z = -half; z < half + MESH_CHUNK; z += MESH_CHUNK)
+		for (int y = -half; y < half; y += MESH_CHUNK)
+			for (int x = -half; x < half; x += MESH_CHUNK) {
+				int pos[3] = {x, y, z};
+				struct mesh_job *j;
+
+				// wait until there is room, the last row just drains the queue
+				while (inflight >= max || (z >= half && inflight)) {
+					if (!(j = mesher_poll(&w))) {
+						sched_yield();
+						continue;
+					}
+
+					for (struct mesh_job *next; j; j = next) {
+						next = j->next;
+
+						if (j->error && !error)
+							error = j->error;
+
+						mesher_release(&w, j);
+						--inflight;
+					}
+				}
+
+				if (z >= half)
+					continue;
+
+				if (!(j = mesher_job(&w, o, pos, MESH_CHUNK))) {
+					error = ENOMEM;
+					goto fail;
+				}
+
+				mesher_submit(&w, j);
+				++inflight;
+			}
+
+	*dt = now() - t0;
+fail:
+	mesher_free(&w);
+	return error;
+}
+
+/* Compare mesh sizes of all faces, culled faces and greedy quads on generated terrain. */
+static int bench_mesh(unsigned size)
+{
+	struct ot_pool o;
+	struct mesh m;
+	struct mesh_stats culled = {0, 0}, greedy = {0, 0};
+	size_t vculled, vgreedy;
+	double t0, t1, t2;
+	int error;
+
+	if (size > BENCH_MESH_MAX)
+		return 0;
+
+	if ((error = ot_init(&o, OT_CAP, OT_RCAP, size)))
+		return error;
+
+	mesh_init(&m);
+
+	t0 = now();
+	if ((error = terrain(&o, size)))
+		goto fail;
+	t1 = now();
+
+	report(size, "terrain_blocks", o.blocks);
+	report(size, "terrain_sec", t1 - t0);
+
+	t0 = now();
+	if ((error = mesh_all(&m, &o, size, 0, &culled, &vculled)))
+		goto fail;
+	t1 = now();
+	if ((error = mesh_all(&m, &o, size, 1, &greedy, &vgreedy)))
+		goto fail;
+	t2 = now();
+
+	report(size, "mesh_all_vertices", o.blocks * 6 * 4);
+	report(size, "mesh_culled_vertices", vculled);
+	report(size, "mesh_greedy_vertices", vgreedy);
+	report(size, "mesh_culled_sec", t1 - t0);
+	report(size, "mesh_greedy_sec", t2 - t1);
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	double chunks = (double)(size / MESH_CHUNK) * (size / MESH_CHUNK) * (size / MESH_CHUNK);
+
+	// scaling of the worker pool, 0 meshes on the main thread
+	for (unsigned threads = 0; threads <= cpus && threads <= MESHER_MAX;) {
+		char buf[64];
+		double dt;
+
+		if ((error = mesh_workers(&o, size, threads, &dt)))
+			goto fail;
+
+		snprintf(buf, sizeof buf, "mesh_workers_%u_chunks_per_sec", threads);
+		report(size, buf, chunks / dt);
+
+		// powers of two and all cores
+		if (threads < cpus && threads << 1 > cpus)
+			threads = (unsigned)cpus;
+		else
+			threads = threads ? threads << 1 : 1;
+	}
+fail:
+	mesh_free(&m);
+	ot_free(&o);
+	return error;
+}
+
+/* Insert every non-air cell of src into dst in batches, like replaying an edit log. */
+static int replay(struct ot_pool *dst, const struct ot_pool *src, struct ot_cell *cells)
+{
+	int half = (int)(src->root_size >> 1), error;
+	int wmin[3] = {-half, -half, -half}, wmax[3] = {half, half, half}, min[3], max[3];
+	struct ot_iter it;
+	size_t n = 0;
+	block_t id;
+
+	ot_iter_init(&it, src, wmin, wmax);
+
+	while (ot_iter_next(&it, min, max, &id))
+		for (int z = min[2]; z < max[2]; ++z)
+			for (int y = min[1]; y < max[1]; ++y)
+				for (int x = min[0]; x < max[0]; ++x) {
+					cells[n].x = x;
+					cells[n].y = y;
+					cells[n].z = z;
+					cells[n].id = id;
+
+					if (++n == BENCH_BATCH) {
+						if ((error = ot_set_cells(dst, cells, n)))
+							return error;
+						n = 0;
+					}
+				}
+
+	return ot_set_cells(dst, cells, n);
+}
+
+static int count_box(void *arg, const int min[3], const int max[3], block_t id)
+{
+	(void)id;
+	*(size_t*)arg += (size_t)(max[0] - min[0]) * (size_t)(max[1] - min[1]) * (size_t)(max[2] - min[2]);
+	return 0;
+}
+
+/* Count all non-air cells cell by cell, by iterating over the tree and from a dense copy. */
+static int bench_box(const struct ot_pool *o)
+{
+	unsigned size = o->root_size;
+	int half = (int)(size >> 1);
+	size_t cells = 0, boxes = 0, dense = 0, n = (size_t)size * size * BENCH_SLAB;
+	block_t *slab;
+	double t0, t1, t2, t3;
+
+	if (!(slab = malloc(n * sizeof *slab)))
+		return ENOMEM;
+
+	t0 = now();
+	if (size <= BENCH_CELLS_MAX)
+		for (int z = -half; z < half; ++z)
+			for (int y = -half; y < half; ++y)
+				for (int x = -half; x < half; ++x)
+					cells += ot_get_cell(o, x, y, z) != ID_AIR;
+	t1 = now();
+
+	int min[3] = {-half, -half, -half}, max[3] = {half, half, half};
+
+	ot_for_each_in_box(o, min, max, count_box, &boxes);
+	t2 = now();
+
+	for (int z = -half; z < half; z += BENCH_SLAB) {
+		min[2] = z;
+		max[2] = z + BENCH_SLAB;
+
+		ot_get_box(o, min, max, slab);
+
+		for (size_t i = 0; i < n; ++i)
+			dense += slab[i] != ID_AIR;
+	}
+	t3 = now();
+
+	free(slab);
+
+	if (boxes != o->blocks || dense != o->blocks || (size <= BENCH_CELLS_MAX && cells != o->blocks)) {
+		fprintf(stderr, "bench: root size %u: wrong number of blocks\n", size);
+		return EINVAL;
+	}
+
+	if (size <= BENCH_CELLS_MAX)
+		report(size, "box_cells_sec", t1 - t0);
+
+	report(size, "box_for_each_sec", t2 - t1);
+	report(size, "box_dense_sec", t3 - t2);
+	return 0;
+}
+
+/* Memory and speed of the deduplicated tree compared to the plain tree of o. */
+static int bench_dag(const struct ot_pool *o)
+{
+	unsigned size = o->root_size;
+	int half = (int)(size >> 1), error;
+	size_t groups = (o->count >> 3) - o->rcount;
+	struct ot_dag d;
+	double t0, t1, t2;
+	unsigned long sum = 0;
+
+	t0 = now();
+	if ((error = ot_dag_build(&d, o)))
+		return error;
+	t1 = now();
+
+	report(size, "dag_build_sec", t1 - t0);
+	report(size, "dag_tree_bytes", groups * (8 * sizeof *o->nodes + sizeof *o->parents + sizeof *o->gens + sizeof *o->epochs));
+	report(size, "dag_bytes", ot_dag_bytes(&d));
+	report(size, "dag_tree_groups", groups);
+	report(size, "dag_nodes", d.live);
+
+	uint32_t seed = rnd();
+
+	t0 = now();
+	for (unsigned i = 0; i < BENCH_GETS; ++i) {
+		uint32_t r = lattice((int)seed, (int)i);
+
+		sum += ot_get_cell(o, (int)(r % size) - half, (int)((r >> 10) % size) - half, (int)((r >> 20) % size) - half);
+	}
+	t1 = now();
+	for (unsigned i = 0; i < BENCH_GETS; ++i) {
+		uint32_t r = lattice((int)seed, (int)i);
+
+		sum -= ot_dag_get_cell(&d, (int)(r % size) - half, (int)((r >> 10) % size) - half, (int)((r >> 20) % size) - half);
+	}
+	t2 = now();
+
+	if (sum) {
+		fprintf(stderr, "bench: root size %u: dag differs from tree\n", size);
+		error = EINVAL;
+		goto fail;
+	}
+
+	report(size, "dag_tree_get_per_sec", BENCH_GETS / (t1 - t0));
+	report(size, "dag_get_per_sec", BENCH_GETS / (t2 - t1));
+
+	t0 = now();
+	for (unsigned i = 0; i < BENCH_SETS; ++i) {
+		int x = (int)(rnd() % size) - half, y = (int)(rnd() % size) - half, z = (int)(rnd() % size) - half;
+
+		if ((error = ot_dag_set_cell(&d, x, y, z, (block_t)(rnd() % 4))))
+			goto fail;
+	}
+	t1 = now();
+
+	report(size, "dag_set_per_sec", BENCH_SETS / (t1 - t0));
+	report(size, "dag_set_bytes", ot_dag_bytes(&d));
+fail:
+	ot_dag_free(&d);
+	return error;
+}
+
+// rays per measurement
+#define BENCH_RAYS (1 << 18)
+
+/* Reference ray cast that looks up every cell along the ray from the root. */
+static int ray_cells(const struct ot_pool *o, const float origin[3], const float dir[3], float max_dist, struct ot_hit *hit)
+{
+	double len = sqrt((double)dir[0] * dir[0] + (double)dir[1] * dir[1] + (double)dir[2] * dir[2]);
+	double next[3], delta[3], t = 0;
+	int cell[3], step[3], axis = -1;
+
+	for (unsigned i = 0; i < 3; ++i) {
+		double d = dir[i] / len;
+
+		cell[i] = (int)floor(origin[i]);
+		step[i] = d > 0 ? 1 : -1;
+		delta[i] = d != 0 ? fabs(1 / d) : INFINITY;
+		next[i] = d > 0 ? (cell[i] + 1 - origin[i]) / d : d < 0 ? (cell[i] - origin[i]) / d : INFINITY;
+	}
+
+	while (t <= max_dist) {
+		block_t id = ot_get_cell(o, cell[0], cell[1], cell[2]);
+
+		if (id != ID_AIR) {
+			memcpy(hit->pos, cell, sizeof hit->pos);
+			hit->normal[0] = hit->normal[1] = hit->normal[2] = 0;
+			if (axis >= 0)
+				hit->normal[axis] = -step[axis];
+			hit->dist = (float)t;
+			hit->id = id;
+			return 1;
+		}
+
+		axis = next[0] < next[1] ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+		t = next[axis];
+		cell[axis] += step[axis];
+		next[axis] += delta[axis];
+	}
+
+	return 0;
+}
+
+/* Rays from random points above the terrain in random downward directions. */
+static int bench_ray(const struct ot_pool *o)
+{
+	unsigned size = o->root_size, hits = 0;
+	float half = (float)(size >> 1), (*rays)[6];
+	struct ot_hit a, b;
+	double t0, t1, t2;
+
+	if (!(rays = malloc(BENCH_RAYS * sizeof *rays)))
+		return ENOMEM;
+
+	for (unsigned i = 0; i < BENCH_RAYS; ++i) {
+		rays[i][0] = (rnd() / 4294967296.0f - 0.5f) * 2 * half;
+		rays[i][1] = (rnd() / 4294967296.0f - 0.5f) * 2 * half;
+		rays[i][2] = half * (0.25f + rnd() / 4294967296.0f * 0.7f);
+		rays[i][3] = rnd() / 4294967296.0f - 0.5f;
+		rays[i][4] = rnd() / 4294967296.0f - 0.5f;
+		rays[i][5] = -0.01f - rnd() / 4294967296.0f;
+	}
+
+	t0 = now();
+	for (unsigned i = 0; i < BENCH_RAYS; ++i)
+		hits += ot_raycast(o, rays[i], rays[i] + 3, (float)size, &a);
+	t1 = now();
+
+	report(size, "ray_per_sec", BENCH_RAYS / (t1 - t0));
+	report(size, "ray_hit_ratio", (double)hits / BENCH_RAYS);
+
+	// stepping cell by cell is far too slow to do all of them
+	unsigned n = BENCH_RAYS >> 4, mismatch = 0;
+
+	t1 = now();
+	for (unsigned i = 0; i < n; ++i) {
+		int hit = ray_cells(o, rays[i], rays[i] + 3, (float)size, &b);
+
+		if (hit != ot_raycast(o, rays[i], rays[i] + 3, (float)size, &a) || (hit && memcmp(a.pos, b.pos, sizeof a.pos)))
+			++mismatch;
+	}
+	t2 = now();
+
+	// time of the check includes the fast cast, subtract it
+	report(size, "ray_cells_per_sec", n / ((t2 - t1) - n * (t1 - t0) / BENCH_RAYS));
+
+	free(rays);
+
+	if (mismatch) {
+		fprintf(stderr, "bench: root size %u: %u rays differ from reference\n", size, mismatch);
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+/* Fill a world of the given size with random cells, once from the smallest root and once in the biggest root. */
+static int bench_grow(unsigned size, struct ot_cell *cells)
+{
+	struct ot_pool o;
+	int half = (int)(size >> 1), error;
+	uint32_t seed = rnd();
+	unsigned long sum[2] = {0, 0};
+
+	for (unsigned i = 0; i < BENCH_SETS; ++i) {
+		cells[i].x = (int)(rnd() % size) - half;
+		cells[i].y = (int)(rnd() % size) - half;
+		cells[i].z = (int)(rnd() % size) - half;
+		cells[i].id = (block_t)(1 + rnd() % 3);
+	}
+
+	for (unsigned pass = 0; pass < 2; ++pass) {
+		const char *name = pass ? "fixed" : "grow";
+		char buf[64];
+		double t0, t1, t2;
+
+		if ((error = ot_init(&o, OT_CAP, OT_RCAP, pass ? OT_SIZE_MAX : 2)))
+			return error;
+
+		t0 = now();
+		for (unsigned i = 0; i < BENCH_SETS; ++i)
+			if ((error = ot_set_cell(&o, cells[i].x, cells[i].y, cells[i].z, cells[i].id)))
+				goto fail;
+		t1 = now();
+		for (unsigned i = 0; i < BENCH_GETS; ++i) {
+			uint32_t r = lattice((int)seed, (int)i);
+
+			sum[pass] += ot_get_cell(&o, (int)(r % size) - half, (int)((r >> 10) % size) - half, (int)((r >> 20) % size) - half);
+		}
+		t2 = now();
+
+		snprintf(buf, sizeof buf, "%s_set_per_sec", name);
+		report(size, buf, BENCH_SETS / (t1 - t0));
+		snprintf(buf, sizeof buf, "%s_get_per_sec", name);
+		report(size, buf, BENCH_GETS / (t2 - t1));
+		snprintf(buf, sizeof buf, "%s_root_size", name);
+		report(size, buf, o.root_size);
+
+		ot_free(&o);
+	}
+
+	if (sum[0] != sum[1]) {
+		fprintf(stderr, "bench: root size %u: grown world differs\n", size);
+		return EINVAL;
+	}
+
+	return 0;
+fail:
+	ot_free(&o);
+	return error;
+}
+
+static size_t rss(void)
+{
+	unsigned long pages = 0;
+	FILE *f;
+
+	if ((f = fopen("/proc/self/statm", "r"))) {
+		if (fscanf(f, "%*s %lu", &pages) != 1)
+			pages = 0;
+		fclose(f);
+	}
+
+	return pages * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static void rmtree(const char *path)
+{
+	struct dirent *e;
+	char buf[4096];
+	DIR *d;
+
+	if ((d = opendir(path))) {
+		while ((e = readdir(d)))
+			if (e->d_name[0] != '.' && (size_t)snprintf(buf, sizeof buf, "%s/%s", path, e->d_name) < sizeof buf)
+				unlink(buf);
+
+		closedir(d);
+	}
+
+	rmdir(path);
+}
+
+/* Tick the world until the chunk with block (x,y,z) is ready, there is no other way to wait for it. */
+static int stream_wait(struct world *w, const float pos[3], int x, int y, int z)
+{
+	const struct timespec ts = {0, BENCH_STREAM_SLEEP};
+	int local[3], error;
+
+	while (!world_chunk_at(w, x, y, z, local)) {
+		if ((error = world_update(w, pos)))
+			return error;
+
+		nanosleep(&ts, NULL);
+	}
+
+	return 0;
+}
+
+/*
+ * Walk BENCH_STREAM_DIST chunks away from the origin and back again. Reports
+ * how long world_update takes on the main thread, how much memory it takes
+ * with and without the budget and how much of the area around the player was
+ * ready. A block that is changed before leaving must still be there on return.
+ */
+static int bench_stream(unsigned size, double *samples)
+{
+	const struct timespec ts = {0, BENCH_STREAM_SLEEP};
+	unsigned ticks = 2 * BENCH_STREAM_DIST * BENCH_STREAM_TICKS;
+	char dir[] = "/tmp/streamXXXXXX";
+	size_t peak = 0, rss0, rss1 = 0;
+	unsigned long wanted = 0, ready = 0;
+	float pos[3] = {0, 0, 0};
+	struct world w;
+	int error;
+
+	if (size > BENCH_STREAM_MAX || ticks > BENCH_SAMPLES)
+		return 0;
+
+	if (!mkdtemp(dir))
+		return errno;
+
+	if ((error = world_init(&w, dir, BENCH_SEED, size, WORLD_IO)))
+		goto fail_dir;
+
+	w.radius = BENCH_STREAM_RADIUS;
+	w.budget = BENCH_STREAM_BUDGET;
+
+	if ((error = stream_wait(&w, pos, 1, 2, 3)) || (error = world_set_cell(&w, 1, 2, 3, ID_GRASS + 1)))
+		goto fail;
+
+	rss0 = rss();
+
+	for (unsigned i = 0; i < ticks; ++i) {
+		// out and back again
+		unsigned step = i < ticks / 2 ? i : ticks - i;
+		int r = BENCH_STREAM_RADIUS, c[3];
+		double t0, t1;
+		size_t m;
+
+		pos[0] = (float)step * size / BENCH_STREAM_TICKS;
+
+		t0 = now();
+		error = world_update(&w, pos);
+		t1 = now();
+
+		if (error)
+			goto fail;
+
+		samples[i] = t1 - t0;
+
+		if (w.bytes > peak)
+			peak = w.bytes;
+		if ((m = rss()) > rss1)
+			rss1 = m;
+
+		c[0] = (int)floorf(pos[0]) / (int)size;
+		c[1] = c[2] = 0;
+
+		for (int dz = -r; dz <= r; ++dz)
+			for (int dy = -r; dy <= r; ++dy)
+				for (int dx = -r; dx <= r; ++dx) {
+					struct world_chunk *ch;
+
+					if (dx * dx + dy * dy + dz * dz > r * r)
+						continue;
+
+					++wanted;
+					ch = world_chunk_find(&w, c[0] + dx, c[1] + dy, c[2] + dz);
+					ready += ch && ch->state == WC_READY;
+				}
+
+		nanosleep(&ts, NULL);
+	}
+
+	report_latency(size, "stream_update", samples, ticks);
+	report(size, "stream_update_max_ns", (samples[ticks - 1]) * 1e9);
+	report(size, "stream_ready_ratio", (double)ready / wanted);
+	report(size, "stream_bytes_peak", peak);
+	report(size, "stream_rss_growth_bytes", rss1 > rss0 ? rss1 - rss0 : 0);
+	report(size, "stream_generated", w.stats.generated);
+	report(size, "stream_loaded", w.stats.loaded);
+	report(size, "stream_stored", w.stats.stored);
+	report(size, "stream_evicted", w.stats.evicted);
+
+	pos[0] = 0;
+	if ((error = stream_wait(&w, pos, 1, 2, 3)))
+		goto fail;
+
+	if (!w.stats.evicted || world_get_cell(&w, 1, 2, 3) != ID_GRASS + 1) {
+		fprintf(stderr, "bench: chunk size %u: change lost after streaming\n", size);
+		error = EINVAL;
+	}
+fail:
+	world_free(&w);
+fail_dir:
+	rmtree(dir);
+	return error;
+}
+
+/* Generate terrain with 1 up to all cores, the worlds must all be the same. */
+static int bench_gen(unsigned size)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t blocks = 0, count = 0;
+	int error = 0;
+
+	if (size > BENCH_GEN_MAX)
+		return 0;
+
+	for (unsigned threads = 1; threads <= cpus && threads <= GEN_MAX;) {
+		struct ot_pool o;
+		char buf[64];
+		double t0, t1;
+
+		if ((error = ot_init(&o, OT_CAP, OT_RCAP, size)))
+			return error;
+
+		t0 = now();
+		error = gen_world(&o, BENCH_SEED, threads);
+		t1 = now();
+
+		if (!error && threads > 1 && (o.blocks != blocks || o.count - (o.rcount << 3) != count)) {
+			fprintf(stderr, "bench: root size %u: world differs with %u threads\n", size, threads);
+			error = EINVAL;
+		}
+
+		blocks = o.blocks;
+		count = o.count - (o.rcount << 3);
+		ot_free(&o);
+
+		if (error)
+			return error;
+
+		snprintf(buf, sizeof buf, "gen_%u_sec", threads);
+		report(size, buf, t1 - t0);
+
+		// powers of two and all cores
+		if (threads < cpus && threads << 1 > cpus)
+			threads = (unsigned)cpus;
+		else
+			threads <<= 1;
+	}
+
+	report(size, "gen_blocks", blocks);
+	report(size, "gen_nodes", count);
+	return 0;
+}
+
+/* Startup from a saved world compared to generating it again or replaying all inserts. */
+static int bench_world(unsigned size, struct ot_cell *cells)
+{
+	struct ot_pool o, l;
+	char path[] = "/tmp/benchXXXXXX";
+	struct stat st;
+	double t0, t1;
+	int fd, error;
+
+	if (size > BENCH_WORLD_MAX)
+		return 0;
+
+	if ((error = ot_init(&o, OT_CAP, OT_RCAP, size)))
+		return error;
+
+	t0 = now();
+	if ((error = terrain(&o, size)))
+		goto fail;
+	t1 = now();
+
+	report(size, "world_gen_sec", t1 - t0);
+
+	if ((fd = mkstemp(path)) < 0) {
+		error = errno;
+		goto fail;
+	}
+
+	close(fd);
+
+	t0 = now();
+	if ((error = ot_save(&o, path)))
+		goto fail_unlink;
+	t1 = now();
+
+	report(size, "world_save_sec", t1 - t0);
+
+	if (stat(path, &st)) {
+		error = errno;
+		goto fail_unlink;
+	}
+
+	report(size, "world_file_bytes", st.st_size);
+	report(size, "world_bytes_per_node", (double)st.st_size / o.count);
+
+	t0 = now();
+	if ((error = ot_load(&l, path)))
+		goto fail_unlink;
+	t1 = now();
+
+	report(size, "world_load_sec", t1 - t0);
+
+	if (l.blocks != o.blocks || l.count != o.count - (o.rcount << 3))
+		error = EINVAL;
+
+	for (unsigned i = 0; !error && i < BENCH_GETS; ++i) {
+		int half = (int)(size >> 1);
+		int x = (int)(rnd() % size) - half, y = (int)(rnd() % size) - half, z = (int)(rnd() % size) - half;
+
+		if (ot_get_cell(&l, x, y, z) != ot_get_cell(&o, x, y, z))
+			error = EINVAL;
+	}
+
+	ot_free(&l);
+
+	if (error) {
+		fprintf(stderr, "bench: root size %u: loaded world differs\n", size);
+		goto fail_unlink;
+	}
+
+	if (size <= replay_max) {
+		if ((error = ot_init(&l, OT_CAP, OT_RCAP, size)))
+			goto fail_unlink;
+
+		t0 = now();
+		error = replay(&l, &o, cells);
+		t1 = now();
+
+		ot_free(&l);
+
+		if (error)
+			goto fail_unlink;
+
+		report(size, "world_replay_sec", t1 - t0);
+	}
+
+	if (!(error = bench_dag(&o)) && !(error = bench_ray(&o)))
+		error = bench_box(&o);
+fail_unlink:
+	unlink(path);
+fail:
+	ot_free(&o);
+	return error;
+}
+
+/* Simulated clients that all live on one thread. */
+struct net_sim {
+	struct net_client *clients;
+	struct ot_pool *pools;
+	unsigned n;
+	// the clients own their pools, so they are checked against the server before they are freed
+	const struct ot_pool *server;
+	block_t *buf, *tmp;
+	unsigned differ;
+	unsigned short port;
+	// end-to-end latency of each delta at each client in seconds
+	double *samples;
+	size_t nsamples, cap;
+	int error;
+	// last tick the server has sent plus one, 0 while it is still running
+	uint32_t target;
+	// clients that have a snapshot
+	unsigned ready;
+	int done;
+};
+
+static struct net_server *bench_server;
+
+static void bench_touch(struct ot_pool *o, const int min[3], const int max[3])
+{
+	(void)o;
+	net_server_touch(bench_server, min, max);
+}
+
+static void sim_applied(struct net_client *c, uint32_t tick, uint64_t stamp)
+{
+	struct net_sim *sim = c->arg;
+
+	(void)tick;
+
+	if (sim->nsamples < sim->cap)
+		sim->samples[sim->nsamples++] = (double)(net_clock() - stamp) * 1e-9;
+}
+
+static int sim_compare(const struct ot_pool *a, const struct ot_pool *b, block_t *buf, block_t *tmp)
+{
+	int min[3] = {-BENCH_REGION, -BENCH_REGION, -BENCH_REGION}, max[3] = {BENCH_REGION, BENCH_REGION, BENCH_REGION};
+	size_t n = (size_t)8 * BENCH_REGION * BENCH_REGION * BENCH_REGION;
+
+	if (a->blocks != b->blocks)
+		return 1;
+
+	ot_get_box(a, min, max, buf);
+	ot_get_box(b, min, max, tmp);
+	return memcmp(buf, tmp, n * sizeof *buf) != 0;
+}
+
+static void *sim_main(void *arg)
+{
+	struct net_sim *sim = arg;
+	struct epoll_event ev[64];
+	unsigned connected = 0;
+	int epfd = -1, error = 0;
+
+	if ((epfd = epoll_create1(0)) == -1) {
+		error = errno;
+		goto fail;
+	}
+
+	for (; connected < sim->n; ++connected) {
+		struct net_client *c = &sim->clients[connected];
+		struct epoll_event e;
+
+		if ((error = net_client_init(c, &sim->pools[connected], "127.0.0.1", sim->port)))
+			goto fail;
+
+		c->applied = sim_applied;
+		c->arg = sim;
+
+		e.events = EPOLLIN;
+		e.data.ptr = c;
+
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &e)) {
+			error = errno;
+			++connected;
+			goto fail;
+		}
+	}
+
+	for (;;) {
+		uint32_t target = __atomic_load_n(&sim->target, __ATOMIC_ACQUIRE);
+		unsigned i, ready = 0;
+		int n;
+
+		for (i = 0; i < sim->n; ++i)
+			ready += sim->clients[i].ready;
+
+		__atomic_store_n(&sim->ready, ready, __ATOMIC_RELEASE);
+
+		if (target) {
+			for (i = 0; i < sim->n && sim->clients[i].ready && sim->clients[i].tick + 1 >= target; ++i)
+				;
+
+			if (i == sim->n) {
+				for (i = 0; i < sim->n; ++i)
+					if (sim_compare(sim->server, &sim->pools[i], sim->buf, sim->tmp))
+						++sim->differ;
+				break;
+			}
+		}
+
+		if ((n = epoll_wait(epfd, ev, 64, 10)) == -1 && errno != EINTR) {
+			error = errno;
+			goto fail;
+		}
+
+		for (int j = 0; j < n; ++j)
+			if ((error = net_client_poll(ev[j].data.ptr)))
+				goto fail;
+	}
+fail:
+	while (connected)
+		net_client_free(&sim->clients[--connected]);
+
+	if (epfd != -1)
+		close(epfd);
+
+	sim->error = error;
+	__atomic_store_n(&sim->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/*
+ * Serve a generated world to 1 up to 64 clients on loopback, while each tick
+ * changes random cells near the origin and fills a small box. Reports bytes
+ * per tick and the time from sending a delta until a client has applied it.
+ * All clients must end up with the same world as the server.
+ */
+static int bench_net(unsigned size, double *samples)
+{
+	static const unsigned counts[] = {1, 4, 16, 64};
+	const struct timespec ts = {0, 1000000000 / BENCH_NET_RATE};
+	size_t n = (size_t)8 * BENCH_REGION * BENCH_REGION * BENCH_REGION;
+	block_t *buf = NULL, *tmp = NULL;
+	struct net_server s;
+	struct ot_pool o;
+	int error;
+
+	if (size > BENCH_NET_MAX)
+		return 0;
+
+	if ((error = ot_init(&o, OT_CAP, OT_RCAP, size)))
+		return error;
+
+	if ((error = gen_world(&o, BENCH_SEED, 1)) || (error = net_server_init(&s, &o, 0)))
+		goto fail;
+
+	bench_server = &s;
+	o.touch = bench_touch;
+
+	if (!(buf = malloc(n * sizeof *buf)) || !(tmp = malloc(n * sizeof *tmp))) {
+		error = ENOMEM;
+		goto fail_server;
+	}
+
+	for (unsigned k = 0; k < ARRAY_SIZE(counts); ++k) {
+		unsigned clients = counts[k];
+		struct net_sim sim;
+		uint64_t bytes;
+		uint32_t last = 0;
+		pthread_t tid;
+		char name[64];
+
+		memset(&sim, 0, sizeof sim);
+		sim.n = clients;
+		sim.port = s.port;
+		sim.server = &o;
+		sim.buf = buf;
+		sim.tmp = tmp;
+		sim.samples = samples;
+		sim.cap = BENCH_SAMPLES;
+		sim.clients = calloc(clients, sizeof *sim.clients);
+		sim.pools = calloc(clients, sizeof *sim.pools);
+
+		if (!sim.clients || !sim.pools || (error = pthread_create(&tid, NULL, sim_main, &sim))) {
+			free(sim.pools);
+			free(sim.clients);
+			error = error ? error : ENOMEM;
+			goto fail_server;
+		}
+
+		// everyone has a snapshot before the ticks start
+		while (__atomic_load_n(&sim.ready, __ATOMIC_ACQUIRE) < clients && !__atomic_load_n(&sim.done, __ATOMIC_ACQUIRE)) {
+			net_server_poll(&s);
+			nanosleep(&ts, NULL);
+		}
+
+		bytes = s.stats.bytes;
+
+		for (unsigned t = 0; !error && t < BENCH_NET_TICKS; ++t) {
+			int min[3], max[3];
+
+			if ((error = net_server_poll(&s)))
+				break;
+
+			for (unsigned i = 0; !error && i < BENCH_NET_EDITS; ++i) {
+				int x = (int)(rnd() % (2 * BENCH_REGION)) - BENCH_REGION;
+				int y = (int)(rnd() % (2 * BENCH_REGION)) - BENCH_REGION;
+				int z = (int)(rnd() % (2 * BENCH_REGION)) - BENCH_REGION;
+
+				error = ot_set_cell(&o, x, y, z, (block_t)(rnd() % 3));
+			}
+
+			for (unsigned i = 0; i < 3; ++i) {
+				min[i] = (int)(rnd() % (2 * BENCH_REGION - BENCH_NET_BOX)) - BENCH_REGION;
+				max[i] = min[i] + BENCH_NET_BOX;
+			}
+
+			if (error || (error = ot_fill_box(&o, min, max, (block_t)(rnd() % 3))))
+				break;
+
+			last = s.tick;
+			error = net_server_flush(&s);
+			nanosleep(&ts, NULL);
+		}
+
+		if (!error)
+			report(size, (snprintf(name, sizeof name, "net_%u_bytes_per_tick", clients), name), (double)(s.stats.bytes - bytes) / BENCH_NET_TICKS);
+
+		// let the clients catch up, or give up on them if something failed
+		__atomic_store_n(&sim.target, error ? UINT32_MAX : last + 1, __ATOMIC_RELEASE);
+
+		while (!__atomic_load_n(&sim.done, __ATOMIC_ACQUIRE)) {
+			net_server_poll(&s);
+			net_server_flush(&s);
+			nanosleep(&ts, NULL);
+		}
+
+		pthread_join(tid, NULL);
+
+		if (!error && !(error = sim.error)) {
+			if (sim.differ) {
+				fprintf(stderr, "bench: root size %u: %u of %u clients differ from server\n", size, sim.differ, clients);
+				error = EINVAL;
+			}
+
+			snprintf(name, sizeof name, "net_%u_latency", clients);
+			if (sim.nsamples)
+				report_latency(size, name, samples, sim.nsamples);
+		}
+
+		free(sim.pools);
+		free(sim.clients);
+
+		if (error)
+			goto fail_server;
+
+		// let the server notice that everyone has left
+		while (s.npeers) {
+			net_server_poll(&s);
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	{
+		unsigned char *data;
+		size_t len;
+
+		if (!(error = ot_encode(&o, &data, &len))) {
+			report(size, "net_snapshot_bytes", len);
+			free(data);
+		}
+	}
+fail_server:
+	net_server_free(&s);
+fail:
+	free(tmp);
+	free(buf);
+	ot_free(&o);
+	return error;
+}
+
+/* Latest snapshot of the writer, which readers take a reference to. */
+struct snap_bench {
+	pthread_mutex_t lock;
+	struct ot_snap *current;
+	int half, stop;
+};
+
+struct snap_reader {
+	struct snap_bench *b;
+	pthread_t tid;
+	uint64_t seed;
+	unsigned long reads, snaps;
+	int error;
+};
+
+static void *snap_read(void *arg)
+{
+	struct snap_reader *r = arg;
+	struct snap_bench *b = r->b;
+	int min[3] = {-BENCH_REGION, -BENCH_REGION, -BENCH_REGION}, max[3] = {BENCH_REGION, BENCH_REGION, BENCH_REGION};
+	size_t n = (size_t)8 * BENCH_REGION * BENCH_REGION * BENCH_REGION;
+	block_t *before, *after;
+	unsigned long sum = 0;
+
+	before = malloc(n * sizeof *before);
+	after = malloc(n * sizeof *after);
+
+	if (!before || !after) {
+		r->error = ENOMEM;
+		goto fail;
+	}
+
+	while (!__atomic_load_n(&b->stop, __ATOMIC_ACQUIRE)) {
+		struct ot_snap *s;
+
+		pthread_mutex_lock(&b->lock);
+		if ((s = b->current))
+			ot_snap_ref(s);
+		pthread_mutex_unlock(&b->lock);
+
+		if (!s) {
+			sched_yield();
+			continue;
+		}
+
+		// the writer edits the same region all the time, but the snapshot must not see it
+		ot_get_box(&s->ot, min, max, before);
+
+		for (unsigned i = 0; i < BENCH_SNAP_READS; ++i) {
+			uint32_t v;
+
+			// xorshift64*, rnd is not thread safe
+			r->seed ^= r->seed >> 12;
+			r->seed ^= r->seed << 25;
+			r->seed ^= r->seed >> 27;
+			v = (uint32_t)((r->seed * 0x2545f4914f6cdd1dULL) >> 32);
+
+			sum += ot_get_cell(&s->ot, (int)(v & 0x3ff) % (2 * b->half) - b->half,
+				(int)(v >> 10 & 0x3ff) % (2 * b->half) - b->half, (int)(v >> 20 & 0x3ff) % (2 * b->half) - b->half);
+		}
+
+		ot_get_box(&s->ot, min, max, after);
+		ot_snap_release(s);
+
+		if (memcmp(before, after, n * sizeof *before)) {
+			r->error = EINVAL;
+			break;
+		}
+
+		r->reads += BENCH_SNAP_READS;
+		++r->snaps;
+	}
+
+	// keep the reads from being optimised away
+	r->seed += sum;
+fail:
+	free(after);
+	free(before);
+	return NULL;
+}
+
+/* Change random cells around the origin and elsewhere in the world, like a game tick would. */
+static int snap_edits(struct ot_pool *o, unsigned size)
+{
+	int half = (int)(size >> 1), error;
+
+	for (unsigned i = 0; i < BENCH_SNAP_EDITS; ++i) {
+		int x, y, z;
+
+		if (i & 1) {
+			x = (int)(rnd() % (2 * BENCH_REGION)) - BENCH_REGION;
+			y = (int)(rnd() % (2 * BENCH_REGION)) - BENCH_REGION;
+			z = (int)(rnd() % (2 * BENCH_REGION)) - BENCH_REGION;
+		} else {
+			x = (int)(rnd() % size) - half;
+			y = (int)(rnd() % size) - half;
+			z = (int)(rnd() % size) - half;
+		}
+
+		if ((error = ot_set_cell(o, x, y, z, (block_t)(rnd() % 3))))
+			return error;
+	}
+
+	return 0;
+}
+
+/*
+ * A writer that changes cells and takes a snapshot after each tick, while 0 up
+ * to 3 reader threads keep reading the newest one. Reports the time to take a
+ * snapshot, edits and reads per second and how many groups and arrays were
+ * waiting for readers at most. Readers check that their snapshot never
+ * changes, even though the writer edits the cells they look at.
+ */
+static int bench_snap(unsigned size, double *samples)
+{
+	static const unsigned counts[] = {0, 1, 3};
+	struct snap_reader readers[3];
+	struct snap_bench b;
+	struct ot_pool o;
+	char name[64];
+	double t0;
+	int error;
+
+	if (size > BENCH_SNAP_MAX)
+		return 0;
+
+	if ((error = ot_init(&o, OT_CAP, OT_RCAP, size)))
+		return error;
+
+	if ((error = gen_world(&o, BENCH_SEED, 1)) || (error = pthread_mutex_init(&b.lock, NULL)))
+		goto fail;
+
+	b.half = (int)(size >> 1);
+
+	// same edits without any snapshot to compare with
+	t0 = now();
+
+	for (unsigned t = 0; t < BENCH_SNAP_TICKS; ++t)
+		if ((error = snap_edits(&o, size)))
+			goto fail_lock;
+
+	report(size, "snap_off_edits_per_s", BENCH_SNAP_TICKS * BENCH_SNAP_EDITS / (now() - t0));
+
+	for (unsigned k = 0; k < ARRAY_SIZE(counts); ++k) {
+		unsigned long reads = 0, snaps = 0;
+		size_t retired = 0;
+		unsigned started;
+
+		b.current = NULL;
+		b.stop = 0;
+
+		for (started = 0; started < counts[k]; ++started) {
+			struct snap_reader *r = &readers[started];
+
+			memset(r, 0, sizeof *r);
+			r->b = &b;
+			r->seed = seed + started + 1;
+
+			if ((error = pthread_create(&r->tid, NULL, snap_read, r)))
+				break;
+		}
+
+		t0 = now();
+
+		for (unsigned t = 0; !error && t < BENCH_SNAP_TICKS; ++t) {
+			struct ot_snap *s, *old;
+			double t1;
+
+			if ((error = snap_edits(&o, size)))
+				break;
+
+			t1 = now();
+			error = ot_snapshot(&o, &s);
+			samples[t] = now() - t1;
+
+			if (error)
+				break;
+
+			pthread_mutex_lock(&b.lock);
+			old = b.current;
+			b.current = s;
+			pthread_mutex_unlock(&b.lock);
+
+			if (old)
+				ot_snap_release(old);
+
+			if (o.nretired > retired)
+				retired = o.nretired;
+		}
+
+		t0 = now() - t0;
+
+		__atomic_store_n(&b.stop, 1, __ATOMIC_RELEASE);
+
+		while (started) {
+			struct snap_reader *r = &readers[--started];
+
+			pthread_join(r->tid, NULL);
+
+			if (!error)
+				error = r->error;
+
+			reads += r->reads;
+			snaps += r->snaps;
+		}
+
+		if (b.current)
+			ot_snap_release(b.current);
+
+		// everything should be back on the free list
+		ot_reclaim(&o);
+
+		if (!error && (o.snaps || o.nretired)) {
+			fprintf(stderr, "bench: root size %u: %zu retired after all snapshots are gone\n", size, o.nretired);
+			error = EINVAL;
+		}
+
+		if (error)
+			goto fail_lock;
+
+		snprintf(name, sizeof name, "snap_%u_create", counts[k]);
+		report_latency(size, name, samples, BENCH_SNAP_TICKS);
+		snprintf(name, sizeof name, "snap_%u_edits_per_s", counts[k]);
+		report(size, name, BENCH_SNAP_TICKS * BENCH_SNAP_EDITS / t0);
+		snprintf(name, sizeof name, "snap_%u_retired_peak", counts[k]);
+		report(size, name, retired);
+
+		if (counts[k]) {
+			snprintf(name, sizeof name, "snap_%u_reads_per_s", counts[k]);
+			report(size, name, reads / t0);
+			snprintf(name, sizeof name, "snap_%u_snapshots_read", counts[k]);
+			report(size, name, snaps);
+		}
+	}
+fail_lock:
+	pthread_mutex_destroy(&b.lock);
+fail:
+	ot_free(&o);
+	return error;
+}
+
+static int bench(unsigned size, struct ot_cell *cells, double *samples)
+{
+	struct ot_pool o;
+	int error;
+
+	if ((error = ot_init(&o, OT_CAP, OT_RCAP, size)))
+		return error;
+
+	if ((error = bench_seq(&o, size)) || (error = bench_rand(&o, size, cells, samples))) {
+		ot_free(&o);
+		return error;
+	}
+
+	ot_free(&o);
+
+	if ((error = bench_split(size)) || (error = bench_batch(size, cells)) || (error = bench_mesh(size)) || (error = bench_gen(size))
+		|| (error = bench_grow(size, cells)) || (error = bench_stream(size, samples)) || (error = bench_net(size, samples))
+		|| (error = bench_snap(size, samples)))
+		return error;
+
+	return bench_world(size, cells);
+}
+
+int main(int argc, char **argv)
+{
+	struct ot_cell *cells;
+	double *samples;
+	int error = 1;
+
+	cells = malloc(BENCH_BATCH * BENCH_BATCHES * sizeof *cells);
+	samples = malloc(BENCH_SAMPLES * sizeof *samples);
+
+	if (!cells || !samples || BENCH_SETS > BENCH_BATCH * BENCH_BATCHES) {
+		fputs("bench: out of memory\n", stderr);
+		goto fail;
+	}
+
+	calibrate();
+	puts("root_size,metric,value");
+
+	// compare loading against replaying inserts at every size, see bench_world
+	if (argc > 1 && !strcmp(argv[1], "--replay")) {
+		replay_max = BENCH_WORLD_MAX;
+		--argc;
+		++argv;
+	}
+
+	if (argc > 1) {
+		for (int i = 1; i < argc; ++i) {
+			unsigned size = (unsigned)strtoul(argv[i], NULL, 0);
+
+			if (size < BENCH_REGION || (size & (size - 1)) || size > OT_SIZE_MAX) {
+				fprintf(stderr, "bench: bad root size: %s\n", argv[i]);
+				goto fail;
+			}
+
+			if ((error = bench(size, cells, samples))) {
+				fprintf(stderr, "bench: root size %u: %s\n", size, strerror(error));
+				goto fail;
+			}
+		}
+	} else {
+		for (unsigned i = 0; i < ARRAY_SIZE(sizes); ++i)
+			if ((error = bench(sizes[i], cells, samples))) {
+				fprintf(stderr, "bench: root size %u: %s\n", sizes[i], strerror(error));
+				goto fail;
+			}
+	}
+
+	error = 0;
+fail:
+	free(samples);
+	free(cells);
+	return error;
+}
@@ -0,0 +1,354 @@
+/*
+ * Hash-consed octree.
+ *
+ * Made by Folkert van Verseveld
+ *
+ * Copyright Folkert van Verseveld. All rights reserved.
+ *
+ * Every node is unique: before a node is created, the hash table is checked
+ * for a node with the same slots and that one is shared instead. Nodes whose
+ * octants all hold the same block id are never created, the parent stores the
+ * id directly. Reference counts keep track of sharing, so a write only costs
+ * one path of new nodes and the old path is released right away.
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dag.h"
+#include "dbg.h"
+
+// node indices may not collide with DAG_LEAF or DAG_NIL
+#define DAG_MAXCAP ((size_t)DAG_LEAF < SIZE_MAX / sizeof(struct ot_dnode) ? (size_t)DAG_LEAF : SIZE_MAX / sizeof(struct ot_dnode))
+
+// deepest path from the root to a cell, see OT_SIZE_MAX
+#define DAG_DEPTH 21
+
+static inline int slot_leaf(uint32_t slot)
+{
+	return (slot & DAG_LEAF) != 0;
+}
+
+static uint32_t slots_hash(const uint32_t slots[8])
+{
+	uint64_t h = 0x9e3779b97f4a7c15u;
+
+	for (unsigned i = 0; i < 8; ++i) {
+		h ^= slots[i];
+		h *= 0xff51afd7ed558ccdu;
+		h ^= h >> 32;
+	}
+
+	return (uint32_t)h;
+}
+
+int ot_dag_init(struct ot_dag *d, size_t cap, unsigned size)
+{
+	if (!cap || cap > DAG_MAXCAP || size < 2 || size > OT_SIZE_MAX || (size & (size - 1)))
+		return EINVAL;
+
+	if (!(d->nodes = malloc(cap * sizeof *d->nodes)))
+		return ENOMEM;
+
+	d->nbuckets = 1;
+	while (d->nbuckets < cap)
+		d->nbuckets <<= 1;
+
+	if (!(d->buckets = malloc(d->nbuckets * sizeof *d->buckets))) {
+		free(d->nodes);
+		return ENOMEM;
+	}
+
+	memset(d->buckets, 0xff, d->nbuckets * sizeof *d->buckets);
+
+	d->count = d->live = 0;
+	d->cap = cap;
+	d->free = DAG_NIL;
+	d->root = DAG_LEAF | ID_AIR;
+	d->blocks = 0;
+	d->root_size = size;
+
+	return 0;
+}
+
+void ot_dag_free(struct ot_dag *d)
+{
+	free(d->buckets);
+	free(d->nodes);
+}
+
+/* Double the number of hash chains and redistribute all nodes. */
+static int dag_rehash(struct ot_dag *d)
+{
+	size_t n = d->nbuckets << 1;
+	uint32_t *buckets;
+
+	if (!(buckets = malloc(n * sizeof *buckets)))
+		return ENOMEM;
+
+	memset(buckets, 0xff, n * sizeof *buckets);
+
+	for (size_t i = 0; i < d->count; ++i) {
+		struct ot_dnode *node = &d->nodes[i];
+		size_t b;
+
+		if (!node->refs)
+			continue;
+
+		b = slots_hash(node->slots) & (n - 1);
+		node->next = buckets[b];
+		buckets[b] = (uint32_t)i;
+	}
+
+	free(d->buckets);
+	d->buckets = buckets;
+	d->nbuckets = n;
+	return 0;
+}
+
+static inline void dag_ref(struct ot_dag *d, uint32_t slot)
+{
+	if (!slot_leaf(slot))
+		++d->nodes[slot].refs;
+}
+
+/* Drop a reference to slot and free everything that is no longer used. */
+static void dag_unref(struct ot_dag *d, uint32_t slot)
+{
+	struct ot_dnode *node;
+	uint32_t *p;
+
+	if (slot_leaf(slot) || --d->nodes[slot].refs)
+		return;
+
+	node = &d->nodes[slot];
+
+	for (p = &d->buckets[slots_hash(node->slots) & (d->nbuckets - 1)]; *p != slot; p = &d->nodes[*p].next)
+		assert(*p != DAG_NIL);
+
+	*p = node->next;
+
+	for (unsigned i = 0; i < 8; ++i)
+		dag_unref(d, node->slots[i]);
+
+	d->nodes[slot].next = d->free;
+	d->free = slot;
+	--d->live;
+}
+
+/*
+ * Return slot for node with the specified slots. The caller hands over one
+ * reference to each slot and gets one reference to the result.
+ */
+static int dag_cons(struct ot_dag *d, const uint32_t slots[8], uint32_t *slot)
+{
+	uint32_t h, i;
+
+	// octants that are all filled with the same id don't need a node
+	if (slot_leaf(slots[0])) {
+		for (i = 1; i < 8 && slots[i] == slots[0]; ++i)
+			;
+
+		if (i == 8) {
+			*slot = slots[0];
+			return 0;
+		}
+	}
+
+	h = slots_hash(slots);
+
+	for (i = d->buckets[h & (d->nbuckets - 1)]; i != DAG_NIL; i = d->nodes[i].next)
+		if (!memcmp(d->nodes[i].slots, slots, sizeof d->nodes[i].slots)) {
+			++d->nodes[i].refs;
+
+			// the existing node already holds a reference to each slot
+			for (unsigned j = 0; j < 8; ++j)
+				dag_unref(d, slots[j]);
+
+			*slot = i;
+			return 0;
+		}
+
+	if (d->free != DAG_NIL) {
+		i = d->free;
+		d->free = d->nodes[i].next;
+	} else {
+		if (d->count == d->cap) {
+			size_t cap = d->cap > DAG_MAXCAP >> 1 ? DAG_MAXCAP : d->cap << 1;
+			struct ot_dnode *nodes;
+
+			if (d->cap >= DAG_MAXCAP)
+				return EOVERFLOW;
+
+			if (!(nodes = realloc(d->nodes, cap * sizeof *nodes)))
+				return ENOMEM;
+
+			d->nodes = nodes;
+			d->cap = cap;
+		}
+
+		i = (uint32_t)d->count++;
+	}
+
+	memcpy(d->nodes[i].slots, slots, sizeof d->nodes[i].slots);
+	d->nodes[i].refs = 1;
+	d->nodes[i].next = d->buckets[h & (d->nbuckets - 1)];
+	d->buckets[h & (d->nbuckets - 1)] = i;
+
+	// keep chains short, chains just get longer if there is no memory for it
+	if (++d->live > d->nbuckets)
+		dag_rehash(d);
+
+	*slot = i;
+	return 0;
+}
+
+static int dag_build_node(struct ot_dag *d, const struct ot_pool *o, const struct ot_node *n, uint32_t *slot)
+{
+	uint32_t slots[8];
+	unsigned i;
+	int error = 0;
+
+	if ((n->type & ONT_TYPE_MASK) != ONT_SPLIT) {
+		for (i = 0; i < 8; ++i)
+			slots[i] = DAG_LEAF | n->data.cells[i];
+
+		return dag_cons(d, slots, slot);
+	}
+
+	for (i = 0; i < 8; ++i)
+		if ((error = dag_build_node(d, o, &ot_children(o, n)[i], &slots[i])))
+			break;
+
+	if (error) {
+		while (i)
+			dag_unref(d, slots[--i]);
+
+		return error;
+	}
+
+	return dag_cons(d, slots, slot);
+}
+
+/* Initialise d with a deduplicated copy of o. */
+int ot_dag_build(struct ot_dag *d, const struct ot_pool *o)
+{
+	size_t groups = (o->count >> 3) - o->rcount;
+	uint32_t root;
+	int error;
+
+	// duplicates are common, so start with a fraction of the nodes in o
+	if ((error = ot_dag_init(d, groups > 64 ? groups / 8 : 8, o->root_size)))
+		return error;
+
+	if ((error = dag_build_node(d, o, &o->nodes[o->root], &root))) {
+		ot_dag_free(d);
+		return error;
+	}
+
+	d->root = root;
+	d->blocks = o->blocks;
+	return 0;
+}
+
+block_t ot_dag_get_cell(const struct ot_dag *d, int x, int y, int z)
+{
+	int size = (int)(d->root_size >> 1);
+
+	if (z < -size || y < -size || x < -size || z >= size || y >= size || x >= size)
+		return ID_AIR;
+
+	// walk with unsigned offsets from the lower corner, bit per level
+	unsigned ux = (unsigned)(x + size), uy = (unsigned)(y + size), uz = (unsigned)(z + size);
+	unsigned shift = 0;
+	uint32_t slot = d->root;
+
+	while ((1u << shift) < d->root_size)
+		++shift;
+
+	while (!slot_leaf(slot)) {
+		--shift;
+
+		unsigned pos = (((uz >> shift) & 1) << 2) | (((uy >> shift) & 1) << 1) | ((ux >> shift) & 1);
+
+		slot = d->nodes[slot].slots[pos];
+	}
+
+	return (block_t)slot;
+}
+
+int ot_dag_set_cell(struct ot_dag *d, int x, int y, int z, block_t id)
+{
+	int size = (int)(d->root_size >> 1);
+
+	if (z < -size || y < -size || x < -size || z >= size || y >= size || x >= size)
+		return ERANGE;
+
+	uint32_t path[DAG_DEPTH][8], slot = d->root;
+	unsigned ux = (unsigned)(x + size), uy = (unsigned)(y + size), uz = (unsigned)(z + size);
+	unsigned pos[DAG_DEPTH], depth = 0, shift = 0;
+	block_t old;
+	int error;
+
+	while ((1u << shift) < d->root_size)
+		++shift;
+
+	// copy the slots of each node down to the cell, uniform octants are expanded on the way
+	while (shift) {
+		--shift;
+
+		if (slot_leaf(slot)) {
+			if (slot == (DAG_LEAF | id))
+				return 0;
+
+			for (unsigned i = 0; i < 8; ++i)
+				path[depth][i] = slot;
+		} else {
+			memcpy(path[depth], d->nodes[slot].slots, sizeof path[depth]);
+		}
+
+		pos[depth] = (((uz >> shift) & 1) << 2) | (((uy >> shift) & 1) << 1) | ((ux >> shift) & 1);
+		slot = path[depth][pos[depth]];
+		++depth;
+	}
+
+	old = (block_t)slot;
+	if (old == id)
+		return 0;
+
+	// build the new path bottom up, siblings are shared with the old path
+	slot = DAG_LEAF | id;
+
+	while (depth) {
+		--depth;
+		path[depth][pos[depth]] = slot;
+
+		for (unsigned i = 0; i < 8; ++i)
+			if (i != pos[depth])
+				dag_ref(d, path[depth][i]);
+
+		if ((error = dag_cons(d, path[depth], &slot))) {
+			// dag_cons only fails before it takes over the references
+			for (unsigned i = 0; i < 8; ++i)
+				dag_unref(d, path[depth][i]);
+
+			return error;
+		}
+	}
+
+	dag_unref(d, d->root);
+	d->root = slot;
+
+	if (old == ID_AIR)
+		++d->blocks;
+	else if (id == ID_AIR)
+		--d->blocks;
+
+	return 0;
+}
+
+/* Number of bytes taken by nodes in use and the hash table. */
+size_t ot_dag_bytes(const struct ot_dag *d)
+{
+	return d->live * sizeof *d->nodes + d->nbuckets * sizeof *d->buckets;
+}
@@ -0,0 +1,61 @@
+#ifndef DAG_H
+#define DAG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ot.h"
+
+// slot holds a block id that fills the whole octant instead of a node index
+#define DAG_LEAF 0x80000000u
+#define DAG_NIL UINT32_MAX
+
+#define DAG_CAP 1024
+
+/*
+ * Node of a sparse voxel DAG. Each octant either refers to another node or is
+ * filled with a single block id. Octants of a node at the bottom level are
+ * always block ids, so a node never describes less than 2x2x2 blocks.
+ */
+struct ot_dnode {
+	uint32_t slots[8];
+	// number of slots and roots that refer to this node, 0 if free
+	uint32_t refs;
+	// next node in hash chain or free list
+	uint32_t next;
+};
+
+/*
+ * Octree where identical subtrees are stored once (hash consing). Nodes are
+ * immutable once created: writes copy the path from the changed cell to the
+ * root and nodes are freed as soon as nothing refers to them anymore.
+ *
+ * Shared nodes have many parents, so unlike ot_pool there is no parent, dirty
+ * or representative bookkeeping. It is meant to store big worlds compactly.
+ */
+struct ot_dag {
+	struct ot_dnode *nodes;
+	size_t count, cap;
+	// number of nodes in use
+	size_t live;
+	uint32_t free;
+	// hash chains of all nodes in use, the number of buckets is a power of 2
+	uint32_t *buckets;
+	size_t nbuckets;
+	// slot of the root node
+	uint32_t root;
+	size_t blocks;
+	unsigned root_size;
+};
+
+int ot_dag_init(struct ot_dag *d, size_t cap, unsigned size);
+void ot_dag_free(struct ot_dag *d);
+
+int ot_dag_build(struct ot_dag *d, const struct ot_pool *o);
+
+block_t ot_dag_get_cell(const struct ot_dag *d, int x, int y, int z);
+int ot_dag_set_cell(struct ot_dag *d, int x, int y, int z, block_t id);
+
+size_t ot_dag_bytes(const struct ot_dag *d);
+
+#endif
@@ -0,0 +1,306 @@
+/*
+ * Procedural terrain generator.
+ *
+ * Made by Folkert van Verseveld
+ *
+ * Copyright Folkert van Verseveld. All rights reserved.
+ *
+ * The world is cut into cubes that are generated independently by a pool of
+ * threads. Each thread fills a dense buffer for its cube and hands it to the
+ * octree with ot_set_box, which is the only part that needs the lock. Rows of
+ * noise are computed with plain loops over arrays without branches, so the
+ * compiler can vectorise them.
+ */
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dbg.h"
+#include "gen.h"
+#include "trace.h"
+
+// cells below the surface where the cave noise exceeds this are air
+#define GEN_CAVE 0.72f
+
+struct gen {
+	struct ot_pool *o;
+	uint32_t seed;
+	// world coordinates of cell (0,0,0) in o
+	int off[3];
+	// edge of a region in blocks and number of regions along each axis
+	unsigned region, regions;
+	// height difference between the lowest and highest possible surface
+	int amp;
+	// next region to generate, shared by all threads
+	unsigned next;
+	// protects o and error
+	pthread_mutex_t lock;
+	int error;
+};
+
+/* Scratch space of one thread. */
+struct gen_scratch {
+	block_t *buf;
+	int *heights, *top;
+	// noise of one row and the lattice values along it
+	float *row, *lat;
+};
+
+static inline uint32_t gen_hash(uint32_t seed, int x, int y, int z)
+{
+	uint32_t h = seed ^ (uint32_t)x * 0x8da6b343u ^ (uint32_t)y * 0xd8163841u ^ (uint32_t)z * 0xcb1ab31fu;
+
+	h ^= h >> 15;
+	h *= 0x2c1b3c6du;
+	h ^= h >> 12;
+	return h;
+}
+
+static inline float gen_value(uint32_t h)
+{
+	return (float)(h >> 8) * (1.0f / 16777216);
+}
+
+static inline float smooth(float t)
+{
+	return t * t * (3 - 2 * t);
+}
+
+/*
+ * Add amp times value noise with lattice spacing 1 << shift to n cells along
+ * x. The lattice is interpolated along the other axes first, which leaves one
+ * value per lattice point on the row. The loop over the cells then only blends
+ * two of those and has no branches or calls, so it is cheap and vectorises.
+ * Lattice coordinates are found with shifts, which floor negative numbers too.
+ */
+static void noise2_row(float *out, float *lat, unsigned n, int x, int y, unsigned shift, float amp, uint32_t seed)
+{
+	int mask = (1 << shift) - 1, x0 = x >> shift, yi = y >> shift;
+	int count = ((x + (int)n - 1) >> shift) - x0 + 2;
+	float inv = 1.0f / (float)(1 << shift), fy = smooth((float)(y & mask) * inv);
+
+	for (int k = 0; k < count; ++k) {
+		float v0 = gen_value(gen_hash(seed, x0 + k, yi, 0)), v1 = gen_value(gen_hash(seed, x0 + k, yi + 1, 0));
+
+		lat[k] = v0 + (v1 - v0) * fy;
+	}
+
+	for (unsigned i = 0; i < n; ++i) {
+		int xx = x + (int)i, k = (xx >> shift) - x0;
+		float fx = smooth((float)(xx & mask) * inv);
+
+		out[i] += amp * (lat[k] + (lat[k + 1] - lat[k]) * fx);
+	}
+}
+
+static void noise3_row(float *out, float *lat, unsigned n, int x, int y, int z, unsigned shift, float amp, uint32_t seed)
+{
+	int mask = (1 << shift) - 1, x0 = x >> shift, yi = y >> shift, zi = z >> shift;
+	int count = ((x + (int)n - 1) >> shift) - x0 + 2;
+	float inv = 1.0f / (float)(1 << shift);
+	float fy = smooth((float)(y & mask) * inv), fz = smooth((float)(z & mask) * inv);
+
+	for (int k = 0; k < count; ++k) {
+		float v00 = gen_value(gen_hash(seed, x0 + k, yi, zi)), v10 = gen_value(gen_hash(seed, x0 + k, yi + 1, zi));
+		float v01 = gen_value(gen_hash(seed, x0 + k, yi, zi + 1)), v11 = gen_value(gen_hash(seed, x0 + k, yi + 1, zi + 1));
+		float a = v00 + (v10 - v00) * fy, b = v01 + (v11 - v01) * fy;
+
+		lat[k] = a + (b - a) * fz;
+	}
+
+	for (unsigned i = 0; i < n; ++i) {
+		int xx = x + (int)i, k = (xx >> shift) - x0;
+		float fx = smooth((float)(xx & mask) * inv);
+
+		out[i] += amp * (lat[k] + (lat[k + 1] - lat[k]) * fx);
+	}
+}
+
+/* Fill the region at pos: stone below the surface, grass on top and caves here and there. */
+static int gen_region(struct gen *g, struct gen_scratch *s, const int pos[3])
+{
+	unsigned n = g->region;
+	int min[3] = {pos[0], pos[1], pos[2]};
+	int max[3] = {pos[0] + (int)n, pos[1] + (int)n, pos[2] + (int)n};
+	// noise is sampled in world coordinates, so neighbouring areas line up
+	int wx = pos[0] + g->off[0], wy = pos[1] + g->off[1], wz = pos[2] + g->off[2];
+	int top = INT_MIN, error;
+	block_t *out = s->buf;
+
+	for (unsigned y = 0; y < n; ++y) {
+		int *h = &s->heights[y * n];
+
+		memset(s->row, 0, n * sizeof *s->row);
+
+		// weights add up to 1
+		noise2_row(s->row, s->lat, n, wx, wy + (int)y, 7, 0.5f, g->seed);
+		noise2_row(s->row, s->lat, n, wx, wy + (int)y, 6, 0.25f, g->seed + 1);
+		noise2_row(s->row, s->lat, n, wx, wy + (int)y, 5, 0.125f, g->seed + 2);
+		noise2_row(s->row, s->lat, n, wx, wy + (int)y, 4, 0.125f, g->seed + 3);
+
+		for (unsigned x = 0; x < n; ++x)
+			h[x] = (int)((s->row[x] - 0.5f) * (float)g->amp);
+
+		s->top[y] = INT_MIN;
+
+		for (unsigned x = 0; x < n; ++x)
+			if (h[x] > s->top[y])
+				s->top[y] = h[x];
+
+		if (s->top[y] > top)
+			top = s->top[y];
+	}
+
+	// nothing but air
+	if (wz >= top) {
+		pthread_mutex_lock(&g->lock);
+		error = ot_fill_box(g->o, min, max, ID_AIR);
+		pthread_mutex_unlock(&g->lock);
+		return error;
+	}
+
+	for (unsigned z = 0; z < n; ++z) {
+		int zz = wz + (int)z;
+
+		for (unsigned y = 0; y < n; ++y, out += n) {
+			const int *h = &s->heights[y * n];
+
+			if (zz >= s->top[y]) {
+				memset(out, 0, n * sizeof *out);
+				continue;
+			}
+
+			memset(s->row, 0, n * sizeof *s->row);
+			noise3_row(s->row, s->lat, n, wx, wy + (int)y, zz, 4, 0.65f, g->seed + 4);
+			noise3_row(s->row, s->lat, n, wx, wy + (int)y, zz, 3, 0.35f, g->seed + 5);
+
+			for (unsigned x = 0; x < n; ++x) {
+				block_t id = zz == h[x] - 1 ? ID_GRASS : ID_STONE;
+
+				out[x] = zz < h[x] && s->row[x] < GEN_CAVE ? id : ID_AIR;
+			}
+		}
+	}
+
+	pthread_mutex_lock(&g->lock);
+	error = ot_set_box(g->o, min, max, s->buf);
+	pthread_mutex_unlock(&g->lock);
+	return error;
+}
+
+static void *gen_main(void *arg)
+{
+	struct gen *g = arg;
+	struct gen_scratch s;
+	size_t n = g->region, count = (size_t)g->regions * g->regions * g->regions;
+	int half = (int)(g->o->root_size >> 1), error = 0;
+
+	s.buf = malloc(n * n * n * sizeof *s.buf);
+	s.heights = malloc(n * n * sizeof *s.heights);
+	s.top = malloc(n * sizeof *s.top);
+	s.row = malloc(n * sizeof *s.row);
+	// a row crosses at most n + 1 lattice cells
+	s.lat = malloc((n + 2) * sizeof *s.lat);
+
+	if (!s.buf || !s.heights || !s.top || !s.row || !s.lat) {
+		error = ENOMEM;
+		goto fail;
+	}
+
+	for (;;) {
+		size_t i = __atomic_fetch_add(&g->next, 1, __ATOMIC_RELAXED);
+
+		if (i >= count || __atomic_load_n(&g->error, __ATOMIC_RELAXED))
+			break;
+
+		int pos[3] = {
+			(int)(i % g->regions * n) - half,
+			(int)(i / g->regions % g->regions * n) - half,
+			(int)(i / g->regions / g->regions * n) - half,
+		};
+
+		uint64_t t = trace_start();
+
+		error = gen_region(g, &s, pos);
+		trace_span("gen_region", t);
+
+		if (error)
+			break;
+	}
+fail:
+	if (error) {
+		pthread_mutex_lock(&g->lock);
+		if (!g->error)
+			g->error = error;
+		pthread_mutex_unlock(&g->lock);
+	}
+
+	free(s.lat);
+	free(s.row);
+	free(s.top);
+	free(s.heights);
+	free(s.buf);
+	return NULL;
+}
+
+static void *gen_thread(void *arg)
+{
+	trace_thread("gen");
+	return gen_main(arg);
+}
+
+/*
+ * Replace the whole world in o by terrain from seed, where cell (0,0,0) of o
+ * is at off in the world and amp is the height difference between the lowest
+ * and highest surface. Uses threads workers or just the calling thread if
+ * there are none. The same seed always gives the same terrain, no matter how
+ * many threads are used or how the world is cut into areas.
+ */
+int gen_area(struct ot_pool *o, uint32_t seed, const int off[3], int amp, unsigned threads)
+{
+	pthread_t tid[GEN_MAX];
+	struct gen g;
+	unsigned started;
+	int error;
+
+	if (threads > GEN_MAX)
+		threads = GEN_MAX;
+
+	g.o = o;
+	g.seed = seed;
+	g.off[0] = off[0];
+	g.off[1] = off[1];
+	g.off[2] = off[2];
+	g.region = o->root_size < GEN_REGION ? o->root_size : GEN_REGION;
+	g.regions = o->root_size / g.region;
+	g.amp = amp;
+	g.next = 0;
+	g.error = 0;
+
+	if ((error = pthread_mutex_init(&g.lock, NULL)))
+		return error;
+
+	for (started = 0; started < threads; ++started)
+		if ((error = pthread_create(&tid[started], NULL, gen_thread, &g)))
+			break;
+
+	// do the work ourselves if we have no helpers
+	if (!started)
+		gen_main(&g);
+
+	while (started)
+		pthread_join(tid[--started], NULL);
+
+	pthread_mutex_destroy(&g.lock);
+	return g.error ? g.error : 0;
+}
+
+/* Terrain for a world that consists of o only, see gen_area. */
+int gen_world(struct ot_pool *o, uint32_t seed, unsigned threads)
+{
+	const int off[3] = {0, 0, 0};
+
+	return gen_area(o, seed, off, (int)(o->root_size >> 2), threads);
+}
@@ -0,0 +1,16 @@
+#ifndef GEN_H
+#define GEN_H
+
+#include <stdint.h>
+
+#include "ot.h"
+
+// edge of the cubes that are generated as a whole
+#define GEN_REGION 64
+// upper limit for number of worker threads
+#define GEN_MAX 64
+
+int gen_area(struct ot_pool *o, uint32_t seed, const int off[3], int amp, unsigned threads);
+int gen_world(struct ot_pool *o, uint32_t seed, unsigned threads);
+
+#endif
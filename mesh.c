@@ -0,0 +1,678 @@
+/*
+ * Block mesh generation and per-chunk mesh cache.
+ *
+ * Made by Folkert van Verseveld
+ *
+ * Copyright Folkert van Verseveld. All rights reserved.
+ *
+ * Nothing in here talks to OpenGL, the renderer decides what to do with the
+ * vertex data and which buffer belongs to which chunk.
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dbg.h"
+#include "mesh.h"
+
+// slot in cache is in use
+#define MESH_LIVE 0x100
+
+// x, y, z, s, t offsets for each quad of a block
+static const unsigned char faces[6][4][5] = {
+	// z1
+	{{0, 0, 1, 0, 1}, {1, 0, 1, 1, 1}, {1, 1, 1, 1, 0}, {0, 1, 1, 0, 0}},
+	// z0
+	{{0, 1, 0, 0, 1}, {1, 1, 0, 1, 1}, {1, 0, 0, 1, 0}, {0, 0, 0, 0, 0}},
+	// y1
+	{{1, 1, 0, 0, 1}, {0, 1, 0, 1, 1}, {0, 1, 1, 1, 0}, {1, 1, 1, 0, 0}},
+	// y0
+	{{0, 0, 0, 0, 1}, {1, 0, 0, 1, 1}, {1, 0, 1, 1, 0}, {0, 0, 1, 0, 0}},
+	// x1
+	{{1, 0, 1, 0, 0}, {1, 0, 0, 0, 1}, {1, 1, 0, 1, 1}, {1, 1, 1, 1, 0}},
+	// x0
+	{{0, 1, 1, 0, 0}, {0, 1, 0, 0, 1}, {0, 0, 0, 1, 1}, {0, 0, 1, 1, 0}},
+};
+
+// axes along which s and t run on faces perpendicular to the x, y and z axis
+static const unsigned char face_st[3][2] = {{1, 2}, {0, 2}, {0, 1}};
+
+void mesh_init(struct mesh *m)
+{
+	m->data = NULL;
+	m->count = m->cap = 0;
+	m->ranges = NULL;
+	m->nranges = m->rcap = 0;
+	m->cells = NULL;
+	m->cells_cap = 0;
+}
+
+void mesh_free(struct mesh *m)
+{
+	free(m->cells);
+	free(m->ranges);
+	free(m->data);
+}
+
+static int mesh_reserve(struct mesh *m, size_t n)
+{
+	struct mesh_vertex *data;
+	size_t cap;
+
+	if (m->cap - m->count >= n)
+		return 0;
+
+	if (m->count > SIZE_MAX / sizeof *data / 2 - n)
+		return EOVERFLOW;
+
+	for (cap = m->cap ? m->cap : 256; cap - m->count < n;)
+		cap <<= 1;
+
+	if (!(data = realloc(m->data, cap * sizeof *data)))
+		return ENOMEM;
+
+	m->data = data;
+	m->cap = cap;
+	return 0;
+}
+
+/* Add faces in mask of block id with lower corner (x,y,z). */
+int mesh_block(struct mesh *m, unsigned size, int x, int y, int z, block_t id, unsigned mask)
+{
+	struct mesh_vertex *v;
+	int error;
+
+	if (!id || !(mask &= MESH_ALL))
+		return 0;
+
+	if ((error = mesh_reserve(m, 6 * 4)))
+		return error;
+
+	unsigned idx, idy;
+	idx = id % 16;
+	idy = id / 16;
+
+	v = &m->data[m->count];
+
+	for (unsigned i = 0; i < 6; ++i) {
+		if (!(mask & (1 << i)))
+			continue;
+
+		for (unsigned j = 0; j < 4; ++j, ++v) {
+			const unsigned char *f = faces[i][j];
+
+			v->x = (float)x + f[0] * size;
+			v->y = (float)y + f[1] * size;
+			v->z = (float)z + f[2] * size;
+			v->s = (idx + f[3]) / 16.0f;
+			v->t = (idy + f[4]) / 16.0f;
+		}
+	}
+
+	m->count = (size_t)(v - m->data);
+	return 0;
+}
+
+static inline unsigned face_count(unsigned mask)
+{
+	return (unsigned)__builtin_popcount(mask & MESH_ALL);
+}
+
+/*
+ * Determine which faces of the cube with lower corner (x,y,z) touch air. A
+ * face is only culled if the equally sized cube on the other side is solid.
+ */
+static unsigned block_mask(const struct ot_pool *o, unsigned size, int x, int y, int z)
+{
+	int s = (int)size, min[3], max[3];
+	unsigned mask = 0;
+
+	for (unsigned i = 0; i < 6; ++i) {
+		unsigned axis = 2 - i / 2;
+		int d = i & 1 ? -s : s;
+
+		min[0] = x; min[1] = y; min[2] = z;
+		min[axis] += d;
+
+		for (unsigned j = 0; j < 3; ++j)
+			max[j] = min[j] + s;
+
+		if (!ot_box_solid(o, min, max))
+			mask |= 1 << i;
+	}
+
+	return mask;
+}
+
+static int mesh_cube(struct mesh *m, const struct ot_pool *o, unsigned size, int x, int y, int z, block_t id, struct mesh_stats *s)
+{
+	unsigned mask;
+
+	if (!id)
+		return 0;
+
+	mask = block_mask(o, size, x, y, z);
+
+	if (s) {
+		s->faces += face_count(mask);
+		s->culled += 6 - face_count(mask);
+	}
+
+	return mesh_block(m, size, x, y, z, id, mask);
+}
+
+/* Add all visible blocks in subtree n with size and centre (x,y,z). */
+int mesh_node(struct mesh *m, const struct ot_pool *o, const struct ot_node *n, unsigned size, int x, int y, int z, struct mesh_stats *s)
+{
+	const struct ot_node *children;
+	int hsize = (int)(size >> 1), qsize = (int)(size >> 2), error = 0;
+
+	switch (n->type & ONT_TYPE_MASK) {
+	case ONT_CELL:
+		for (unsigned i = 0; i < 8 && !error; ++i)
+			error = mesh_cube(m, o, hsize,
+				x - hsize + (i & 1 ? hsize : 0),
+				y - hsize + (i & 2 ? hsize : 0),
+				z - hsize + (i & 4 ? hsize : 0),
+				n->data.cells[i], s
+			);
+		break;
+	case ONT_UNIFORM:
+		error = mesh_cube(m, o, size, x - hsize, y - hsize, z - hsize, n->data.cells[0], s);
+		break;
+	case ONT_SPLIT:
+		children = ot_children(o, n);
+
+		for (unsigned i = 0; i < 8 && !error; ++i)
+			error = mesh_node(m, o, &children[i], size >> 1,
+				x + (i & 1 ? qsize : -qsize),
+				y + (i & 2 ? qsize : -qsize),
+				z + (i & 4 ? qsize : -qsize),
+				s
+			);
+		break;
+	}
+
+	return error;
+}
+
+/* Add subtree n with size and centre (x,y,z) as one block of its representative id. */
+int mesh_lod(struct mesh *m, const struct ot_pool *o, const struct ot_node *n, unsigned size, int x, int y, int z, struct mesh_stats *s)
+{
+	int hsize = (int)(size >> 1);
+
+	return mesh_cube(m, o, size, x - hsize, y - hsize, z - hsize, ot_rep(n), s);
+}
+
+/*
+ * Copy cells of the cube with lower corner pos and a border of one block to
+ * the scratch space of m, so it can be meshed without looking at the tree.
+ */
+int mesh_copy(struct mesh *m, const struct ot_pool *o, const int pos[3], unsigned size)
+{
+	size_t dim = (size_t)size + 2;
+	// room for one greedy mask slice as well
+	size_t n = dim * dim * dim + (size_t)size * size;
+	int min[3], max[3];
+
+	if (m->cells_cap < n) {
+		block_t *cells;
+
+		if (!(cells = realloc(m->cells, n * sizeof *cells)))
+			return ENOMEM;
+
+		m->cells = cells;
+		m->cells_cap = n;
+	}
+
+	for (unsigned i = 0; i < 3; ++i) {
+		min[i] = pos[i] - 1;
+		max[i] = pos[i] + (int)size + 1;
+	}
+
+	ot_get_box(o, min, max, m->cells);
+	return 0;
+}
+
+static int mesh_cells_culled(struct mesh *m, const int pos[3], unsigned size, struct mesh_stats *s)
+{
+	size_t dim = (size_t)size + 2;
+	int error;
+
+	// offsets to the neighbour behind each face
+	const ptrdiff_t d[6] = {
+		(ptrdiff_t)(dim * dim), -(ptrdiff_t)(dim * dim),
+		(ptrdiff_t)dim, -(ptrdiff_t)dim,
+		1, -1,
+	};
+
+	for (unsigned z = 0; z < size; ++z)
+		for (unsigned y = 0; y < size; ++y) {
+			const block_t *c = &m->cells[((z + 1) * dim + y + 1) * dim + 1];
+
+			for (unsigned x = 0; x < size; ++x, ++c) {
+				unsigned mask = 0;
+
+				if (!*c)
+					continue;
+
+				for (unsigned i = 0; i < 6; ++i)
+					if (!c[d[i]])
+						mask |= 1 << i;
+
+				if (s) {
+					s->faces += face_count(mask);
+					s->culled += 6 - face_count(mask);
+				}
+
+				if ((error = mesh_block(m, 1, pos[0] + (int)x, pos[1] + (int)y, pos[2] + (int)z, *c, mask)))
+					return error;
+			}
+		}
+
+	return 0;
+}
+
+/* Add face of box with lower corner pos and extent ext, texture is repeated per block. */
+static int mesh_quad(struct mesh *m, unsigned face, const int pos[3], const int ext[3])
+{
+	const unsigned char *st = face_st[2 - face / 2];
+	struct mesh_vertex *v;
+	int error;
+
+	if ((error = mesh_reserve(m, 4)))
+		return error;
+
+	v = &m->data[m->count];
+
+	for (unsigned j = 0; j < 4; ++j, ++v) {
+		const unsigned char *f = faces[face][j];
+
+		v->x = (float)(pos[0] + f[0] * ext[0]);
+		v->y = (float)(pos[1] + f[1] * ext[1]);
+		v->z = (float)(pos[2] + f[2] * ext[2]);
+		v->s = (float)(f[3] * ext[st[0]]);
+		v->t = (float)(f[4] * ext[st[1]]);
+	}
+
+	m->count += 4;
+	return 0;
+}
+
+static int mesh_range_push(struct mesh *m, block_t id, size_t first)
+{
+	struct mesh_range *r;
+
+	if (m->count == first)
+		return 0;
+
+	if (m->nranges == m->rcap) {
+		size_t cap = m->rcap ? m->rcap << 1 : 16;
+
+		if (!(r = realloc(m->ranges, cap * sizeof *r)))
+			return ENOMEM;
+
+		m->ranges = r;
+		m->rcap = cap;
+	}
+
+	r = &m->ranges[m->nranges++];
+	r->id = id;
+	r->first = first;
+	r->count = m->count - first;
+	return 0;
+}
+
+/* Merge visible faces of id in one slice perpendicular to axis of face. */
+static int mesh_slice(struct mesh *m, const int pos[3], unsigned size, unsigned face, unsigned k, block_t id, struct mesh_stats *s)
+{
+	unsigned axis = 2 - face / 2, u = face_st[axis][0], v = face_st[axis][1];
+	size_t dim = (size_t)size + 2, stride[3] = {1, dim, dim * dim};
+	block_t *mask = &m->cells[dim * dim * dim];
+	ptrdiff_t d = face & 1 ? -(ptrdiff_t)stride[axis] : (ptrdiff_t)stride[axis];
+	unsigned long culled = 0;
+	int error;
+
+	for (unsigned j = 0; j < size; ++j)
+		for (unsigned i = 0; i < size; ++i) {
+			const block_t *c = &m->cells[(k + 1) * stride[axis] + (i + 1) * stride[u] + (j + 1) * stride[v]];
+
+			mask[j * size + i] = *c == id && !c[d];
+			culled += *c == id && c[d];
+		}
+
+	if (s)
+		s->culled += culled;
+
+	for (unsigned j = 0; j < size; ++j)
+		for (unsigned i = 0; i < size;) {
+			int p[3], ext[3];
+			unsigned w, h;
+
+			if (!mask[j * size + i]) {
+				++i;
+				continue;
+			}
+
+			for (w = 1; i + w < size && mask[j * size + i + w]; ++w)
+				;
+
+			for (h = 1; j + h < size; ++h) {
+				unsigned x;
+
+				for (x = 0; x < w && mask[(j + h) * size + i + x]; ++x)
+					;
+
+				if (x < w)
+					break;
+			}
+
+			for (unsigned y = 0; y < h; ++y)
+				memset(&mask[(j + y) * size + i], 0, w * sizeof *mask);
+
+			p[axis] = pos[axis] + (int)k;
+			p[u] = pos[u] + (int)i;
+			p[v] = pos[v] + (int)j;
+			ext[axis] = 1;
+			ext[u] = (int)w;
+			ext[v] = (int)h;
+
+			if ((error = mesh_quad(m, face, p, ext)))
+				return error;
+
+			if (s)
+				++s->faces;
+
+			i += w;
+		}
+
+	return 0;
+}
+
+static int mesh_cells_greedy(struct mesh *m, const int pos[3], unsigned size, struct mesh_stats *s)
+{
+	size_t dim = (size_t)size + 2;
+	uint64_t seen[(1u << (8 * sizeof(block_t))) / 64];
+	int error;
+
+	memset(seen, 0, sizeof seen);
+
+	for (unsigned z = 0; z < size; ++z)
+		for (unsigned y = 0; y < size; ++y) {
+			const block_t *c = &m->cells[((z + 1) * dim + y + 1) * dim + 1];
+
+			for (unsigned x = 0; x < size; ++x, ++c)
+				seen[*c / 64] |= UINT64_C(1) << (*c % 64);
+		}
+
+	// ignore air
+	seen[0] &= ~UINT64_C(1);
+
+	for (size_t w = 0; w < sizeof seen / sizeof *seen; ++w)
+		for (uint64_t bits = seen[w]; bits; bits &= bits - 1) {
+			block_t id = (block_t)(w * 64 + (unsigned)__builtin_ctzll(bits));
+			size_t first = m->count;
+
+			for (unsigned face = 0; face < 6; ++face)
+				for (unsigned k = 0; k < size; ++k)
+					if ((error = mesh_slice(m, pos, size, face, k, id, s)))
+						return error;
+
+			if ((error = mesh_range_push(m, id, first)))
+				return error;
+		}
+
+	return 0;
+}
+
+/*
+ * Add visible faces of the cells copied by mesh_copy. Only reads the copy, so
+ * this can run on any thread.
+ */
+int mesh_cells(struct mesh *m, const int pos[3], unsigned size, int greedy, struct mesh_stats *s)
+{
+	return (greedy ? mesh_cells_greedy : mesh_cells_culled)(m, pos, size, s);
+}
+
+/*
+ * Add all visible unit faces of the cube with lower corner pos. The cells are
+ * copied with a border of one block, so faces on the chunk boundary are culled
+ * against the neighbouring chunks as well.
+ */
+int mesh_chunk(struct mesh *m, const struct ot_pool *o, const int pos[3], unsigned size, struct mesh_stats *s)
+{
+	int error;
+
+	if ((error = mesh_copy(m, o, pos, size)))
+		return error;
+
+	return mesh_cells_culled(m, pos, size, s);
+}
+
+/*
+ * Like mesh_chunk, but coplanar visible faces with the same block id are
+ * merged into rectangles. Texture coordinates are in blocks rather than atlas
+ * units, so the renderer has to bind a repeating texture for each range.
+ * Stats count merged quads instead of unit faces.
+ */
+int mesh_chunk_greedy(struct mesh *m, const struct ot_pool *o, const int pos[3], unsigned size, struct mesh_stats *s)
+{
+	int error;
+
+	if ((error = mesh_copy(m, o, pos, size)))
+		return error;
+
+	return mesh_cells_greedy(m, pos, size, s);
+}
+
+static inline size_t chunk_hash(int x, int y, int z)
+{
+	return ((unsigned)x * 73856093u) ^ ((unsigned)y * 19349663u) ^ ((unsigned)z * 83492791u);
+}
+
+/* Floor division of block coordinate v by chunk size. */
+int mesh_chunk_coord(int v, unsigned chunk_size)
+{
+	int s = (int)chunk_size;
+
+	return v >= 0 ? v / s : -((-v - 1) / s) - 1;
+}
+
+int mesh_cache_init(struct mesh_cache *c, unsigned chunk_size)
+{
+	if (chunk_size < 2 || (chunk_size & (chunk_size - 1)))
+		return EINVAL;
+
+	if (!(c->chunks = calloc(64, sizeof *c->chunks)))
+		return ENOMEM;
+
+	c->count = 0;
+	c->cap = 64;
+	c->chunk_size = chunk_size;
+	return 0;
+}
+
+void mesh_cache_free(struct mesh_cache *c)
+{
+	for (size_t i = 0; i < c->cap; ++i)
+		if (c->chunks[i].flags & MESH_LIVE)
+			free(c->chunks[i].ranges);
+
+	free(c->chunks);
+}
+
+struct mesh_chunk *mesh_cache_find(const struct mesh_cache *c, int x, int y, int z)
+{
+	size_t mask = c->cap - 1;
+
+	for (size_t i = chunk_hash(x, y, z) & mask;; i = (i + 1) & mask) {
+		struct mesh_chunk *ch = &c->chunks[i];
+
+		if (!(ch->flags & MESH_LIVE))
+			return NULL;
+
+		if (ch->x == x && ch->y == y && ch->z == z)
+			return ch;
+	}
+}
+
+static struct mesh_chunk *mesh_cache_put(struct mesh_chunk *chunks, size_t cap, int x, int y, int z)
+{
+	size_t mask = cap - 1, i;
+
+	for (i = chunk_hash(x, y, z) & mask; chunks[i].flags & MESH_LIVE; i = (i + 1) & mask)
+		;
+
+	chunks[i].x = x;
+	chunks[i].y = y;
+	chunks[i].z = z;
+	chunks[i].vbo = 0;
+	chunks[i].count = 0;
+	chunks[i].stats.faces = chunks[i].stats.culled = 0;
+	chunks[i].ranges = NULL;
+	chunks[i].nranges = 0;
+	chunks[i].job = 0;
+	chunks[i].flags = MESH_LIVE | MESH_DIRTY;
+
+	return &chunks[i];
+}
+
+/* Find chunk or insert an empty dirty one. Returns NULL if out of memory. */
+struct mesh_chunk *mesh_cache_get(struct mesh_cache *c, int x, int y, int z)
+{
+	struct mesh_chunk *ch;
+
+	if ((ch = mesh_cache_find(c, x, y, z)))
+		return ch;
+
+	// keep load factor below 1/2
+	if (c->count >= c->cap >> 1) {
+		struct mesh_chunk *chunks;
+		size_t cap = c->cap << 1;
+
+		if (cap < c->cap || !(chunks = calloc(cap, sizeof *chunks)))
+			return NULL;
+
+		for (size_t i = 0; i < c->cap; ++i) {
+			struct mesh_chunk *old = &c->chunks[i];
+
+			if (old->flags & MESH_LIVE)
+				*mesh_cache_put(chunks, cap, old->x, old->y, old->z) = *old;
+		}
+
+		free(c->chunks);
+		c->chunks = chunks;
+		c->cap = cap;
+	}
+
+	++c->count;
+	return mesh_cache_put(c->chunks, c->cap, x, y, z);
+}
+
+static void mesh_cache_remove(struct mesh_cache *c, size_t i)
+{
+	size_t mask = c->cap - 1;
+
+	c->chunks[i].flags = 0;
+
+	// shift back any entries that would become unreachable
+	for (size_t j = (i + 1) & mask; c->chunks[j].flags & MESH_LIVE; j = (j + 1) & mask) {
+		struct mesh_chunk *ch = &c->chunks[j];
+		size_t k = chunk_hash(ch->x, ch->y, ch->z) & mask;
+
+		if (i <= j ? i < k && k <= j : i < k || k <= j)
+			continue;
+
+		c->chunks[i] = *ch;
+		ch->flags = 0;
+		i = j;
+	}
+
+	--c->count;
+}
+
+/* Mark all chunks that overlap min <= (x,y,z) < max as dirty. */
+void mesh_cache_touch(struct mesh_cache *c, const int min[3], const int max[3])
+{
+	int cmin[3], cmax[3];
+	size_t n = 1;
+
+	for (unsigned i = 0; i < 3; ++i) {
+		if (min[i] >= max[i])
+			return;
+
+		cmin[i] = mesh_chunk_coord(min[i], c->chunk_size);
+		cmax[i] = mesh_chunk_coord(max[i] - 1, c->chunk_size);
+
+		n *= (size_t)(cmax[i] - cmin[i] + 1);
+	}
+
+	if (n > c->count) {
+		// cheaper to check every cached chunk
+		for (size_t i = 0; i < c->cap; ++i) {
+			struct mesh_chunk *ch = &c->chunks[i];
+
+			if ((ch->flags & MESH_LIVE)
+				&& ch->x >= cmin[0] && ch->x <= cmax[0]
+				&& ch->y >= cmin[1] && ch->y <= cmax[1]
+				&& ch->z >= cmin[2] && ch->z <= cmax[2])
+				ch->flags |= MESH_DIRTY;
+		}
+		return;
+	}
+
+	for (int z = cmin[2]; z <= cmax[2]; ++z)
+		for (int y = cmin[1]; y <= cmax[1]; ++y)
+			for (int x = cmin[0]; x <= cmax[0]; ++x) {
+				struct mesh_chunk *ch = mesh_cache_find(c, x, y, z);
+
+				if (ch)
+					ch->flags |= MESH_DIRTY;
+			}
+}
+
+/*
+ * Drop all chunks that are dirty and have not been used since the last sweep,
+ * release is called for each of them first. Clears MESH_USED on the others.
+ */
+void mesh_cache_sweep(struct mesh_cache *c, void (*release)(struct mesh_chunk *ch))
+{
+	for (size_t i = 0; i < c->cap;) {
+		struct mesh_chunk *ch = &c->chunks[i];
+
+		if (!(ch->flags & MESH_LIVE)) {
+			++i;
+			continue;
+		}
+
+		if ((ch->flags & (MESH_DIRTY | MESH_USED)) == MESH_DIRTY) {
+			release(ch);
+			free(ch->ranges);
+			// another chunk may have moved into this slot, so look again
+			mesh_cache_remove(c, i);
+			continue;
+		}
+
+		ch->flags &= ~MESH_USED;
+		++i;
+	}
+}
+
+/* Keep a copy of the ranges of m in ch, so the chunk can be drawn per block id. */
+int mesh_chunk_set_ranges(struct mesh_chunk *ch, const struct mesh *m)
+{
+	struct mesh_range *r = NULL;
+
+	if (m->nranges) {
+		if (!(r = realloc(ch->ranges, m->nranges * sizeof *r)))
+			return ENOMEM;
+
+		memcpy(r, m->ranges, m->nranges * sizeof *r);
+	} else {
+		free(ch->ranges);
+	}
+
+	ch->ranges = r;
+	ch->nranges = m->nranges;
+	return 0;
+}
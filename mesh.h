@@ -0,0 +1,106 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <stddef.h>
+
+#include "ot.h"
+
+// default size of subtrees that get their own vertex buffer
+#define MESH_CHUNK 16
+
+// layout matches GL_T2F_V3F
+struct mesh_vertex {
+	float s, t;
+	float x, y, z;
+};
+
+/* Vertices of quads with block id, the texture of id is repeated over them. */
+struct mesh_range {
+	block_t id;
+	size_t first, count;
+};
+
+/* Vertex data for a list of quads. */
+struct mesh {
+	struct mesh_vertex *data;
+	size_t count, cap;
+	// empty unless built by mesh_chunk_greedy
+	struct mesh_range *ranges;
+	size_t nranges, rcap;
+	// scratch copy of cells for mesh_chunk
+	block_t *cells;
+	size_t cells_cap;
+};
+
+// face bits for mesh_block, in the same order as the faces are emitted
+#define MESH_Z1 0x01
+#define MESH_Z0 0x02
+#define MESH_Y1 0x04
+#define MESH_Y0 0x08
+#define MESH_X1 0x10
+#define MESH_X0 0x20
+#define MESH_ALL 0x3f
+
+/* Number of faces that were emitted and skipped because they touch a solid neighbour. */
+struct mesh_stats {
+	unsigned long faces, culled;
+};
+
+void mesh_init(struct mesh *m);
+void mesh_free(struct mesh *m);
+
+static inline void mesh_clear(struct mesh *m)
+{
+	m->count = m->nranges = 0;
+}
+
+int mesh_block(struct mesh *m, unsigned size, int x, int y, int z, block_t id, unsigned mask);
+int mesh_node(struct mesh *m, const struct ot_pool *o, const struct ot_node *n, unsigned size, int x, int y, int z, struct mesh_stats *s);
+int mesh_lod(struct mesh *m, const struct ot_pool *o, const struct ot_node *n, unsigned size, int x, int y, int z, struct mesh_stats *s);
+int mesh_copy(struct mesh *m, const struct ot_pool *o, const int pos[3], unsigned size);
+int mesh_cells(struct mesh *m, const int pos[3], unsigned size, int greedy, struct mesh_stats *s);
+int mesh_chunk(struct mesh *m, const struct ot_pool *o, const int pos[3], unsigned size, struct mesh_stats *s);
+int mesh_chunk_greedy(struct mesh *m, const struct ot_pool *o, const int pos[3], unsigned size, struct mesh_stats *s);
+
+#define MESH_DIRTY 1
+// drawn since last sweep
+#define MESH_USED 2
+// being rebuilt in the background
+#define MESH_QUEUED 4
+
+struct mesh_chunk {
+	// chunk coordinates, i.e. block coordinates of lower corner divided by chunk size
+	int x, y, z;
+	// buffer name for renderer, 0 if none
+	unsigned vbo;
+	// number of vertices in buffer
+	size_t count;
+	// face counts of the last rebuild
+	struct mesh_stats stats;
+	// copy of mesh ranges, NULL if the whole buffer uses the atlas
+	struct mesh_range *ranges;
+	size_t nranges;
+	// last background job, so results of older ones can be ignored
+	unsigned job;
+	unsigned flags;
+};
+
+/* Hash map from chunk coordinates to cached meshes. */
+struct mesh_cache {
+	struct mesh_chunk *chunks;
+	size_t count, cap;
+	unsigned chunk_size;
+};
+
+int mesh_cache_init(struct mesh_cache *c, unsigned chunk_size);
+void mesh_cache_free(struct mesh_cache *c);
+
+struct mesh_chunk *mesh_cache_find(const struct mesh_cache *c, int x, int y, int z);
+struct mesh_chunk *mesh_cache_get(struct mesh_cache *c, int x, int y, int z);
+void mesh_cache_touch(struct mesh_cache *c, const int min[3], const int max[3]);
+void mesh_cache_sweep(struct mesh_cache *c, void (*release)(struct mesh_chunk *ch));
+int mesh_chunk_set_ranges(struct mesh_chunk *ch, const struct mesh *m);
+
+int mesh_chunk_coord(int v, unsigned chunk_size);
+
+#endif
@@ -0,0 +1,216 @@
+/*
+ * Background chunk meshing.
+ *
+ * Made by Folkert van Verseveld
+ *
+ * Copyright Folkert van Verseveld. All rights reserved.
+ *
+ * The main thread copies the cells of a chunk into a job, which is consistent
+ * by definition, and queues it. Workers only turn the copy into vertex data.
+ * Uploading to the GPU is left to the main thread as well.
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dbg.h"
+#include "mesher.h"
+#include "trace.h"
+
+static void mesher_run(struct mesher *w, struct mesh_job *j)
+{
+	j->stats.faces = j->stats.culled = 0;
+	mesh_clear(&j->mesh);
+	j->error = mesh_cells(&j->mesh, j->pos, j->size, w->greedy, &j->stats);
+}
+
+static void mesher_done(struct mesher *w, struct mesh_job *j)
+{
+	struct mesh_job *head = __atomic_load_n(&w->done, __ATOMIC_RELAXED);
+
+	do
+		j->next = head;
+	while (!__atomic_compare_exchange_n(&w->done, &head, j, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void *mesher_main(void *arg)
+{
+	struct mesher *w = arg;
+
+	trace_thread("mesher");
+
+	for (;;) {
+		struct mesh_job *j;
+		uint64_t t;
+
+		pthread_mutex_lock(&w->lock);
+
+		while (!w->todo && !w->stop)
+			pthread_cond_wait(&w->cond, &w->lock);
+
+		if (w->stop) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+
+		j = w->todo;
+		if (!(w->todo = j->next))
+			w->todo_tail = NULL;
+
+		pthread_mutex_unlock(&w->lock);
+
+		t = trace_start();
+		mesher_run(w, j);
+		trace_span("mesh_job", t);
+		mesher_done(w, j);
+	}
+
+	return NULL;
+}
+
+static void mesher_stop(struct mesher *w, unsigned n)
+{
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	while (n)
+		pthread_join(w->threads[--n], NULL);
+}
+
+/* Start threads workers, or none to mesh on the calling thread in mesher_submit. */
+int mesher_init(struct mesher *w, unsigned threads, int greedy)
+{
+	int error;
+
+	w->threads = NULL;
+	w->nthreads = threads;
+	w->greedy = greedy;
+	w->todo = w->todo_tail = NULL;
+	w->stop = 0;
+	w->done = NULL;
+	w->spare = NULL;
+
+	if (threads && !(w->threads = malloc(threads * sizeof *w->threads)))
+		return ENOMEM;
+
+	if ((error = pthread_mutex_init(&w->lock, NULL)))
+		goto fail;
+
+	if ((error = pthread_cond_init(&w->cond, NULL))) {
+		pthread_mutex_destroy(&w->lock);
+		goto fail;
+	}
+
+	for (unsigned i = 0; i < threads; ++i)
+		if ((error = pthread_create(&w->threads[i], NULL, mesher_main, w))) {
+			mesher_stop(w, i);
+			pthread_cond_destroy(&w->cond);
+			pthread_mutex_destroy(&w->lock);
+			goto fail;
+		}
+
+	return 0;
+fail:
+	free(w->threads);
+	return error;
+}
+
+static void mesh_jobs_free(struct mesh_job *j)
+{
+	while (j) {
+		struct mesh_job *next = j->next;
+
+		mesh_free(&j->mesh);
+		free(j);
+		j = next;
+	}
+}
+
+/* Stop all workers and drop any unfinished work. */
+void mesher_free(struct mesher *w)
+{
+	mesher_stop(w, w->nthreads);
+
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+
+	mesh_jobs_free(w->todo);
+	mesh_jobs_free(w->done);
+	mesh_jobs_free(w->spare);
+	free(w->threads);
+}
+
+/* Create job for the cube with lower corner pos. Returns NULL if out of memory. */
+struct mesh_job *mesher_job(struct mesher *w, const struct ot_pool *o, const int pos[3], unsigned size)
+{
+	struct mesh_job *j;
+
+	if ((j = w->spare)) {
+		w->spare = j->next;
+	} else {
+		if (!(j = malloc(sizeof *j)))
+			return NULL;
+
+		mesh_init(&j->mesh);
+	}
+
+	if (mesh_copy(&j->mesh, o, pos, size)) {
+		mesher_release(w, j);
+		return NULL;
+	}
+
+	memcpy(j->pos, pos, sizeof j->pos);
+	j->size = size;
+	j->error = 0;
+	j->next = NULL;
+	return j;
+}
+
+void mesher_submit(struct mesher *w, struct mesh_job *j)
+{
+	if (!w->nthreads) {
+		mesher_run(w, j);
+		mesher_done(w, j);
+		return;
+	}
+
+	j->next = NULL;
+
+	pthread_mutex_lock(&w->lock);
+
+	if (w->todo_tail)
+		w->todo_tail->next = j;
+	else
+		w->todo = j;
+
+	w->todo_tail = j;
+
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Take all finished jobs, oldest first. Never blocks. */
+struct mesh_job *mesher_poll(struct mesher *w)
+{
+	struct mesh_job *j = __atomic_exchange_n(&w->done, NULL, __ATOMIC_ACQUIRE), *list = NULL;
+
+	// the stack has the newest job on top
+	while (j) {
+		struct mesh_job *next = j->next;
+
+		j->next = list;
+		list = j;
+		j = next;
+	}
+
+	return list;
+}
+
+/* Give job back for reuse, the vertex and cell buffers are kept. */
+void mesher_release(struct mesher *w, struct mesh_job *j)
+{
+	j->next = w->spare;
+	w->spare = j;
+}
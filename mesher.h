@@ -0,0 +1,57 @@
+#ifndef MESHER_H
+#define MESHER_H
+
+#include <pthread.h>
+
+#include "mesh.h"
+
+// upper limit for number of worker threads
+#define MESHER_MAX 64
+
+/* Mesh of one chunk that is built in the background. */
+struct mesh_job {
+	// chunk coordinates and the value of mesh_chunk.job it belongs to
+	int x, y, z;
+	unsigned seq;
+	// lower corner and size in blocks
+	int pos[3];
+	unsigned size;
+	// copy of the cells on input, vertex data on output
+	struct mesh mesh;
+	struct mesh_stats stats;
+	int error;
+	struct mesh_job *next;
+};
+
+/*
+ * Pool of worker threads that mesh chunks. Jobs carry their own copy of the
+ * cells, so workers never look at the octree while the main thread changes it.
+ * Finished jobs are handed back through a lock-free stack.
+ */
+struct mesher {
+	pthread_t *threads;
+	unsigned nthreads;
+	int greedy;
+
+	// pending jobs, protected by lock
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct mesh_job *todo, *todo_tail;
+	int stop;
+
+	// finished jobs, pushed by workers and taken all at once by mesher_poll
+	struct mesh_job *done;
+
+	// jobs for reuse, only touched by the main thread
+	struct mesh_job *spare;
+};
+
+int mesher_init(struct mesher *w, unsigned threads, int greedy);
+void mesher_free(struct mesher *w);
+
+struct mesh_job *mesher_job(struct mesher *w, const struct ot_pool *o, const int pos[3], unsigned size);
+void mesher_submit(struct mesher *w, struct mesh_job *j);
+struct mesh_job *mesher_poll(struct mesher *w);
+void mesher_release(struct mesher *w, struct mesh_job *j);
+
+#endif
@@ -0,0 +1,1012 @@
+/*
+ * Block replication over TCP.
+ *
+ * Made by Folkert van Verseveld
+ *
+ * Copyright Folkert van Verseveld. All rights reserved.
+ *
+ * The server only remembers where the tree has changed. When a tick is over,
+ * the positions are sorted and the current ids are looked up, so a cell that
+ * changed many times is sent once. Sorted cells are sent as offsets from the
+ * previous cell, which are tiny for edits that are close together. The
+ * message is encoded once and copied to the queue of each client.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "dbg.h"
+#include "net.h"
+#include "varint.h"
+
+// events that are handled at once by net_server_poll
+#define NET_EVENTS 64
+// room that is made for each recv
+#define NET_RECV 65536
+// bytes read from one client per net_server_poll, see net_peer_recv
+#define NET_PEER_READ (NET_REQUEST_MAX + NET_RECV)
+// type and length
+#define NET_HEADER 5
+
+uint64_t net_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* Make room for n more bytes, dropping everything before head. */
+static int nb_reserve(struct net_buf *b, size_t n)
+{
+	unsigned char *data;
+	size_t cap;
+
+	if (b->head) {
+		memmove(b->data, b->data + b->head, b->size - b->head);
+		b->size -= b->head;
+		b->head = 0;
+	}
+
+	if (b->cap - b->size >= n)
+		return 0;
+
+	for (cap = b->cap ? b->cap : 4096; cap - b->size < n; cap <<= 1)
+		if (cap > SIZE_MAX >> 1)
+			return EOVERFLOW;
+
+	if (!(data = realloc(b->data, cap)))
+		return ENOMEM;
+
+	b->data = data;
+	b->cap = cap;
+	return 0;
+}
+
+static int nb_put(struct net_buf *b, const void *data, size_t n)
+{
+	int error;
+
+	if ((error = nb_reserve(b, n)))
+		return error;
+
+	memcpy(b->data + b->size, data, n);
+	b->size += n;
+	return 0;
+}
+
+static int nb_le(struct net_buf *b, uint64_t v, unsigned n)
+{
+	unsigned char buf[8];
+
+	for (unsigned i = 0; i < n; ++i, v >>= 8)
+		buf[i] = (unsigned char)v;
+
+	return nb_put(b, buf, n);
+}
+
+static int nb_varint(struct net_buf *b, uint64_t v)
+{
+	int error;
+
+	if ((error = nb_reserve(b, VARINT_MAX)))
+		return error;
+
+	b->size += varint_put(b->data + b->size, v);
+	return 0;
+}
+
+static int nb_sint(struct net_buf *b, int64_t v)
+{
+	return nb_varint(b, zigzag_encode(v));
+}
+
+/* Start message of type at the end of b, net_end fills in the length. */
+static int net_begin(struct net_buf *b, unsigned type, size_t *start)
+{
+	int error;
+
+	if ((error = nb_reserve(b, NET_HEADER)))
+		return error;
+
+	*start = b->size;
+	b->data[b->size + 4] = (unsigned char)type;
+	b->size += NET_HEADER;
+	return 0;
+}
+
+static int net_end(struct net_buf *b, size_t start)
+{
+	size_t n = b->size - start - 4;
+
+	if (n > UINT32_MAX)
+		return EOVERFLOW;
+
+	for (unsigned i = 0; i < 4; ++i)
+		b->data[start + i] = (unsigned char)(n >> 8 * i);
+
+	return 0;
+}
+
+struct net_reader {
+	const unsigned char *pos, *end;
+};
+
+static int nr_le(struct net_reader *r, uint64_t *v, unsigned n)
+{
+	if ((size_t)(r->end - r->pos) < n)
+		return EINVAL;
+
+	*v = 0;
+	for (unsigned i = n; i-- > 0;)
+		*v = *v << 8 | r->pos[i];
+
+	r->pos += n;
+	return 0;
+}
+
+static int nr_varint(struct net_reader *r, uint64_t *v)
+{
+	return varint_get(&r->pos, r->end, v);
+}
+
+static int nr_sint(struct net_reader *r, int *v)
+{
+	uint64_t u;
+	int64_t x;
+
+	if (nr_varint(r, &u))
+		return EINVAL;
+
+	x = zigzag_decode(u);
+
+	if (x < -(int64_t)OT_SIZE_MAX || x > (int64_t)OT_SIZE_MAX)
+		return EINVAL;
+
+	*v = (int)x;
+	return 0;
+}
+
+static int nr_id(struct net_reader *r, block_t *id)
+{
+	uint64_t v;
+
+	if (nr_varint(r, &v) || v > (block_t)-1)
+		return EINVAL;
+
+	*id = (block_t)v;
+	return 0;
+}
+
+/*
+ * Find the next complete message in b. Returns 1 and moves head past it if
+ * there is one, 0 if it is still incomplete and -1 if it is too big.
+ */
+static int net_next(struct net_buf *b, size_t max, unsigned *type, struct net_reader *r)
+{
+	const unsigned char *p = b->data + b->head;
+	size_t avail = b->size - b->head, n;
+
+	if (avail < NET_HEADER)
+		return 0;
+
+	n = (size_t)p[0] | (size_t)p[1] << 8 | (size_t)p[2] << 16 | (size_t)p[3] << 24;
+
+	if (!n || n > max)
+		return -1;
+
+	if (avail - 4 < n)
+		return 0;
+
+	*type = p[4];
+	r->pos = p + NET_HEADER;
+	r->end = p + 4 + n;
+	b->head += 4 + n;
+	return 1;
+}
+
+/* Read up to max bytes, less if there is no more. Returns 0 or the reason the connection is gone. */
+static int net_recv(int fd, struct net_buf *b, size_t max, uint64_t *total)
+{
+	for (size_t got = 0; got < max;) {
+		size_t room;
+		ssize_t n;
+		int error;
+
+		if ((error = nb_reserve(b, NET_RECV)))
+			return error;
+
+		room = b->cap - b->size;
+
+		if ((n = recv(fd, b->data + b->size, room < max - got ? room : max - got, 0)) > 0) {
+			b->size += (size_t)n;
+			got += (size_t)n;
+			*total += (uint64_t)n;
+			continue;
+		}
+
+		if (!n)
+			return ECONNRESET;
+
+		if (errno == EINTR)
+			continue;
+
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : errno;
+	}
+
+	return 0;
+}
+
+/* Send as much as the socket takes. Sets *blocked if some is left. */
+static int net_send(int fd, struct net_buf *b, int *blocked)
+{
+	while (b->head < b->size) {
+		ssize_t n = send(fd, b->data + b->head, b->size - b->head, MSG_NOSIGNAL);
+
+		if (n >= 0) {
+			b->head += (size_t)n;
+			continue;
+		}
+
+		if (errno == EINTR)
+			continue;
+
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			*blocked = 1;
+			return 0;
+		}
+
+		return errno;
+	}
+
+	b->head = b->size = 0;
+	*blocked = 0;
+	return 0;
+}
+
+static int cmp_cell(const void *a, const void *b)
+{
+	const struct ot_cell *p = a, *q = b;
+
+	if (p->z != q->z)
+		return p->z < q->z ? -1 : 1;
+	if (p->y != q->y)
+		return p->y < q->y ? -1 : 1;
+	if (p->x != q->x)
+		return p->x < q->x ? -1 : 1;
+	return 0;
+}
+
+static int net_push_cell(struct ot_cell **cells, size_t *n, size_t *cap, int x, int y, int z)
+{
+	if (*n == *cap) {
+		size_t m = *cap ? *cap << 1 : 256;
+		struct ot_cell *p;
+
+		if (!(p = realloc(*cells, m * sizeof *p)))
+			return ENOMEM;
+
+		*cells = p;
+		*cap = m;
+	}
+
+	(*cells)[*n].x = x;
+	(*cells)[*n].y = y;
+	(*cells)[*n].z = z;
+	++*n;
+	return 0;
+}
+
+/*
+ * Sort cells, drop duplicates and append them with their current id in o.
+ * Each cell is stored as the offset from the previous one.
+ */
+static int net_put_cells(struct net_buf *b, const struct ot_pool *o, struct ot_cell *cells, size_t n)
+{
+	int p[3] = {0, 0, 0}, error;
+	size_t m = 0;
+
+	qsort(cells, n, sizeof *cells, cmp_cell);
+
+	for (size_t i = 0; i < n; ++i)
+		if (!m || cmp_cell(&cells[m - 1], &cells[i]))
+			cells[m++] = cells[i];
+
+	if ((error = nb_varint(b, m)))
+		return error;
+
+	for (size_t i = 0; i < m; ++i) {
+		const struct ot_cell *c = &cells[i];
+
+		if ((error = nb_sint(b, (int64_t)c->x - p[0])) || (error = nb_sint(b, (int64_t)c->y - p[1]))
+			|| (error = nb_sint(b, (int64_t)c->z - p[2])) || (error = nb_varint(b, ot_get_cell(o, c->x, c->y, c->z))))
+			return error;
+
+		p[0] = c->x;
+		p[1] = c->y;
+		p[2] = c->z;
+	}
+
+	return 0;
+}
+
+/* Apply cells written by net_put_cells to o. */
+static int net_get_cells(struct net_reader *r, struct ot_pool *o)
+{
+	int p[3] = {0, 0, 0}, d[3], error;
+	uint64_t n;
+	block_t id;
+
+	if (nr_varint(r, &n))
+		return EINVAL;
+
+	while (n--) {
+		if (nr_sint(r, &d[0]) || nr_sint(r, &d[1]) || nr_sint(r, &d[2]) || nr_id(r, &id))
+			return EINVAL;
+
+		for (unsigned i = 0; i < 3; ++i)
+			if ((p[i] += d[i]) < -(int)OT_SIZE_MAX || p[i] > (int)OT_SIZE_MAX)
+				return EINVAL;
+
+		// out of range for this tree is fine, anything else is not
+		if ((error = ot_set_cell(o, p[0], p[1], p[2], id)) && error != ERANGE)
+			return error;
+	}
+
+	return 0;
+}
+
+static size_t box_volume(const int min[3], const int max[3])
+{
+	return (size_t)(max[0] - min[0]) * (size_t)(max[1] - min[1]) * (size_t)(max[2] - min[2]);
+}
+
+/* Append boxes with their cells from o in runs of the same id. */
+static int net_put_boxes(struct net_buf *b, const struct ot_pool *o, const struct net_box *boxes, size_t n)
+{
+	block_t *buf = NULL;
+	size_t cap = 0;
+	int error;
+
+	if ((error = nb_varint(b, n)))
+		return error;
+
+	for (size_t i = 0; i < n; ++i) {
+		const struct net_box *x = &boxes[i];
+		size_t vol = box_volume(x->min, x->max);
+
+		if (vol > cap) {
+			block_t *p;
+
+			if (!(p = realloc(buf, vol * sizeof *p))) {
+				error = ENOMEM;
+				goto fail;
+			}
+
+			buf = p;
+			cap = vol;
+		}
+
+		ot_get_box(o, x->min, x->max, buf);
+
+		for (unsigned j = 0; j < 3; ++j)
+			if ((error = nb_sint(b, x->min[j])))
+				goto fail;
+
+		for (unsigned j = 0; j < 3; ++j)
+			if ((error = nb_varint(b, (uint64_t)(x->max[j] - x->min[j]))))
+				goto fail;
+
+		for (size_t j = 0, k; j < vol; j = k) {
+			for (k = j + 1; k < vol && buf[k] == buf[j]; ++k)
+				;
+
+			if ((error = nb_varint(b, k - j - 1)) || (error = nb_varint(b, buf[j])))
+				goto fail;
+		}
+	}
+fail:
+	free(buf);
+	return error;
+}
+
+static int net_get_boxes(struct net_reader *r, struct ot_pool *o)
+{
+	block_t *buf = NULL;
+	uint64_t n, v;
+	int error = 0;
+
+	if (nr_varint(r, &n))
+		return EINVAL;
+
+	if (n && !(buf = malloc(NET_BOX_MAX * sizeof *buf)))
+		return ENOMEM;
+
+	while (n--) {
+		int min[3], max[3];
+		size_t vol;
+
+		for (unsigned i = 0; i < 3; ++i)
+			if (nr_sint(r, &min[i])) {
+				error = EINVAL;
+				goto fail;
+			}
+
+		for (unsigned i = 0; i < 3; ++i) {
+			if (nr_varint(r, &v) || !v || v > OT_SIZE_MAX) {
+				error = EINVAL;
+				goto fail;
+			}
+
+			max[i] = min[i] + (int)v;
+		}
+
+		if ((vol = box_volume(min, max)) > NET_BOX_MAX) {
+			error = EINVAL;
+			goto fail;
+		}
+
+		for (size_t i = 0; i < vol;) {
+			block_t id;
+
+			if (nr_varint(r, &v) || v >= vol - i || nr_id(r, &id)) {
+				error = EINVAL;
+				goto fail;
+			}
+
+			for (v += i + 1; i < v; ++i)
+				buf[i] = id;
+		}
+
+		if ((error = ot_set_box(o, min, max, buf)) && error != ERANGE)
+			goto fail;
+
+		error = 0;
+	}
+fail:
+	free(buf);
+	return error;
+}
+
+static int net_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL), one = 1;
+
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		return errno;
+
+	// changes are small and should go out right away
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	return 0;
+}
+
+/* Listen on all interfaces at port, or any free port if it is 0. */
+int net_server_init(struct net_server *s, struct ot_pool *o, unsigned short port)
+{
+	struct sockaddr_in sa;
+	socklen_t len = sizeof sa;
+	struct epoll_event ev;
+	int one = 1, error;
+
+	memset(s, 0, sizeof *s);
+	s->o = o;
+	s->epfd = -1;
+
+	if ((s->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+		return errno;
+
+	setsockopt(s->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+
+	memset(&sa, 0, sizeof sa);
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_ANY);
+	sa.sin_port = htons(port);
+
+	if (bind(s->fd, (struct sockaddr*)&sa, sizeof sa) || listen(s->fd, SOMAXCONN)
+		|| getsockname(s->fd, (struct sockaddr*)&sa, &len))
+	{
+		error = errno;
+		goto fail;
+	}
+
+	s->port = ntohs(sa.sin_port);
+
+	if ((error = net_nonblock(s->fd)))
+		goto fail;
+
+	if ((s->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		error = errno;
+		goto fail;
+	}
+
+	// the listening socket is the only one without a peer
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+
+	if (epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->fd, &ev)) {
+		error = errno;
+		goto fail;
+	}
+
+	if (!(s->peers = malloc(NET_CLIENTS_MAX * sizeof *s->peers))) {
+		error = ENOMEM;
+		goto fail;
+	}
+
+	return 0;
+fail:
+	if (s->epfd != -1)
+		close(s->epfd);
+
+	close(s->fd);
+	return error;
+}
+
+static void net_peer_free(struct net_peer *p)
+{
+	close(p->fd);
+	free(p->in.data);
+	free(p->out.data);
+	free(p);
+}
+
+void net_server_free(struct net_server *s)
+{
+	for (unsigned i = 0; i < s->npeers; ++i)
+		net_peer_free(s->peers[i]);
+
+	close(s->epfd);
+	close(s->fd);
+
+	free(s->peers);
+	free(s->cells);
+	free(s->boxes);
+	free(s->msg.data);
+}
+
+/* Remember that cells with min <= (x,y,z) < max have changed. */
+void net_server_touch(struct net_server *s, const int min[3], const int max[3])
+{
+	size_t vol = box_volume(min, max);
+
+	if (s->resync)
+		return;
+
+	if (vol == 1) {
+		if (net_push_cell(&s->cells, &s->ncells, &s->cellcap, min[0], min[1], min[2]))
+			s->resync = 1;
+		return;
+	}
+
+	if (vol > NET_BOX_MAX) {
+		s->resync = 1;
+		return;
+	}
+
+	if (s->nboxes == s->boxcap) {
+		size_t cap = s->boxcap ? s->boxcap << 1 : 16;
+		struct net_box *p;
+
+		if (!(p = realloc(s->boxes, cap * sizeof *p))) {
+			s->resync = 1;
+			return;
+		}
+
+		s->boxes = p;
+		s->boxcap = cap;
+	}
+
+	memcpy(s->boxes[s->nboxes].min, min, sizeof s->boxes[s->nboxes].min);
+	memcpy(s->boxes[s->nboxes].max, max, sizeof s->boxes[s->nboxes].max);
+	++s->nboxes;
+}
+
+/* Queue message in b for peer, or drop the peer if it is too far behind. */
+static void net_peer_queue(struct net_server *s, struct net_peer *p, const struct net_buf *b)
+{
+	size_t n = b->size - b->head;
+
+	if (p->dead)
+		return;
+
+	if (p->out.size - p->out.head + n > NET_QUEUE_MAX || nb_put(&p->out, b->data + b->head, n)) {
+		dbgf("net: dropping client %d\n", p->fd);
+		p->dead = 1;
+		++s->stats.dropped;
+		return;
+	}
+
+	s->stats.bytes += n;
+	s->stats.tick_bytes += n;
+	++s->stats.messages;
+}
+
+static void net_peer_send(struct net_server *s, struct net_peer *p)
+{
+	int blocked = p->blocked;
+	struct epoll_event ev;
+
+	if (p->dead)
+		return;
+
+	if (net_send(p->fd, &p->out, &p->blocked)) {
+		p->dead = 1;
+		return;
+	}
+
+	if (blocked == p->blocked)
+		return;
+
+	// only ask for room in the socket while we have something to send
+	ev.events = EPOLLIN | (p->blocked ? EPOLLOUT : 0);
+	ev.data.ptr = p;
+
+	if (epoll_ctl(s->epfd, EPOLL_CTL_MOD, p->fd, &ev))
+		p->dead = 1;
+}
+
+/* Close peers that are dead. */
+static void net_sweep(struct net_server *s)
+{
+	for (unsigned i = 0; i < s->npeers;) {
+		struct net_peer *p = s->peers[i];
+
+		if (!p->dead) {
+			++i;
+			continue;
+		}
+
+		net_peer_free(p);
+		s->peers[i] = s->peers[--s->npeers];
+	}
+}
+
+static int net_snapshot(struct net_server *s, struct net_buf *b)
+{
+	unsigned char *data;
+	size_t size, start;
+	int error;
+
+	if ((error = ot_encode(s->o, &data, &size)))
+		return error;
+
+	if (!(error = net_begin(b, NET_SNAPSHOT, &start)) && !(error = nb_le(b, s->tick, 4)) && !(error = nb_put(b, data, size)))
+		error = net_end(b, start);
+
+	free(data);
+	return error;
+}
+
+static int net_accept(struct net_server *s)
+{
+	struct epoll_event ev;
+	struct net_peer *p;
+	int fd, error;
+
+	while ((fd = accept(s->fd, NULL, NULL)) != -1) {
+		if (s->npeers == NET_CLIENTS_MAX || !(p = calloc(1, sizeof *p))) {
+			close(fd);
+			continue;
+		}
+
+		p->fd = fd;
+		ev.events = EPOLLIN;
+		ev.data.ptr = p;
+
+		if ((error = net_nonblock(fd)) || epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev)) {
+			net_peer_free(p);
+			continue;
+		}
+
+		s->peers[s->npeers++] = p;
+		++s->stats.accepted;
+
+		// one snapshot for everyone who joins now, all changes after it come with the next flush
+		if (!s->msg.size && (error = net_snapshot(s, &s->msg))) {
+			// drop what was written, or the next one to join gets half a frame
+			s->msg.head = s->msg.size = 0;
+			p->dead = 1;
+			continue;
+		}
+
+		++s->stats.snapshots;
+		net_peer_queue(s, p, &s->msg);
+		net_peer_send(s, p);
+	}
+
+	s->msg.head = s->msg.size = 0;
+	return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : errno;
+}
+
+static int net_request(struct net_server *s, struct net_peer *p)
+{
+	struct net_reader r;
+	unsigned type;
+	int ret, error;
+
+	while ((ret = net_next(&p->in, NET_REQUEST_MAX, &type, &r)) > 0) {
+		if (type != NET_SET || (error = net_get_cells(&r, s->o)) == EINVAL || r.pos != r.end) {
+			dbgf("net: bad request from client %d\n", p->fd);
+			return EINVAL;
+		}
+
+		// the world is still sane, just drop the change
+		if (error)
+			dbgf("net: could not apply change: %s\n", strerror(error));
+	}
+
+	return ret < 0 ? EINVAL : 0;
+}
+
+/*
+ * Read and apply what p has sent. Requests are applied after each read, so
+ * p->in never holds more than one partial request and one read, and a client
+ * that keeps sending cannot hold up the tick for more than NET_PEER_READ.
+ * The rest is reported again by the next epoll_wait.
+ */
+static int net_peer_recv(struct net_server *s, struct net_peer *p)
+{
+	uint64_t bytes = 0, last;
+	int error;
+
+	do {
+		last = bytes;
+		error = net_recv(p->fd, &p->in, NET_RECV, &bytes);
+
+		// changes that did arrive still count
+		if (net_request(s, p))
+			return EINVAL;
+	} while (!error && bytes - last == NET_RECV && bytes < NET_PEER_READ);
+
+	return error;
+}
+
+/* Accept clients, apply their changes and send what is pending. Never blocks. */
+int net_server_poll(struct net_server *s)
+{
+	struct epoll_event ev[NET_EVENTS];
+	int n, error = 0;
+
+	do {
+		if ((n = epoll_wait(s->epfd, ev, NET_EVENTS, 0)) == -1)
+			return errno == EINTR ? 0 : errno;
+
+		for (int i = 0; i < n; ++i) {
+			struct net_peer *p = ev[i].data.ptr;
+
+			if (!p) {
+				if ((error = net_accept(s)))
+					break;
+				continue;
+			}
+
+			if (p->dead)
+				continue;
+
+			if ((ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && net_peer_recv(s, p)) {
+				p->dead = 1;
+				continue;
+			}
+
+			if (ev[i].events & EPOLLOUT)
+				net_peer_send(s, p);
+		}
+
+		net_sweep(s);
+	} while (!error && n == NET_EVENTS);
+
+	return error;
+}
+
+/*
+ * End the current tick: send everyone the cells that have changed since the
+ * last flush, or a snapshot if too much has changed.
+ */
+int net_server_flush(struct net_server *s)
+{
+	struct net_buf *b = &s->msg;
+	size_t start;
+	int error = 0;
+
+	s->stats.tick_bytes = 0;
+	b->head = b->size = 0;
+
+	if (s->resync) {
+		if ((error = net_snapshot(s, b)))
+			goto fail;
+
+		s->stats.snapshots += s->npeers;
+	} else if (s->ncells || s->nboxes) {
+		if ((error = net_begin(b, NET_DELTA, &start)) || (error = nb_le(b, s->tick, 4)) || (error = nb_le(b, net_clock(), 8))
+			|| (error = net_put_cells(b, s->o, s->cells, s->ncells)) || (error = net_put_boxes(b, s->o, s->boxes, s->nboxes))
+			|| (error = net_end(b, start)))
+			goto fail;
+	}
+
+	for (unsigned i = 0; i < s->npeers; ++i) {
+		if (b->size)
+			net_peer_queue(s, s->peers[i], b);
+
+		net_peer_send(s, s->peers[i]);
+	}
+
+	net_sweep(s);
+fail:
+	// a failed message can't be sent later, so everyone needs to start over
+	s->resync = error != 0;
+	s->ncells = s->nboxes = 0;
+	b->head = b->size = 0;
+	++s->tick;
+	return error;
+}
+
+/* Connect to the server at host and port. Only this waits for the network, the rest never blocks. */
+int net_client_init(struct net_client *c, struct ot_pool *o, const char *host, unsigned short port)
+{
+	struct addrinfo hints, *res, *ai;
+	char service[8];
+	int error;
+
+	memset(c, 0, sizeof *c);
+	c->o = o;
+	c->fd = -1;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(service, sizeof service, "%u", port);
+
+	if ((error = getaddrinfo(host, service, &hints, &res)))
+		return error == EAI_SYSTEM ? errno : EHOSTUNREACH;
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if ((c->fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) == -1)
+			continue;
+
+		if (!connect(c->fd, ai->ai_addr, ai->ai_addrlen))
+			break;
+
+		close(c->fd);
+		c->fd = -1;
+	}
+
+	error = c->fd == -1 ? (errno ? errno : ECONNREFUSED) : 0;
+	freeaddrinfo(res);
+
+	if (error)
+		return error;
+
+	if ((error = net_nonblock(c->fd))) {
+		close(c->fd);
+		return error;
+	}
+
+	return 0;
+}
+
+void net_client_free(struct net_client *c)
+{
+	close(c->fd);
+	free(c->in.data);
+	free(c->out.data);
+	free(c->cells);
+
+	if (c->ready)
+		ot_free(c->o);
+}
+
+static int net_message(struct net_client *c, unsigned type, struct net_reader *r)
+{
+	uint64_t tick, stamp;
+	struct ot_pool o;
+	int error;
+
+	if (nr_le(r, &tick, 4))
+		return EINVAL;
+
+	switch (type) {
+	case NET_SNAPSHOT:
+		if ((error = ot_decode(&o, r->pos, (size_t)(r->end - r->pos))))
+			return error;
+
+		// snapshots of the old tree may still be read
+		if (!c->ready) {
+			*c->o = o;
+		} else if ((error = ot_replace(c->o, &o))) {
+			ot_free(&o);
+			return error;
+		}
+
+		c->ready = 1;
+		++c->snapshots;
+		c->tick = (uint32_t)tick;
+		return 0;
+	case NET_DELTA:
+		if (!c->ready || nr_le(r, &stamp, 8))
+			return EINVAL;
+
+		if ((error = net_get_cells(r, c->o)) || (error = net_get_boxes(r, c->o)))
+			return error;
+
+		if (r->pos != r->end)
+			return EINVAL;
+
+		c->tick = (uint32_t)tick;
+
+		if (c->applied)
+			c->applied(c, c->tick, stamp);
+		return 0;
+	}
+
+	return EINVAL;
+}
+
+/* Apply everything the server has sent and send our pending changes. Returns ECONNRESET once the server is gone. */
+int net_client_poll(struct net_client *c)
+{
+	struct net_reader r;
+	unsigned type;
+	int ret, error, blocked;
+
+	error = net_recv(c->fd, &c->in, SIZE_MAX, &c->bytes);
+
+	// handle what did arrive, even if the connection is gone now
+	while ((ret = net_next(&c->in, NET_FRAME_MAX, &type, &r)) > 0) {
+		int err;
+
+		if ((err = net_message(c, type, &r)))
+			return err;
+	}
+
+	if (ret < 0)
+		return EINVAL;
+
+	if (error)
+		return error;
+
+	return net_send(c->fd, &c->out, &blocked);
+}
+
+/* Change cell in our copy and send it with the next net_client_flush. Returns EAGAIN if there is no copy yet. */
+int net_client_set_cell(struct net_client *c, int x, int y, int z, block_t id)
+{
+	int error;
+
+	if (!c->ready)
+		return EAGAIN;
+
+	if ((error = ot_set_cell(c->o, x, y, z, id)))
+		return error;
+
+	return net_push_cell(&c->cells, &c->ncells, &c->cellcap, x, y, z);
+}
+
+int net_client_flush(struct net_client *c)
+{
+	size_t start;
+	int error, blocked;
+
+	if (c->ncells) {
+		if (c->out.size - c->out.head > NET_QUEUE_MAX)
+			return ENOBUFS;
+
+		if ((error = net_begin(&c->out, NET_SET, &start)) || (error = net_put_cells(&c->out, c->o, c->cells, c->ncells))
+			|| (error = net_end(&c->out, start)))
+			return error;
+
+		c->ncells = 0;
+	}
+
+	return net_send(c->fd, &c->out, &blocked);
+}
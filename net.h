@@ -0,0 +1,126 @@
+#ifndef NET_H
+#define NET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ot.h"
+
+// default TCP port
+#define NET_PORT 25665
+// upper limit for number of connected clients
+#define NET_CLIENTS_MAX 256
+// bytes a peer may fall behind before it is dropped
+#define NET_QUEUE_MAX ((size_t)16 << 20)
+// largest message a client accepts, snapshots included
+#define NET_FRAME_MAX ((size_t)64 << 20)
+// largest message the server accepts from a client
+#define NET_REQUEST_MAX ((size_t)1 << 20)
+// changed boxes bigger than this many cells are sent as a new snapshot instead
+#define NET_BOX_MAX (64 * 64 * 64)
+
+/*
+ * Each message starts with its length in 4 bytes little endian, which covers
+ * the type byte and the payload. Integers in the payload are LEB128 varints,
+ * signed ones zigzag encoded, unless noted otherwise.
+ */
+// tick (4 bytes) and the whole tree as written by ot_encode
+#define NET_SNAPSHOT 1
+// tick (4 bytes), send time (8 bytes) and the changes since the last message
+#define NET_DELTA 2
+// changes by a client
+#define NET_SET 3
+
+/* Byte queue, everything before head has been handled already. */
+struct net_buf {
+	unsigned char *data;
+	size_t head, size, cap;
+};
+
+struct net_peer {
+	int fd;
+	// closed once the current batch of events is done
+	int dead;
+	// waiting for room in the socket
+	int blocked;
+	struct net_buf in, out;
+};
+
+struct net_box {
+	int min[3], max[3];
+};
+
+struct net_stats {
+	// bytes and messages queued for all clients together
+	uint64_t bytes, messages, snapshots;
+	// bytes queued by the last net_server_flush
+	size_t tick_bytes;
+	unsigned long accepted, dropped;
+};
+
+/*
+ * Replicates o to all connected clients. New clients get a snapshot of the
+ * whole tree, after that each net_server_flush sends one message with all
+ * cells that have changed since the last one. Changes are reported with
+ * net_server_touch, which is meant to be called from o->touch. All sockets are
+ * non-blocking and are only served from net_server_poll and net_server_flush.
+ */
+struct net_server {
+	struct ot_pool *o;
+	int fd, epfd;
+	unsigned short port;
+	struct net_peer **peers;
+	unsigned npeers;
+	// positions of single cells and boxes that changed since the last flush
+	struct ot_cell *cells;
+	size_t ncells, cellcap;
+	struct net_box *boxes;
+	size_t nboxes, boxcap;
+	// too much has changed to send, everyone gets a new snapshot instead
+	int resync;
+	uint32_t tick;
+	// message that is sent to everyone
+	struct net_buf msg;
+	struct net_stats stats;
+};
+
+int net_server_init(struct net_server *s, struct ot_pool *o, unsigned short port);
+void net_server_free(struct net_server *s);
+
+void net_server_touch(struct net_server *s, const int min[3], const int max[3]);
+int net_server_poll(struct net_server *s);
+int net_server_flush(struct net_server *s);
+
+/*
+ * Copy of the tree of a server in o, which is initialised by the first
+ * snapshot. Changes made with net_client_set_cell show up in o right away and
+ * are sent by net_client_flush, the server then sends them to everyone.
+ */
+struct net_client {
+	struct ot_pool *o;
+	int fd;
+	// set once o holds a snapshot
+	int ready;
+	// tick of the last message from the server
+	uint32_t tick;
+	// snapshots received, each one replaces o as a whole
+	unsigned long snapshots;
+	struct net_buf in, out;
+	struct ot_cell *cells;
+	size_t ncells, cellcap;
+	uint64_t bytes;
+	// Called after a delta has been applied, may be NULL. stamp is net_clock of the server when it was sent.
+	void (*applied)(struct net_client *c, uint32_t tick, uint64_t stamp);
+	void *arg;
+};
+
+int net_client_init(struct net_client *c, struct ot_pool *o, const char *host, unsigned short port);
+void net_client_free(struct net_client *c);
+
+int net_client_poll(struct net_client *c);
+int net_client_set_cell(struct net_client *c, int x, int y, int z, block_t id);
+int net_client_flush(struct net_client *c);
+
+uint64_t net_clock(void);
+
+#endif
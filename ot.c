@@ -0,0 +1,2653 @@
+/*
+ * Octree node pool.
+ *
+ * Made by Folkert van Verseveld
+ *
+ * Copyright Folkert van Verseveld. All rights reserved.
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "dbg.h"
+#include "ot.h"
+#include "trace.h"
+#include "varint.h"
+
+// node indices must fit in 32 bits
+#define OT_MAXCAP ((size_t)UINT32_MAX + 1 < SIZE_MAX / sizeof(struct ot_node) ? (size_t)UINT32_MAX + 1 : (SIZE_MAX / sizeof(struct ot_node)) & ~(size_t)7)
+
+// generation or epoch a is newer than b, also when the counter has wrapped
+static inline int gen_after(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) > 0;
+}
+
+int ot_init(struct ot_pool *o, size_t cap, size_t rcap, unsigned size)
+{
+	struct ot_node *nodes;
+	uint32_t *parents, *gens, *epochs, *rpop;
+
+	if (cap < 16 || (cap & 7) || cap > OT_MAXCAP || !rcap || size < 2 || size > OT_SIZE_MAX || (size & (size - 1)))
+		return EINVAL;
+
+	if (!(nodes = malloc(cap * sizeof *nodes)))
+		return ENOMEM;
+	if (!(parents = malloc((cap >> 3) * sizeof *parents))) {
+		free(nodes);
+		return ENOMEM;
+	}
+	if (!(gens = malloc((cap >> 3) * sizeof *gens))) {
+		free(parents);
+		free(nodes);
+		return ENOMEM;
+	}
+	if (!(epochs = malloc((cap >> 3) * sizeof *epochs))) {
+		free(gens);
+		free(parents);
+		free(nodes);
+		return ENOMEM;
+	}
+	if (!(rpop = malloc(rcap * sizeof *rpop))) {
+		free(epochs);
+		free(gens);
+		free(parents);
+		free(nodes);
+		return ENOMEM;
+	}
+
+	// group 0 is reserved for the root
+	memset(nodes, 0, 8 * sizeof *nodes);
+	nodes[0].type = ONT_CELL;
+	parents[0] = 0;
+	gens[0] = 0;
+	epochs[0] = 0;
+
+	o->nodes = nodes;
+	o->parents = parents;
+	o->gens = gens;
+	o->gen = 1;
+	o->epochs = epochs;
+	o->epoch = 0;
+	o->snaps = o->snaps_tail = NULL;
+	o->retired = NULL;
+	o->nretired = o->retcap = 0;
+	o->root = 0;
+	o->count = 8;
+	o->cap = cap;
+	o->blocks = 0;
+	o->root_size = size;
+	o->touch = NULL;
+
+	o->rpop = rpop;
+	o->rcount = 0;
+	o->rcap = rcap;
+
+	return 0;
+}
+
+/* All snapshots must have been released, they can't be used after this. */
+void ot_free(struct ot_pool *o)
+{
+	struct ot_snap *s;
+
+	while ((s = o->snaps)) {
+		o->snaps = s->next;
+		free(s);
+	}
+
+	for (size_t i = 0; i < o->nretired; ++i)
+		free(o->retired[i].mem);
+
+	free(o->retired);
+	free(o->rpop);
+	free(o->epochs);
+	free(o->gens);
+	free(o->parents);
+	free(o->nodes);
+}
+
+/*
+ * Make a deep copy of src. Since nodes only store indices, this is just a copy
+ * of each array. The copy has no snapshots, so retired groups are free in it.
+ */
+int ot_copy(struct ot_pool *dst, const struct ot_pool *src)
+{
+	struct ot_node *nodes;
+	uint32_t *parents, *gens, *epochs, *rpop;
+	size_t rcap = src->rcount;
+
+	for (size_t i = 0; i < src->nretired; ++i)
+		rcap += !src->retired[i].mem;
+
+	rcap = rcap > src->rcap ? rcap : src->rcap;
+
+	if (!(nodes = malloc(src->count * sizeof *nodes)))
+		return ENOMEM;
+	if (!(parents = malloc((src->count >> 3) * sizeof *parents))) {
+		free(nodes);
+		return ENOMEM;
+	}
+	if (!(gens = malloc((src->count >> 3) * sizeof *gens))) {
+		free(parents);
+		free(nodes);
+		return ENOMEM;
+	}
+	if (!(epochs = malloc((src->count >> 3) * sizeof *epochs))) {
+		free(gens);
+		free(parents);
+		free(nodes);
+		return ENOMEM;
+	}
+	if (!(rpop = malloc(rcap * sizeof *rpop))) {
+		free(epochs);
+		free(gens);
+		free(parents);
+		free(nodes);
+		return ENOMEM;
+	}
+
+	memcpy(nodes, src->nodes, src->count * sizeof *nodes);
+	memcpy(parents, src->parents, (src->count >> 3) * sizeof *parents);
+	memcpy(gens, src->gens, (src->count >> 3) * sizeof *gens);
+	memcpy(epochs, src->epochs, (src->count >> 3) * sizeof *epochs);
+	memcpy(rpop, src->rpop, src->rcount * sizeof *rpop);
+
+	*dst = *src;
+	dst->nodes = nodes;
+	dst->parents = parents;
+	dst->gens = gens;
+	dst->epochs = epochs;
+	dst->cap = src->count;
+	dst->rpop = rpop;
+	dst->rcap = rcap;
+	dst->snaps = dst->snaps_tail = NULL;
+	dst->retired = NULL;
+	dst->nretired = dst->retcap = 0;
+
+	for (size_t i = 0; i < src->nretired; ++i)
+		if (!src->retired[i].mem)
+			rpop[dst->rcount++] = src->retired[i].group;
+
+	return 0;
+}
+
+/* Ensure there is room to retire another n groups or arrays. */
+static int retire_reserve(struct ot_pool *o, size_t n)
+{
+	struct ot_retired *data;
+	size_t newcap;
+
+	if (o->retcap - o->nretired >= n)
+		return 0;
+
+	if (o->nretired > SIZE_MAX / sizeof *data / 2 - n)
+		return EOVERFLOW;
+
+	for (newcap = o->retcap ? o->retcap : OT_RCAP; newcap - o->nretired < n;)
+		newcap <<= 1;
+
+	if (!(data = realloc(o->retired, newcap * sizeof *data)))
+		return ENOMEM;
+
+	o->retired = data;
+	o->retcap = newcap;
+	return 0;
+}
+
+/* Keep group or mem until all snapshots that can see it are gone. There must be room, see retire_reserve. */
+static void ot_retire(struct ot_pool *o, uint32_t group, void *mem)
+{
+	struct ot_retired *r = &o->retired[o->nretired++];
+
+	r->epoch = o->epoch;
+	r->group = group;
+	r->mem = mem;
+}
+
+/*
+ * Replace the tree of o by src, which o takes over, for example to load a new
+ * world. Unlike ot_free followed by an assignment, snapshots of o stay valid:
+ * only the node array is kept for them, as none of the other arrays are read
+ * by snapshots. src must not have snapshots itself. On error o and src are
+ * left alone.
+ */
+int ot_replace(struct ot_pool *o, struct ot_pool *src)
+{
+	size_t kept = 0;
+	int error;
+
+	ot_reclaim(o);
+
+	if (!o->snaps) {
+		void (*touch)(struct ot_pool*, const int*, const int*) = o->touch;
+
+		ot_free(o);
+		*o = *src;
+		o->touch = touch;
+		return 0;
+	}
+
+	if ((error = retire_reserve(o, 1)))
+		return error;
+
+	// retired groups belong to the old tree, so only the arrays matter
+	for (size_t i = 0; i < o->nretired; ++i)
+		if (o->retired[i].mem)
+			o->retired[kept++] = o->retired[i];
+
+	o->nretired = kept;
+	ot_retire(o, 0, o->nodes);
+
+	free(src->retired);
+	free(o->rpop);
+	free(o->epochs);
+	free(o->gens);
+	free(o->parents);
+
+	// no snapshot can see the new tree
+	for (size_t i = 0; i < src->count >> 3; ++i)
+		src->epochs[i] = o->epoch;
+
+	o->nodes = src->nodes;
+	o->parents = src->parents;
+	o->gens = src->gens;
+	o->gen = src->gen;
+	o->epochs = src->epochs;
+	o->root = src->root;
+	o->count = src->count;
+	o->cap = src->cap;
+	o->rpop = src->rpop;
+	o->rcount = src->rcount;
+	o->rcap = src->rcap;
+	o->blocks = src->blocks;
+	o->root_size = src->root_size;
+	return 0;
+}
+
+/*
+ * Grow or shrink node capacity. cap must be able to hold all allocated nodes.
+ * Snapshots may still read the old array, so it is only moved by realloc if
+ * there are none.
+ */
+int ot_reserve(struct ot_pool *o, size_t cap)
+{
+	struct ot_node *nodes;
+	uint32_t *parents, *gens, *epochs;
+	int error;
+
+	if (cap < o->count || (cap & 7) || cap > OT_MAXCAP)
+		return EINVAL;
+
+	if (!o->snaps) {
+		if (!(nodes = realloc(o->nodes, cap * sizeof *nodes)))
+			return ENOMEM;
+	} else {
+		if ((error = retire_reserve(o, 1)))
+			return error;
+
+		if (!(nodes = malloc(cap * sizeof *nodes)))
+			return ENOMEM;
+
+		memcpy(nodes, o->nodes, o->count * sizeof *nodes);
+		ot_retire(o, 0, o->nodes);
+	}
+	o->nodes = nodes;
+
+	if (!(parents = realloc(o->parents, (cap >> 3) * sizeof *parents))) {
+		// nodes are already resized, so keep them consistent with parents
+		if (cap > o->cap)
+			return ENOMEM;
+	} else {
+		o->parents = parents;
+	}
+
+	if (!(gens = realloc(o->gens, (cap >> 3) * sizeof *gens))) {
+		if (cap > o->cap)
+			return ENOMEM;
+	} else {
+		o->gens = gens;
+	}
+
+	if (!(epochs = realloc(o->epochs, (cap >> 3) * sizeof *epochs))) {
+		if (cap > o->cap)
+			return ENOMEM;
+	} else {
+		o->epochs = epochs;
+	}
+
+	o->cap = cap;
+	return 0;
+}
+
+/* Take a group from the free list or the end of the pool, which may move the pool. */
+static int ot_alloc(struct ot_pool *o, uint32_t *group)
+{
+	int error;
+
+	// check for resize
+	if (!o->rcount && o->count > o->cap - 8) {
+		size_t maxcap = OT_MAXCAP;
+
+		if (o->cap >= maxcap)
+			return EOVERFLOW;
+
+		uint64_t t = trace_start();
+
+		error = ot_reserve(o, o->cap > maxcap >> 1 ? maxcap : o->cap << 1);
+		trace_span("ot_reserve", t);
+
+		if (error)
+			return error;
+	}
+
+	if (o->rcount) {
+		*group = o->rpop[--o->rcount];
+	} else {
+		*group = (uint32_t)(o->count >> 3);
+		o->count += 8;
+	}
+
+	o->epochs[*group] = o->epoch;
+	return 0;
+}
+
+/* Split cell node n into 8 children. n must be writable, see ot_own. */
+int ot_split(struct ot_pool *o, size_t n)
+{
+	struct ot_node *children;
+	uint32_t group;
+	uint64_t t = trace_start();
+	int error;
+
+	assert((o->nodes[n].type & ONT_TYPE_MASK) != ONT_SPLIT);
+
+	if ((error = ot_alloc(o, &group)))
+		return error;
+
+	children = ot_group(o, group);
+	o->parents[group] = (uint32_t)n;
+	// nothing changed, but a change of n itself may not have been seen yet
+	o->gens[group] = o->gens[n >> 3];
+
+	// each child inherits the block id of the octant it replaces
+	for (unsigned i = 0; i < 8; ++i) {
+		block_t id = o->nodes[n].data.cells[i];
+
+		children[i].type = i | (id ? ONT_UNIFORM | ONT_CELL_MASK : ONT_CELL);
+
+		for (unsigned j = 0; j < 8; ++j)
+			children[i].data.cells[j] = id;
+	}
+
+	// the children represent the same ids, so the representative stays the same
+	o->nodes[n].type = (o->nodes[n].type & ONT_SIDE_MASK) | ONT_SPLIT | (uint32_t)ot_rep(&o->nodes[n]) << ONT_REP_SHIFT;
+	o->nodes[n].data.children = group;
+
+	trace_span("ot_split", t);
+	return 0;
+}
+
+static inline int cells_uniform(const struct ot_node *n)
+{
+	for (unsigned i = 1; i < 8; ++i)
+		if (n->data.cells[i] != n->data.cells[0])
+			return 0;
+
+	return 1;
+}
+
+/* Recompute node type and cell mask of cell node n from its cells. */
+static void node_retype(struct ot_node *n)
+{
+	uint32_t type = n->type & ONT_SIDE_MASK;
+
+	for (unsigned i = 0; i < 8; ++i)
+		if (n->data.cells[i])
+			type |= 0x100 << i;
+
+	if ((type & ONT_CELL_MASK) == ONT_CELL_MASK && cells_uniform(n))
+		type |= ONT_UNIFORM;
+	else
+		type |= ONT_CELL;
+
+	n->type = type;
+}
+
+/* Ensure there is room for another n free groups. */
+static int rpop_reserve(struct ot_pool *o, size_t n)
+{
+	size_t maxcap, newcap;
+	uint32_t *data;
+
+	if (o->rcap - o->rcount >= n)
+		return 0;
+
+	maxcap = SIZE_MAX / sizeof(uint32_t);
+
+	if (o->rcount > maxcap - n)
+		// can't resize anymore, should never happen
+		return EOVERFLOW;
+
+	for (newcap = o->rcap; newcap - o->rcount < n;)
+		newcap = newcap > maxcap >> 1 ? maxcap : newcap << 1;
+
+	data = realloc(o->rpop, newcap * sizeof(uint32_t));
+
+	if (!data)
+		return ENOMEM;
+
+	o->rpop = data;
+	o->rcap = newcap;
+
+	return 0;
+}
+
+/*
+ * Check whether a snapshot may see group. The root group never is, since each
+ * snapshot gets its own copy of it. A group that was allocated after the
+ * newest snapshot is only part of the pool, and so are all its ancestors.
+ */
+static inline int ot_shared(const struct ot_pool *o, uint32_t group)
+{
+	return group && o->snaps && !gen_after(o->epochs[group], o->snaps_tail->epoch);
+}
+
+/* Ensure that another n groups can be given back with ot_release. */
+static int release_reserve(struct ot_pool *o, size_t n)
+{
+	int error;
+
+	if ((error = rpop_reserve(o, n)))
+		return error;
+
+	return o->snaps ? retire_reserve(o, n) : 0;
+}
+
+/* Put group on the free list, or keep it around for as long as snapshots may see it. */
+static void ot_release(struct ot_pool *o, uint32_t group)
+{
+	if (ot_shared(o, group))
+		ot_retire(o, group, NULL);
+	else
+		o->rpop[o->rcount++] = group;
+}
+
+/*
+ * Make node n writable and update n to where it ends up. If a snapshot may see
+ * its group, the group is copied and the parent is pointed at the copy, which
+ * makes the parent writable first. So the whole path up to the first group
+ * that isn't shared is copied once and changes after that are in place. This
+ * may move the pool.
+ */
+static int ot_own(struct ot_pool *o, size_t *n)
+{
+	uint32_t group = (uint32_t)(*n >> 3), copy;
+	struct ot_node *nodes;
+	size_t p;
+	int error;
+
+	if (!ot_shared(o, group))
+		return 0;
+
+	// the snapshots that see it may have been released already
+	ot_reclaim(o);
+
+	if (!ot_shared(o, group))
+		return 0;
+
+	p = ot_parent(o, *n);
+
+	// the pool may have to move too
+	if ((error = ot_own(o, &p)) || (error = retire_reserve(o, 2)) || (error = ot_alloc(o, &copy)))
+		return error;
+
+	nodes = ot_group(o, copy);
+	memcpy(nodes, ot_group(o, group), 8 * sizeof *nodes);
+	o->parents[copy] = (uint32_t)p;
+	o->gens[copy] = o->gens[group];
+	o->nodes[p].data.children = copy;
+
+	for (unsigned i = 0; i < 8; ++i)
+		if ((nodes[i].type & ONT_TYPE_MASK) == ONT_SPLIT)
+			o->parents[nodes[i].data.children] = (copy << 3) + i;
+
+	ot_retire(o, group, NULL);
+	*n = ((size_t)copy << 3) + (*n & 7);
+	return 0;
+}
+
+/* Make all children of split node n writable, n must be writable already. Returns the index of the first child. */
+static int ot_own_children(struct ot_pool *o, size_t n, size_t *children)
+{
+	*children = (size_t)o->nodes[n].data.children << 3;
+	return ot_own(o, children);
+}
+
+/*
+ * Turn split node n back into a cell node. This only works if all children
+ * are uniform cell or uniform nodes. The children group is put on the free
+ * list. n must be writable, see ot_own.
+ */
+int ot_unsplit(struct ot_pool *o, size_t n)
+{
+	struct ot_node *node = &o->nodes[n], *children;
+	uint32_t group;
+	int error;
+
+	assert((node->type & ONT_TYPE_MASK) == ONT_SPLIT);
+
+	group = node->data.children;
+	children = ot_group(o, group);
+
+	for (unsigned i = 0; i < 8; ++i)
+		if ((children[i].type & ONT_TYPE_MASK) == ONT_SPLIT || !cells_uniform(&children[i]))
+			return ENOTEMPTY;
+
+	if ((error = release_reserve(o, 1)))
+		return error;
+
+	for (unsigned i = 0; i < 8; ++i)
+		node->data.cells[i] = children[i].data.cells[0];
+
+	node_retype(node);
+	ot_release(o, group);
+
+	return 0;
+}
+
+/*
+ * Record a change of node n: stamp its group and the groups of all its
+ * ancestors with the current generation and mark the representatives of its
+ * ancestors as stale. Ancestors are always at least as new and stale as their
+ * descendants, so we can stop as soon as both are already done.
+ */
+static void ot_changed(struct ot_pool *o, size_t n)
+{
+	int stale = 1;
+
+	for (;;) {
+		uint32_t *gen = &o->gens[n >> 3];
+		int done = *gen == o->gen;
+
+		*gen = o->gen;
+
+		if (n == o->root)
+			break;
+
+		n = ot_parent(o, n);
+
+		if (stale) {
+			if (o->nodes[n].type & ONT_STALE)
+				stale = 0;
+			else
+				o->nodes[n].type |= ONT_STALE;
+		}
+
+		if (done && !stale)
+			break;
+	}
+}
+
+/* Put block id at pos in cell node n and update block count. */
+static void ot_put(struct ot_pool *o, size_t n, unsigned pos, block_t id)
+{
+	struct ot_node *node = &o->nodes[n];
+
+	if (!id)
+		--o->blocks;
+	else if (!node->data.cells[pos])
+		++o->blocks;
+
+	node->data.cells[pos] = id;
+	node_retype(node);
+	ot_changed(o, n);
+}
+
+static inline void ot_touch(struct ot_pool *o, int x, int y, int z)
+{
+	if (o->touch) {
+		int min[3] = {x, y, z}, max[3] = {x + 1, y + 1, z + 1};
+		o->touch(o, min, max);
+	}
+}
+
+/* Fold cell node n and its ancestors into their parents for as long as they are uniform. */
+static int ot_collapse(struct ot_pool *o, size_t n)
+{
+	int error;
+
+	while (n != o->root && cells_uniform(&o->nodes[n])) {
+		n = ot_parent(o, n);
+
+		if ((error = ot_unsplit(o, n)))
+			return error == ENOTEMPTY ? 0 : error;
+	}
+
+	return 0;
+}
+
+static uint32_t ot_compact_group(const struct ot_pool *o, struct ot_node *nodes, uint32_t *parents, uint32_t *gens, uint32_t dst, uint32_t next)
+{
+	for (unsigned i = 0; i < 8; ++i) {
+		struct ot_node *n = &nodes[((size_t)dst << 3) + i];
+
+		if ((n->type & ONT_TYPE_MASK) != ONT_SPLIT)
+			continue;
+
+		uint32_t g = next++;
+
+		memcpy(&nodes[(size_t)g << 3], ot_group(o, n->data.children), 8 * sizeof *nodes);
+		parents[g] = (dst << 3) + i;
+		gens[g] = o->gens[n->data.children];
+		n->data.children = g;
+
+		next = ot_compact_group(o, nodes, parents, gens, g, next);
+	}
+
+	return next;
+}
+
+/*
+ * Defragment the pool: copy all live groups depth-first into a new array
+ * that is just big enough, drop the free list and release the old memory.
+ * Snapshots keep reading the old array, so it is retired instead.
+ */
+int ot_compact(struct ot_pool *o)
+{
+	struct ot_node *nodes;
+	uint32_t *parents, *gens, *epochs, *rpop;
+	size_t live, cap, kept = 0;
+	int error;
+
+	live = o->count - (o->rcount << 3);
+
+	for (size_t i = 0; i < o->nretired; ++i)
+		if (!o->retired[i].mem)
+			live -= 8;
+
+	cap = live < 16 ? 16 : live;
+
+	if (o->snaps && (error = retire_reserve(o, 1)))
+		return error;
+
+	if (!(nodes = malloc(cap * sizeof *nodes)))
+		return ENOMEM;
+	if (!(parents = malloc((cap >> 3) * sizeof *parents))) {
+		free(nodes);
+		return ENOMEM;
+	}
+	if (!(gens = malloc((cap >> 3) * sizeof *gens))) {
+		free(parents);
+		free(nodes);
+		return ENOMEM;
+	}
+	if (!(epochs = malloc((cap >> 3) * sizeof *epochs))) {
+		free(gens);
+		free(parents);
+		free(nodes);
+		return ENOMEM;
+	}
+
+	memcpy(nodes, o->nodes, 8 * sizeof *nodes);
+	parents[0] = 0;
+	gens[0] = o->gens[0];
+
+	uint32_t groups = ot_compact_group(o, nodes, parents, gens, 0, 1);
+	assert((size_t)groups << 3 == live);
+	(void)groups;
+
+	// no snapshot can see the new array
+	for (size_t i = 0; i < cap >> 3; ++i)
+		epochs[i] = o->epoch;
+
+	// retired groups are gone, but arrays must still wait for the snapshots
+	for (size_t i = 0; i < o->nretired; ++i)
+		if (o->retired[i].mem)
+			o->retired[kept++] = o->retired[i];
+
+	o->nretired = kept;
+
+	free(o->epochs);
+	free(o->gens);
+	free(o->parents);
+
+	if (o->snaps)
+		ot_retire(o, 0, o->nodes);
+	else
+		free(o->nodes);
+
+	o->nodes = nodes;
+	o->parents = parents;
+	o->gens = gens;
+	o->epochs = epochs;
+	o->count = live;
+	o->cap = cap;
+	o->rcount = 0;
+
+	if (o->rcap > OT_RCAP && (rpop = realloc(o->rpop, OT_RCAP * sizeof *rpop))) {
+		o->rpop = rpop;
+		o->rcap = OT_RCAP;
+	}
+
+#ifdef __GLIBC__
+	malloc_trim(0);
+#endif
+	return 0;
+}
+
+/*
+ * Double the size of the world by putting a new level on top of the root.
+ * Each octant of the old root ends up in the corner of the new octant that
+ * faces the middle, so all cells keep their coordinates.
+ */
+int ot_grow(struct ot_pool *o)
+{
+	size_t root = o->root, avail = o->rcount + ((o->cap - o->count) >> 3), n;
+	struct ot_node old = o->nodes[root];
+	uint32_t group = 0;
+	int error;
+
+	if (o->root_size >= OT_SIZE_MAX)
+		return ERANGE;
+
+	// make sure nothing can fail halfway: 1 group for the new root and 8 for the old children
+	if (avail < 9 && (error = ot_reserve(o, o->count + 9 * 8 > o->cap << 1 ? o->count + 9 * 8 : o->cap << 1)))
+		return error;
+
+	if ((error = release_reserve(o, 9)))
+		return error;
+
+	// turn the root into air, so splitting it gives 8 air children
+	o->nodes[root].type = (old.type & ONT_SIDE_MASK) | ONT_CELL;
+	memset(&o->nodes[root].data, 0, sizeof o->nodes[root].data);
+
+	if ((error = ot_split(o, root)))
+		return error;
+
+	n = (size_t)o->nodes[root].data.children << 3;
+
+	if ((old.type & ONT_TYPE_MASK) != ONT_SPLIT) {
+		for (unsigned i = 0; i < 8; ++i) {
+			o->nodes[n + i].data.cells[7 - i] = old.data.cells[i];
+			node_retype(&o->nodes[n + i]);
+			ot_changed(o, n + i);
+		}
+	} else {
+		group = old.data.children;
+
+		for (unsigned i = 0; i < 8; ++i) {
+			size_t dst, src = ((size_t)group << 3) + i;
+
+			if ((error = ot_split(o, n + i)))
+				return error;
+
+			dst = ((size_t)o->nodes[n + i].data.children << 3) + 7 - i;
+			o->nodes[dst] = o->nodes[src];
+			o->nodes[dst].type = (o->nodes[dst].type & ~(uint32_t)ONT_SIDE_MASK) | (7 - i);
+
+			if ((o->nodes[dst].type & ONT_TYPE_MASK) == ONT_SPLIT)
+				o->parents[o->nodes[dst].data.children] = (uint32_t)dst;
+
+			ot_changed(o, dst);
+		}
+
+		ot_release(o, group);
+
+		// octants that were all air don't need the extra level
+		for (unsigned i = 0; i < 8; ++i)
+			if ((error = ot_unsplit(o, n + i)) && error != ENOTEMPTY)
+				return error;
+	}
+
+	o->root_size <<= 1;
+
+	error = ot_unsplit(o, root);
+	return error == ENOTEMPTY ? 0 : error;
+}
+
+/* Grow the world until it contains all cells with min <= (x,y,z) < max. */
+static int ot_fit(struct ot_pool *o, const int min[3], const int max[3])
+{
+	int error;
+
+	for (unsigned i = 0; i < 3; ++i)
+		while (min[i] < -(int)(o->root_size >> 1) || max[i] > (int)(o->root_size >> 1))
+			if ((error = ot_grow(o)))
+				return error;
+
+	return 0;
+}
+
+static inline int cell_air(const struct ot_node *n)
+{
+	return (n->type & ONT_TYPE_MASK) == ONT_CELL && !(n->type & ONT_CELL_MASK);
+}
+
+/*
+ * Check whether child i of the root only has something in the octant that
+ * faces the middle, which is all that is left of it after ot_shrink.
+ */
+static int ot_shrinkable(const struct ot_pool *o, const struct ot_node *n, unsigned i)
+{
+	if ((n->type & ONT_TYPE_MASK) != ONT_SPLIT) {
+		for (unsigned j = 0; j < 8; ++j)
+			if (j != 7 - i && n->data.cells[j])
+				return 0;
+
+		return 1;
+	}
+
+	for (unsigned j = 0; j < 8; ++j)
+		if (j != 7 - i && !cell_air(&ot_children(o, n)[j]))
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Halve the size of the world for as long as all cells outside the middle
+ * half are air, but not below size. This is the opposite of ot_grow.
+ */
+int ot_shrink(struct ot_pool *o, unsigned size)
+{
+	int error;
+
+	while (o->root_size > size && o->root_size > 2) {
+		struct ot_node *root = &o->nodes[o->root];
+		size_t n;
+
+		if ((root->type & ONT_TYPE_MASK) != ONT_SPLIT) {
+			// octants of the root touch the border, so they have to be air
+			if (root->type & ONT_CELL_MASK)
+				break;
+
+			o->root_size >>= 1;
+			continue;
+		}
+
+		n = (size_t)root->data.children << 3;
+
+		for (unsigned i = 0; i < 8; ++i)
+			if (!ot_shrinkable(o, &o->nodes[n + i], i))
+				return 0;
+
+		if ((error = release_reserve(o, 9)) || (error = ot_own(o, &n)))
+			return error;
+
+		// replace each child by its octant in the middle
+		for (unsigned i = 0; i < 8; ++i) {
+			struct ot_node *c = &o->nodes[n + i];
+
+			if ((c->type & ONT_TYPE_MASK) != ONT_SPLIT) {
+				block_t id = c->data.cells[7 - i];
+
+				for (unsigned j = 0; j < 8; ++j)
+					c->data.cells[j] = id;
+
+				node_retype(c);
+			} else {
+				uint32_t group = c->data.children;
+
+				*c = ot_group(o, group)[7 - i];
+				c->type = (c->type & ~(uint32_t)ONT_SIDE_MASK) | i;
+
+				if ((c->type & ONT_TYPE_MASK) == ONT_SPLIT)
+					o->parents[c->data.children] = (uint32_t)(n + i);
+
+				ot_release(o, group);
+			}
+
+			ot_changed(o, n + i);
+		}
+
+		o->root_size >>= 1;
+
+		if ((error = ot_unsplit(o, o->root)) && error != ENOTEMPTY)
+			return error;
+	}
+
+	return 0;
+}
+
+static inline unsigned cell_get_pos(int cx, int cy, int cz, int x, int y, int z)
+{
+	int dx, dy, dz;
+
+	dx = x >= cx;
+	dy = y >= cy;
+	dz = z >= cz;
+
+	return (dz << 2) + (dy << 1) + dx;
+}
+
+static inline void cell_pos_update(int *size, int *cx, int *cy, int *cz, int x, int y, int z)
+{
+	*size >>= 1;
+
+	*cx = x >= *cx ? *cx + *size : *cx - *size;
+	*cy = y >= *cy ? *cy + *size : *cy - *size;
+	*cz = z >= *cz ? *cz + *size : *cz - *size;
+}
+
+block_t ot_get_cell(const struct ot_pool *o, int x, int y, int z)
+{
+	assert(o->count);
+
+	// ignore if position out of boundaries
+	int size = (int)(o->root_size >> 1);
+
+	if (z < -size || y < -size || x < -size || z >= size || y >= size || x >= size)
+		return ID_AIR;
+
+	int cx = 0, cy = 0, cz = 0;
+	unsigned pos;
+
+	const struct ot_node *node = &o->nodes[o->root];
+
+	while (size > 1) {
+		pos = cell_get_pos(cx, cy, cz, x, y, z);
+
+		if ((node->type & ONT_TYPE_MASK) != ONT_SPLIT)
+			return node->data.cells[pos];
+
+		node = &ot_children(o, node)[pos];
+		cell_pos_update(&size, &cx, &cy, &cz, x, y, z);
+	}
+
+	pos = cell_get_pos(cx, cy, cz, x, y, z);
+	return node->data.cells[pos];
+}
+
+int ot_set_cell(struct ot_pool *o, int x, int y, int z, block_t id)
+{
+	int error;
+
+	// make room if position out of boundaries
+	int size = (int)(o->root_size >> 1);
+
+	if (z < -size || y < -size || x < -size || z >= size || y >= size || x >= size) {
+		int min[3] = {x, y, z}, max[3] = {x + 1, y + 1, z + 1};
+
+		if ((error = ot_fit(o, min, max)))
+			return error;
+
+		size = (int)(o->root_size >> 1);
+	}
+
+	int cx = 0, cy = 0, cz = 0;
+	unsigned pos;
+
+	// strategy: find closest node, split if bigger than 2, put block
+	size_t n = o->root;
+
+	while (size > 1) {
+		pos = cell_get_pos(cx, cy, cz, x, y, z);
+
+		if ((o->nodes[n].type & ONT_TYPE_MASK) != ONT_SPLIT) {
+			// nothing to do if the octant already has this id
+			if (o->nodes[n].data.cells[pos] == id)
+				return 0;
+
+			// split may move the pool, so always go through the index
+			if ((error = ot_own(o, &n)) || (error = ot_split(o, n)))
+				return error;
+		}
+
+		n = ((size_t)o->nodes[n].data.children << 3) + pos;
+
+		cell_pos_update(&size, &cx, &cy, &cz, x, y, z);
+	}
+
+	pos = cell_get_pos(cx, cy, cz, x, y, z);
+
+	if (o->nodes[n].data.cells[pos] == id)
+		return 0;
+
+	if ((error = ot_own(o, &n)))
+		return error;
+
+	ot_put(o, n, pos, id);
+	ot_touch(o, x, y, z);
+	return ot_collapse(o, n);
+}
+
+static inline uint64_t morton_spread(uint32_t v)
+{
+	uint64_t x = v & 0x1fffff;
+
+	x = (x | x << 32) & 0x1f00000000ffffULL;
+	x = (x | x << 16) & 0x1f0000ff0000ffULL;
+	x = (x | x << 8) & 0x100f00f00f00f00fULL;
+	x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+	x = (x | x << 2) & 0x1249249249249249ULL;
+
+	return x;
+}
+
+struct ot_key {
+	uint64_t code;
+	// index into cells and a copy of its id, so set does not have to gather
+	uint32_t idx;
+	block_t id;
+};
+
+static unsigned ot_levels(const struct ot_pool *o)
+{
+	unsigned levels = 1;
+
+	while ((2u << levels) <= o->root_size)
+		++levels;
+
+	return levels;
+}
+
+/*
+ * Compute morton codes for all cells within bounds and sort them with a
+ * stable radix sort. Returns NULL if out of memory, *count is set to the
+ * number of keys.
+ */
+static struct ot_key *ot_sort_cells(const struct ot_pool *o, const struct ot_cell *cells, size_t n, unsigned levels, size_t *count)
+{
+	struct ot_key *keys, *tmp, *swap;
+	int half = (int)(o->root_size >> 1);
+	size_t m = 0;
+
+	if (n > UINT32_MAX || !(keys = malloc((n ? 2 * n : 1) * sizeof *keys)))
+		return NULL;
+
+	tmp = keys + n;
+
+	for (size_t i = 0; i < n; ++i) {
+		const struct ot_cell *c = &cells[i];
+
+		if (c->z < -half || c->y < -half || c->x < -half || c->z >= half || c->y >= half || c->x >= half)
+			continue;
+
+		keys[m].code = morton_spread((uint32_t)(c->x + half))
+			| morton_spread((uint32_t)(c->y + half)) << 1
+			| morton_spread((uint32_t)(c->z + half)) << 2;
+		keys[m].id = c->id;
+		keys[m++].idx = (uint32_t)i;
+	}
+
+	for (unsigned shift = 0; shift < 3 * levels; shift += 8) {
+		size_t offs[256] = {0};
+
+		for (size_t i = 0; i < m; ++i)
+			++offs[keys[i].code >> shift & 0xff];
+
+		for (size_t i = 0, sum = 0; i < 256; ++i) {
+			size_t cnt = offs[i];
+
+			offs[i] = sum;
+			sum += cnt;
+		}
+
+		for (size_t i = 0; i < m; ++i)
+			tmp[offs[keys[i].code >> shift & 0xff]++] = keys[i];
+
+		swap = keys;
+		keys = tmp;
+		tmp = swap;
+	}
+
+	// ensure we return the start of the allocation
+	if (keys > tmp) {
+		memcpy(tmp, keys, m * sizeof *keys);
+		keys = tmp;
+	}
+
+	*count = m;
+	return keys;
+}
+
+/* Depth of the deepest node that both codes pass through. */
+static inline unsigned shared_depth(uint64_t a, uint64_t b, unsigned levels)
+{
+	if (a == b)
+		return levels - 1;
+
+	return levels - 1 - (63 - __builtin_clzll(a ^ b)) / 3;
+}
+
+#define code_pos(code, levels, depth) ((unsigned)((code) >> 3 * ((levels) - 1 - (depth))) & 7)
+
+/*
+ * Look up many cells at once. The cells are visited in morton order, and each
+ * lookup only descends from the deepest node it shares with the previous one.
+ * The id of each cell is overwritten with the result.
+ */
+int ot_get_cells(const struct ot_pool *o, struct ot_cell *cells, size_t n)
+{
+	size_t path[32], count;
+	unsigned levels = ot_levels(o), depth = 0;
+	struct ot_key *keys;
+
+	if (!(keys = ot_sort_cells(o, cells, n, levels, &count)))
+		return ENOMEM;
+
+	// cells out of boundaries are skipped by ot_sort_cells
+	for (size_t i = 0; i < n; ++i)
+		cells[i].id = ID_AIR;
+
+	path[0] = o->root;
+
+	for (size_t i = 0; i < count; ++i) {
+		uint64_t code = keys[i].code;
+		unsigned d = i ? shared_depth(keys[i - 1].code, code, levels) : 0;
+		const struct ot_node *node;
+		unsigned pos;
+
+		if (d > depth)
+			d = depth;
+
+		for (;;) {
+			node = &o->nodes[path[d]];
+			pos = code_pos(code, levels, d);
+
+			if ((node->type & ONT_TYPE_MASK) != ONT_SPLIT)
+				break;
+
+			path[++d] = ((size_t)node->data.children << 3) + pos;
+		}
+
+		depth = d;
+		cells[keys[i].idx].id = node->data.cells[pos];
+	}
+
+	free(keys);
+	return 0;
+}
+
+/* Make the node at depth d of path writable, which may move all nodes above it too. */
+static int ot_own_path(struct ot_pool *o, size_t *path, unsigned d)
+{
+	size_t n = path[d];
+	int error;
+
+	if ((error = ot_own(o, &path[d])) || path[d] == n)
+		return error;
+
+	for (; d; --d)
+		path[d - 1] = ot_parent(o, path[d]);
+
+	return 0;
+}
+
+/*
+ * Set many cells at once, see ot_get_cells. If the same cell occurs more than
+ * once, the last one wins. The root first grows until it holds all cells. If
+ * that would exceed OT_SIZE_MAX, ERANGE is returned without setting any cell,
+ * but the root may have grown already.
+ */
+int ot_set_cells(struct ot_pool *o, const struct ot_cell *cells, size_t n)
+{
+	size_t path[32], count;
+	unsigned levels, depth = 0;
+	struct ot_key *keys;
+	int error = 0;
+
+	if (n) {
+		int min[3] = {cells[0].x, cells[0].y, cells[0].z}, max[3];
+
+		memcpy(max, min, sizeof max);
+
+		for (size_t i = 1; i < n; ++i) {
+			const int c[3] = {cells[i].x, cells[i].y, cells[i].z};
+
+			for (unsigned j = 0; j < 3; ++j) {
+				if (c[j] < min[j])
+					min[j] = c[j];
+				if (c[j] > max[j])
+					max[j] = c[j];
+			}
+		}
+
+		for (unsigned j = 0; j < 3; ++j)
+			++max[j];
+
+		if ((error = ot_fit(o, min, max)))
+			return error;
+	}
+
+	levels = ot_levels(o);
+
+	if (!(keys = ot_sort_cells(o, cells, n, levels, &count)))
+		return ENOMEM;
+
+	assert(count == n);
+
+	path[0] = o->root;
+
+	for (size_t i = 0; i < count; ++i) {
+		uint64_t code = keys[i].code;
+		block_t id = keys[i].id;
+		unsigned d = i ? shared_depth(keys[i - 1].code, code, levels) : 0;
+		unsigned pos;
+
+		if (d > depth)
+			d = depth;
+
+		for (;;) {
+			size_t node = path[d];
+
+			pos = code_pos(code, levels, d);
+
+			if ((o->nodes[node].type & ONT_TYPE_MASK) != ONT_SPLIT) {
+				// nothing to do if the octant already has this id
+				if (o->nodes[node].data.cells[pos] == id)
+					goto next;
+
+				if (d == levels - 1)
+					break;
+
+				if ((error = ot_own_path(o, path, d)) || (error = ot_split(o, path[d])))
+					goto fail;
+
+				node = path[d];
+			}
+
+			path[++d] = ((size_t)o->nodes[node].data.children << 3) + pos;
+		}
+
+		if ((error = ot_own_path(o, path, d)))
+			goto fail;
+
+		ot_put(o, path[d], pos, id);
+
+		if (o->touch) {
+			const struct ot_cell *c = &cells[keys[i].idx];
+			ot_touch(o, c->x, c->y, c->z);
+		}
+
+		// collapse along the path, which also tells us how much of the path is still valid
+		while (d && cells_uniform(&o->nodes[path[d]])) {
+			if ((error = ot_unsplit(o, path[d - 1]))) {
+				if (error != ENOTEMPTY)
+					goto fail;
+
+				error = 0;
+				break;
+			}
+
+			--d;
+		}
+next:
+		depth = d;
+	}
+
+fail:
+	free(keys);
+	return error;
+}
+
+/* Number of non-air blocks in the subtree of node n. */
+static size_t ot_count(const struct ot_pool *o, const struct ot_node *n, unsigned size)
+{
+	const struct ot_node *children;
+	size_t count = 0, hvol;
+
+	switch (n->type & ONT_TYPE_MASK) {
+	case ONT_UNIFORM:
+		return (size_t)size * size * size;
+	case ONT_SPLIT:
+		children = ot_children(o, n);
+
+		for (unsigned i = 0; i < 8; ++i)
+			count += ot_count(o, &children[i], size >> 1);
+		return count;
+	}
+
+	hvol = (size_t)(size >> 1) * (size >> 1) * (size >> 1);
+
+	for (unsigned i = 0; i < 8; ++i)
+		if (n->data.cells[i])
+			count += hvol;
+
+	return count;
+}
+
+static size_t count_groups(const struct ot_pool *o, uint32_t group)
+{
+	const struct ot_node *children = ot_group(o, group);
+	size_t count = 1;
+
+	for (unsigned i = 0; i < 8; ++i)
+		if ((children[i].type & ONT_TYPE_MASK) == ONT_SPLIT)
+			count += count_groups(o, children[i].data.children);
+
+	return count;
+}
+
+static void free_groups(struct ot_pool *o, uint32_t group)
+{
+	const struct ot_node *children = ot_group(o, group);
+
+	for (unsigned i = 0; i < 8; ++i)
+		if ((children[i].type & ONT_TYPE_MASK) == ONT_SPLIT)
+			free_groups(o, children[i].data.children);
+
+	ot_release(o, group);
+}
+
+/* Replace the whole subtree of node n by id. n must be writable, see ot_own. */
+static int ot_fill_node(struct ot_pool *o, size_t n, unsigned size, block_t id)
+{
+	struct ot_node *node = &o->nodes[n];
+	size_t old = ot_count(o, node, size);
+	int error;
+
+	if ((node->type & ONT_TYPE_MASK) == ONT_SPLIT) {
+		if ((error = release_reserve(o, count_groups(o, node->data.children))))
+			return error;
+
+		free_groups(o, node->data.children);
+	}
+
+	for (unsigned i = 0; i < 8; ++i)
+		node->data.cells[i] = id;
+
+	node_retype(node);
+	ot_changed(o, n);
+
+	o->blocks -= old;
+	if (id)
+		o->blocks += (size_t)size * size * size;
+
+	return 0;
+}
+
+/* Fill the part of the box in the subtree of node n, which must be writable. Only groups that overlap the box are copied. */
+static int ot_fill_box_node(struct ot_pool *o, size_t n, unsigned size, const int pos[3], const int min[3], const int max[3], block_t id)
+{
+	struct ot_node *node = &o->nodes[n];
+	int hsize = (int)(size >> 1), opos[8][3];
+	unsigned overlap = 0, full = 0;
+	int error;
+
+	// replace everything if box covers this node
+	if (min[0] <= pos[0] && min[1] <= pos[1] && min[2] <= pos[2]
+		&& max[0] >= pos[0] + (int)size && max[1] >= pos[1] + (int)size && max[2] >= pos[2] + (int)size)
+		return ot_fill_node(o, n, size, id);
+
+	for (unsigned i = 0; i < 8; ++i) {
+		unsigned in = 1, all = 1;
+
+		for (unsigned j = 0; j < 3; ++j) {
+			opos[i][j] = pos[j] + ((i >> j) & 1 ? hsize : 0);
+
+			in &= min[j] < opos[i][j] + hsize && max[j] > opos[i][j];
+			all &= min[j] <= opos[i][j] && max[j] >= opos[i][j] + hsize;
+		}
+
+		overlap |= in << i;
+		full |= all << i;
+	}
+
+	if ((node->type & ONT_TYPE_MASK) != ONT_SPLIT) {
+		unsigned partial = 0;
+		size_t hvol = (size_t)hsize * hsize * hsize;
+
+		for (unsigned i = 0; i < 8; ++i)
+			if ((overlap & ~full) >> i & 1 && node->data.cells[i] != id)
+				partial = 1;
+
+		if (!partial) {
+			unsigned changed = 0;
+
+			// only whole octants are touched, so no need to split
+			for (unsigned i = 0; i < 8; ++i) {
+				if (!(full >> i & 1) || node->data.cells[i] == id)
+					continue;
+
+				if (!id)
+					o->blocks -= hvol;
+				else if (!node->data.cells[i])
+					o->blocks += hvol;
+
+				node->data.cells[i] = id;
+				changed = 1;
+			}
+
+			if (changed) {
+				node_retype(node);
+				ot_changed(o, n);
+			}
+			return 0;
+		}
+
+		if ((error = ot_split(o, n)))
+			return error;
+	}
+
+	size_t children;
+
+	if ((error = ot_own_children(o, n, &children)))
+		return error;
+
+	for (unsigned i = 0; i < 8; ++i)
+		if ((overlap >> i & 1) && (error = ot_fill_box_node(o, children + i, size >> 1, opos[i], min, max, id)))
+			return error;
+
+	error = ot_unsplit(o, n);
+	return error == ENOTEMPTY ? 0 : error;
+}
+
+/*
+ * Set all cells with min <= (x,y,z) < max to id. Aligned cubes that are
+ * completely inside the box are stored as a single node, so only nodes along
+ * the edges of the box are split.
+ */
+int ot_fill_box(struct ot_pool *o, const int min[3], const int max[3], block_t id)
+{
+	int size, pos[3], error;
+
+	for (unsigned i = 0; i < 3; ++i)
+		if (min[i] >= max[i])
+			return 0;
+
+	if ((error = ot_fit(o, min, max)))
+		return error;
+
+	size = (int)(o->root_size >> 1);
+	pos[0] = pos[1] = pos[2] = -size;
+
+	error = ot_fill_box_node(o, o->root, o->root_size, pos, min, max, id);
+
+	// even if we failed, some cells may have changed already
+	if (o->touch)
+		o->touch(o, min, max);
+
+	return error;
+}
+
+static inline int box_overlap(const int pos[3], int size, const int min[3], const int max[3])
+{
+	for (unsigned i = 0; i < 3; ++i)
+		if (min[i] >= pos[i] + size || max[i] <= pos[i])
+			return 0;
+
+	return 1;
+}
+
+/* Check whether all cells of buf in the part of the box between lo and hi hold the same id. */
+static int box_uniform(const block_t *buf, const int min[3], const int max[3], const int lo[3], const int hi[3], block_t *id)
+{
+	size_t sx = (size_t)(max[0] - min[0]), sy = (size_t)(max[1] - min[1]);
+	block_t first = buf[((size_t)(lo[2] - min[2]) * sy + (size_t)(lo[1] - min[1])) * sx + (size_t)(lo[0] - min[0])];
+
+	for (int z = lo[2]; z < hi[2]; ++z)
+		for (int y = lo[1]; y < hi[1]; ++y) {
+			const block_t *row = &buf[((size_t)(z - min[2]) * sy + (size_t)(y - min[1])) * sx + (size_t)(lo[0] - min[0])];
+
+			for (int x = 0; x < hi[0] - lo[0]; ++x)
+				if (row[x] != first)
+					return 0;
+		}
+
+	*id = first;
+	return 1;
+}
+
+/* Copy the part of buf in the subtree of node n, which must be writable. */
+static int ot_set_box_node(struct ot_pool *o, size_t n, unsigned size, const int pos[3], const int min[3], const int max[3], const block_t *buf)
+{
+	int hsize = (int)(size >> 1), lo[3], hi[3], opos[3];
+	block_t id;
+	int error;
+
+	for (unsigned i = 0; i < 3; ++i) {
+		lo[i] = pos[i] > min[i] ? pos[i] : min[i];
+		hi[i] = pos[i] + (int)size < max[i] ? pos[i] + (int)size : max[i];
+	}
+
+	// uniform parts are stored as big as possible right away
+	if (box_uniform(buf, min, max, lo, hi, &id))
+		return ot_fill_box_node(o, n, size, pos, lo, hi, id);
+
+	if (size == 2) {
+		size_t sx = (size_t)(max[0] - min[0]), sy = (size_t)(max[1] - min[1]);
+
+		for (unsigned i = 0; i < 8; ++i) {
+			for (unsigned j = 0; j < 3; ++j)
+				opos[j] = pos[j] + (int)((i >> j) & 1);
+
+			if (!box_overlap(opos, 1, min, max))
+				continue;
+
+			id = buf[((size_t)(opos[2] - min[2]) * sy + (size_t)(opos[1] - min[1])) * sx + (size_t)(opos[0] - min[0])];
+
+			if (o->nodes[n].data.cells[i] != id)
+				ot_put(o, n, i, id);
+		}
+
+		return 0;
+	}
+
+	if ((o->nodes[n].type & ONT_TYPE_MASK) != ONT_SPLIT && (error = ot_split(o, n)))
+		return error;
+
+	size_t children;
+
+	if ((error = ot_own_children(o, n, &children)))
+		return error;
+
+	for (unsigned i = 0; i < 8; ++i) {
+		for (unsigned j = 0; j < 3; ++j)
+			opos[j] = pos[j] + ((i >> j) & 1 ? hsize : 0);
+
+		if (box_overlap(opos, hsize, min, max) && (error = ot_set_box_node(o, children + i, size >> 1, opos, min, max, buf)))
+			return error;
+	}
+
+	error = ot_unsplit(o, n);
+	return error == ENOTEMPTY ? 0 : error;
+}
+
+/*
+ * Copy buf to all cells with min <= (x,y,z) < max, the layout is the same as
+ * for ot_get_box. Parts of the box that hold a single id are filled as a whole
+ * like ot_fill_box, so this is much faster than setting each cell.
+ */
+int ot_set_box(struct ot_pool *o, const int min[3], const int max[3], const block_t *buf)
+{
+	int size, pos[3], error;
+
+	for (unsigned i = 0; i < 3; ++i)
+		if (min[i] >= max[i])
+			return 0;
+
+	if ((error = ot_fit(o, min, max)))
+		return error;
+
+	size = (int)(o->root_size >> 1);
+	pos[0] = pos[1] = pos[2] = -size;
+
+	error = ot_set_box_node(o, o->root, o->root_size, pos, min, max, buf);
+
+	// even if we failed, some cells may have changed already
+	if (o->touch)
+		o->touch(o, min, max);
+
+	return error;
+}
+
+/* Write id to all cells in buf that are both in the box and in the cube at pos. */
+static void box_put(block_t *buf, const int min[3], const int max[3], const int pos[3], int size, block_t id)
+{
+	size_t sx = (size_t)(max[0] - min[0]), sy = (size_t)(max[1] - min[1]);
+	int lo[3], hi[3];
+
+	// buf is cleared already
+	if (!id)
+		return;
+
+	for (unsigned i = 0; i < 3; ++i) {
+		lo[i] = pos[i] > min[i] ? pos[i] : min[i];
+		hi[i] = pos[i] + size < max[i] ? pos[i] + size : max[i];
+	}
+
+	for (int z = lo[2]; z < hi[2]; ++z)
+		for (int y = lo[1]; y < hi[1]; ++y) {
+			block_t *row = &buf[((size_t)(z - min[2]) * sy + (size_t)(y - min[1])) * sx + (size_t)(lo[0] - min[0])];
+
+			for (int x = lo[0]; x < hi[0]; ++x)
+				*row++ = id;
+		}
+}
+
+static void ot_get_box_node(const struct ot_pool *o, const struct ot_node *n, unsigned size, const int pos[3], const int min[3], const int max[3], block_t *buf)
+{
+	int hsize = (int)(size >> 1), opos[3];
+
+	switch (n->type & ONT_TYPE_MASK) {
+	case ONT_UNIFORM:
+		box_put(buf, min, max, pos, (int)size, n->data.cells[0]);
+		return;
+	case ONT_CELL:
+		if (!(n->type & ONT_CELL_MASK))
+			return;
+		break;
+	}
+
+	for (unsigned i = 0; i < 8; ++i) {
+		for (unsigned j = 0; j < 3; ++j)
+			opos[j] = pos[j] + ((i >> j) & 1 ? hsize : 0);
+
+		if (!box_overlap(opos, hsize, min, max))
+			continue;
+
+		if ((n->type & ONT_TYPE_MASK) == ONT_SPLIT)
+			ot_get_box_node(o, &ot_children(o, n)[i], size >> 1, opos, min, max, buf);
+		else
+			box_put(buf, min, max, opos, hsize, n->data.cells[i]);
+	}
+}
+
+/*
+ * Copy all cells with min <= (x,y,z) < max to buf, x varies fastest and z
+ * slowest. Cells outside the world are air. Subtrees outside the box are
+ * skipped entirely.
+ */
+void ot_get_box(const struct ot_pool *o, const int min[3], const int max[3], block_t *buf)
+{
+	int size = (int)(o->root_size >> 1);
+	int pos[3] = {-size, -size, -size};
+	size_t n = 1;
+
+	for (unsigned i = 0; i < 3; ++i) {
+		if (min[i] >= max[i])
+			return;
+
+		n *= (size_t)(max[i] - min[i]);
+	}
+
+	memset(buf, 0, n * sizeof *buf);
+
+	if (box_overlap(pos, (int)o->root_size, min, max))
+		ot_get_box_node(o, &o->nodes[o->root], o->root_size, pos, min, max, buf);
+}
+
+static int ot_box_solid_node(const struct ot_pool *o, const struct ot_node *n, unsigned size, const int pos[3], const int min[3], const int max[3])
+{
+	int hsize = (int)(size >> 1), opos[3];
+
+	switch (n->type & ONT_TYPE_MASK) {
+	case ONT_UNIFORM:
+		return 1;
+	case ONT_CELL:
+		if ((n->type & ONT_CELL_MASK) == ONT_CELL_MASK)
+			return 1;
+		break;
+	}
+
+	for (unsigned i = 0; i < 8; ++i) {
+		for (unsigned j = 0; j < 3; ++j)
+			opos[j] = pos[j] + ((i >> j) & 1 ? hsize : 0);
+
+		if (!box_overlap(opos, hsize, min, max))
+			continue;
+
+		if ((n->type & ONT_TYPE_MASK) == ONT_SPLIT) {
+			if (!ot_box_solid_node(o, &ot_children(o, n)[i], size >> 1, opos, min, max))
+				return 0;
+		} else if (!n->data.cells[i]) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Check whether all cells with min <= (x,y,z) < max are not air. */
+int ot_box_solid(const struct ot_pool *o, const int min[3], const int max[3])
+{
+	int size = (int)(o->root_size >> 1);
+	int pos[3] = {-size, -size, -size};
+
+	for (unsigned i = 0; i < 3; ++i) {
+		if (min[i] >= max[i])
+			return 1;
+
+		// everything outside the world is air
+		if (min[i] < -size || max[i] > size)
+			return 0;
+	}
+
+	return ot_box_solid_node(o, &o->nodes[o->root], o->root_size, pos, min, max);
+}
+
+/* Start iterating over all non-air cells with min <= (x,y,z) < max, see ot_iter_next. */
+void ot_iter_init(struct ot_iter *it, const struct ot_pool *o, const int min[3], const int max[3])
+{
+	int size = (int)(o->root_size >> 1);
+	struct ot_iter_node *r = &it->path[0];
+
+	it->o = o;
+	memcpy(it->min, min, sizeof it->min);
+	memcpy(it->max, max, sizeof it->max);
+
+	r->n = o->root;
+	r->lo[0] = r->lo[1] = r->lo[2] = -size;
+	r->size = o->root_size;
+	r->next = 0;
+
+	it->depth = box_overlap(r->lo, (int)r->size, min, max);
+
+	for (unsigned i = 0; i < 3; ++i)
+		if (min[i] >= max[i])
+			it->depth = 0;
+}
+
+/*
+ * Find the next box of cells that all hold the same non-air id. Returns zero
+ * when there are none left. Boxes are clipped to the box that is iterated and
+ * never overlap, but neighbouring boxes may have the same id.
+ */
+int ot_iter_next(struct ot_iter *it, int min[3], int max[3], block_t *id)
+{
+	const struct ot_pool *o = it->o;
+
+	while (it->depth) {
+		struct ot_iter_node *r = &it->path[it->depth - 1];
+		const struct ot_node *n = &o->nodes[r->n];
+		int hsize = (int)(r->size >> 1), lo[3], size = hsize;
+		unsigned type = n->type & ONT_TYPE_MASK, mask = (n->type & ONT_CELL_MASK) >> 8, pos;
+
+		// uniform nodes are reported as a whole
+		if (type == ONT_UNIFORM) {
+			if (r->next) {
+				--it->depth;
+				continue;
+			}
+
+			r->next = 8;
+			memcpy(lo, r->lo, sizeof lo);
+			size = (int)r->size;
+			*id = n->data.cells[0];
+			goto found;
+		}
+
+		// skip air octants of cell nodes without looking at them
+		if (type == ONT_CELL)
+			mask &= ~0u << r->next;
+		else
+			mask = 0xff & (~0u << r->next);
+
+		for (; mask; mask &= mask - 1) {
+			pos = (unsigned)__builtin_ctz(mask);
+
+			for (unsigned j = 0; j < 3; ++j)
+				lo[j] = r->lo[j] + ((pos >> j) & 1 ? hsize : 0);
+
+			if (box_overlap(lo, hsize, it->min, it->max))
+				break;
+		}
+
+		if (!mask) {
+			--it->depth;
+			continue;
+		}
+
+		r->next = pos + 1;
+
+		if (type == ONT_SPLIT) {
+			struct ot_iter_node *c = &it->path[it->depth++];
+
+			c->n = ((size_t)n->data.children << 3) + pos;
+			memcpy(c->lo, lo, sizeof c->lo);
+			c->size = (unsigned)hsize;
+			c->next = 0;
+			continue;
+		}
+
+		*id = n->data.cells[pos];
+found:
+		for (unsigned j = 0; j < 3; ++j) {
+			min[j] = lo[j] > it->min[j] ? lo[j] : it->min[j];
+			max[j] = lo[j] + size < it->max[j] ? lo[j] + size : it->max[j];
+		}
+
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Call cb for each box of non-air cells with min <= (x,y,z) < max, like
+ * ot_iter_next. Stops as soon as cb returns nonzero and returns that value.
+ */
+int ot_for_each_in_box(const struct ot_pool *o, const int min[3], const int max[3], int (*cb)(void *arg, const int min[3], const int max[3], block_t id), void *arg)
+{
+	struct ot_iter it;
+	int bmin[3], bmax[3], ret;
+	block_t id;
+
+	ot_iter_init(&it, o, min, max);
+
+	while (ot_iter_next(&it, bmin, bmax, &id))
+		if ((ret = cb(arg, bmin, bmax, id)))
+			return ret;
+
+	return 0;
+}
+
+/* Most common non-air id, or air if all are air. */
+static block_t most_common(const block_t ids[8])
+{
+	block_t best = ID_AIR;
+	unsigned count = 0;
+
+	for (unsigned i = 0; i < 8 && count < 8 - i; ++i) {
+		unsigned n = 0;
+
+		if (!ids[i] || ids[i] == best)
+			continue;
+
+		for (unsigned j = i; j < 8; ++j)
+			n += ids[j] == ids[i];
+
+		if (n > count) {
+			best = ids[i];
+			count = n;
+		}
+	}
+
+	return best;
+}
+
+/* Representative id of node n, only up to date for split nodes after ot_update_reps. */
+block_t ot_rep(const struct ot_node *n)
+{
+	if ((n->type & ONT_TYPE_MASK) == ONT_SPLIT)
+		return (block_t)(n->type >> ONT_REP_SHIFT);
+
+	return most_common(n->data.cells);
+}
+
+/* n must be writable, see ot_own. */
+static block_t ot_update_rep(struct ot_pool *o, size_t n)
+{
+	size_t children;
+	block_t ids[8];
+
+	if ((o->nodes[n].type & (ONT_TYPE_MASK | ONT_STALE)) != (ONT_SPLIT | ONT_STALE))
+		return ot_rep(&o->nodes[n]);
+
+	children = (size_t)o->nodes[n].data.children << 3;
+
+	for (unsigned i = 0; i < 8; ++i)
+		if ((o->nodes[children + i].type & (ONT_TYPE_MASK | ONT_STALE)) == (ONT_SPLIT | ONT_STALE)) {
+			// snapshots may see the stale children, leave them stale if we can't copy them
+			if (ot_own(o, &children))
+				return ot_rep(&o->nodes[n]);
+			break;
+		}
+
+	for (unsigned i = 0; i < 8; ++i)
+		ids[i] = ot_update_rep(o, children + i);
+
+	o->nodes[n].type = (o->nodes[n].type & ~(ONT_REP_MASK | ONT_STALE)) | (uint32_t)most_common(ids) << ONT_REP_SHIFT;
+	return ot_rep(&o->nodes[n]);
+}
+
+/* Recompute all stale representatives, only visits subtrees that changed. */
+void ot_update_reps(struct ot_pool *o)
+{
+	ot_update_rep(o, o->root);
+}
+
+static void ot_dirty_node(const struct ot_pool *o, size_t n, unsigned size, const int pos[3], unsigned level, uint32_t since, void (*cb)(void *arg, const int pos[3], unsigned size), void *arg)
+{
+	const struct ot_node *node = &o->nodes[n];
+	int hsize = (int)(size >> 1), opos[3];
+
+	if ((node->type & ONT_TYPE_MASK) != ONT_SPLIT) {
+		// siblings share the generation, so this may be a false positive
+		if (gen_after(o->gens[n >> 3], since))
+			cb(arg, pos, size);
+		return;
+	}
+
+	if (!gen_after(o->gens[node->data.children], since))
+		return;
+
+	if (!level) {
+		cb(arg, pos, size);
+		return;
+	}
+
+	for (unsigned i = 0; i < 8; ++i) {
+		for (unsigned j = 0; j < 3; ++j)
+			opos[j] = pos[j] + ((i >> j) & 1 ? hsize : 0);
+
+		ot_dirty_node(o, ((size_t)node->data.children << 3) + i, size >> 1, opos, level - 1, since, cb, arg);
+	}
+}
+
+/*
+ * Call cb for each node at the specified depth below the root whose subtree
+ * has changed after generation since, with its lower corner and size. Changed
+ * cell nodes above that depth are reported as a whole. Returns the generation
+ * to pass next time, so each consumer only sees what changed in between.
+ */
+uint32_t ot_dirty(struct ot_pool *o, unsigned level, uint32_t since, void (*cb)(void *arg, const int pos[3], unsigned size), void *arg)
+{
+	int size = (int)(o->root_size >> 1);
+	int pos[3] = {-size, -size, -size};
+
+	ot_dirty_node(o, o->root, o->root_size, pos, level, since, cb, arg);
+	return o->gen++;
+}
+
+/*
+ * Take a snapshot of o in constant time: the root group is copied, everything
+ * below it is shared until the pool changes it. The snapshot starts with one
+ * reference and may be handed to other threads, as long as that happens after
+ * this returns.
+ */
+int ot_snapshot(struct ot_pool *o, struct ot_snap **snap)
+{
+	struct ot_snap *s;
+	uint32_t group;
+	int error;
+
+	ot_reclaim(o);
+
+	if (!(s = malloc(sizeof *s)))
+		return ENOMEM;
+
+	// room for the root copy and for the array if the pool moves
+	if ((error = retire_reserve(o, 2)) || (error = ot_alloc(o, &group))) {
+		free(s);
+		return error;
+	}
+
+	memcpy(ot_group(o, group), ot_group(o, o->root >> 3), 8 * sizeof(struct ot_node));
+	o->parents[group] = 0;
+	o->gens[group] = o->gens[o->root >> 3];
+
+	memset(&s->ot, 0, sizeof s->ot);
+	s->ot.nodes = o->nodes;
+	s->ot.gen = o->gen;
+	s->ot.root = ((size_t)group << 3) + (o->root & 7);
+	s->ot.count = s->ot.cap = o->count;
+	s->ot.blocks = o->blocks;
+	s->ot.root_size = o->root_size;
+	s->epoch = o->epoch++;
+	s->refs = 1;
+	s->next = NULL;
+
+	if (o->snaps_tail)
+		o->snaps_tail->next = s;
+	else
+		o->snaps = s;
+
+	o->snaps_tail = s;
+
+	// nothing but the snapshot uses the root copy
+	ot_retire(o, group, NULL);
+
+	*snap = s;
+	return 0;
+}
+
+/* Add a reference to s, the caller must hold one already. */
+void ot_snap_ref(struct ot_snap *s)
+{
+	__atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* Drop a reference to s, from any thread. s must not be used after dropping the last one. */
+void ot_snap_release(struct ot_snap *s)
+{
+	__atomic_sub_fetch(&s->refs, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Forget released snapshots and give back what only they could see. Groups
+ * and arrays are retired with the epoch they were replaced in, so they can go
+ * once the oldest remaining snapshot is at least as new. Called by
+ * ot_snapshot and whenever a shared group has to be copied, but the owner of
+ * o may call it at any time to release memory sooner.
+ */
+void ot_reclaim(struct ot_pool *o)
+{
+	struct ot_snap **p = &o->snaps, *s;
+	size_t i;
+
+	o->snaps_tail = NULL;
+
+	while ((s = *p)) {
+		if (!__atomic_load_n(&s->refs, __ATOMIC_ACQUIRE)) {
+			*p = s->next;
+			free(s);
+			continue;
+		}
+
+		o->snaps_tail = s;
+		p = &s->next;
+	}
+
+	for (i = 0; i < o->nretired; ++i) {
+		struct ot_retired *r = &o->retired[i];
+
+		if (o->snaps && gen_after(r->epoch, o->snaps->epoch))
+			break;
+
+		if (r->mem) {
+			free(r->mem);
+		} else {
+			// try again next time
+			if (rpop_reserve(o, 1))
+				break;
+
+			o->rpop[o->rcount++] = r->group;
+		}
+	}
+
+	if (i) {
+		o->nretired -= i;
+		memmove(o->retired, o->retired + i, o->nretired * sizeof *o->retired);
+	}
+}
+
+// bounds of a node on the path of a ray
+struct ot_ray_node {
+	size_t n;
+	int lo[3];
+	unsigned size;
+};
+
+static inline int ray_inside(const struct ot_ray_node *r, const int cell[3])
+{
+	for (unsigned i = 0; i < 3; ++i)
+		if (cell[i] < r->lo[i] || cell[i] >= r->lo[i] + (int)r->size)
+			return 0;
+
+	return 1;
+}
+
+static inline int ray_clamp(double v, int lo, int hi)
+{
+	v = floor(v);
+	return v < lo ? lo : v > hi ? hi : (int)v;
+}
+
+/*
+ * Find the first non-air cell along the ray from origin in direction dir within
+ * max_dist blocks. Returns nonzero and fills in hit if something was found.
+ *
+ * Rather than stepping one cell at a time, the ray jumps over the whole air
+ * octant the current cell is in. The path to that octant is kept, so the next
+ * lookup only goes up as far as needed instead of starting at the root.
+ */
+int ot_raycast(const struct ot_pool *o, const float origin[3], const float dir[3], float max_dist, struct ot_hit *hit)
+{
+	struct ot_ray_node path[OT_DEPTH_MAX + 1];
+	double org[3], d[3], len, t = 0, tmax = max_dist;
+	int half = (int)(o->root_size >> 1), cell[3], axis = -1;
+	unsigned depth = 1;
+
+	len = sqrt((double)dir[0] * dir[0] + (double)dir[1] * dir[1] + (double)dir[2] * dir[2]);
+	if (!(len > 0))
+		return 0;
+
+	// clip ray to the world
+	for (unsigned i = 0; i < 3; ++i) {
+		double t0, t1;
+
+		org[i] = origin[i];
+		d[i] = dir[i] / len;
+
+		if (d[i] == 0) {
+			if (org[i] < -half || org[i] >= half)
+				return 0;
+			continue;
+		}
+
+		t0 = (-half - org[i]) / d[i];
+		t1 = (half - org[i]) / d[i];
+
+		if (t0 > t1) {
+			double tmp = t0;
+			t0 = t1;
+			t1 = tmp;
+		}
+
+		if (t0 > t) {
+			t = t0;
+			axis = (int)i;
+		}
+
+		if (t1 < tmax)
+			tmax = t1;
+	}
+
+	if (t > tmax)
+		return 0;
+
+	for (unsigned i = 0; i < 3; ++i)
+		cell[i] = ray_clamp(org[i] + d[i] * t, -half, half - 1);
+
+	path[0].n = o->root;
+	path[0].lo[0] = path[0].lo[1] = path[0].lo[2] = -half;
+	path[0].size = o->root_size;
+
+	for (;;) {
+		int lo[3];
+		unsigned size;
+		block_t id;
+
+		// go up until the cell is inside, then down to the octant that holds it
+		while (depth && !ray_inside(&path[depth - 1], cell))
+			--depth;
+
+		if (!depth)
+			return 0;
+
+		for (;;) {
+			const struct ot_ray_node *r = &path[depth - 1];
+			const struct ot_node *n = &o->nodes[r->n];
+			unsigned pos = 0;
+
+			size = r->size >> 1;
+
+			for (unsigned i = 0; i < 3; ++i) {
+				lo[i] = r->lo[i];
+
+				if (cell[i] >= lo[i] + (int)size) {
+					lo[i] += (int)size;
+					pos |= 1u << i;
+				}
+			}
+
+			if ((n->type & ONT_TYPE_MASK) != ONT_SPLIT) {
+				id = n->data.cells[pos];
+				break;
+			}
+
+			path[depth].n = ((size_t)n->data.children << 3) + pos;
+			memcpy(path[depth].lo, lo, sizeof lo);
+			path[depth].size = size;
+			++depth;
+		}
+
+		if (id != ID_AIR) {
+			memcpy(hit->pos, cell, sizeof hit->pos);
+			hit->normal[0] = hit->normal[1] = hit->normal[2] = 0;
+
+			if (axis >= 0)
+				hit->normal[axis] = d[axis] > 0 ? -1 : 1;
+
+			hit->dist = (float)t;
+			hit->id = id;
+			return 1;
+		}
+
+		// leave the octant through the nearest face
+		double texit = INFINITY;
+
+		for (unsigned i = 0; i < 3; ++i) {
+			double ti;
+
+			if (d[i] == 0)
+				continue;
+
+			ti = ((d[i] > 0 ? lo[i] + (int)size : lo[i]) - org[i]) / d[i];
+
+			if (ti < texit) {
+				texit = ti;
+				axis = (int)i;
+			}
+		}
+
+		if (texit > t)
+			t = texit;
+
+		if (t > tmax)
+			return 0;
+
+		// stay within the octant on the other axes to cope with rounding
+		for (unsigned i = 0; i < 3; ++i)
+			if ((int)i == axis)
+				cell[i] = d[i] > 0 ? lo[i] + (int)size : lo[i] - 1;
+			else
+				cell[i] = ray_clamp(org[i] + d[i] * t, lo[i], lo[i] + (int)size - 1);
+	}
+}
+
+/*
+ * World file format, all numbers are little endian:
+ *
+ *   0 magic "MVOT"
+ *   4 u16 version
+ *   6 u16 reserved, must be 0
+ *   8 u32 root size
+ *  12 u32 number of groups, including the one of the root
+ *  16 u64 number of blocks
+ *  24 u64 payload size in bytes
+ *
+ * The payload is the tree in depth-first order, one token per node. The lower
+ * two bits of the first byte of a token determine the type:
+ *
+ *   split   followed by its 8 children
+ *   uniform the next n nodes are cell nodes with all octants set to id, n-1 is
+ *           in the upper 6 bits or 63 plus a varint after it, then id follows
+ *   cells   followed by runs of equal octants as varint (id << 3 | (n - 1))
+ *
+ * Varints are LEB128. Groups are numbered in the order they appear, which is
+ * the same layout ot_compact produces, so loading is a single linear pass.
+ */
+#define OTF_MAGIC "MVOT"
+#define OTF_VERSION 1
+#define OTF_HEADER 32
+
+#define OTF_SPLIT 0
+#define OTF_UNIFORM 1
+#define OTF_CELLS 2
+
+struct ot_writer {
+	unsigned char *data;
+	size_t size, cap;
+	// pending uniform nodes
+	size_t run;
+	block_t id;
+	uint32_t groups;
+};
+
+static int otw_reserve(struct ot_writer *w, size_t n)
+{
+	unsigned char *data;
+	size_t cap;
+
+	if (w->cap - w->size >= n)
+		return 0;
+
+	for (cap = w->cap ? w->cap : 4096; cap - w->size < n; cap <<= 1)
+		if (cap > SIZE_MAX >> 1)
+			return EOVERFLOW;
+
+	if (!(data = realloc(w->data, cap)))
+		return ENOMEM;
+
+	w->data = data;
+	w->cap = cap;
+	return 0;
+}
+
+static int otw_byte(struct ot_writer *w, unsigned char b)
+{
+	int error;
+
+	if ((error = otw_reserve(w, 1)))
+		return error;
+
+	w->data[w->size++] = b;
+	return 0;
+}
+
+static int otw_varint(struct ot_writer *w, uint64_t v)
+{
+	int error;
+
+	if ((error = otw_reserve(w, VARINT_MAX)))
+		return error;
+
+	w->size += varint_put(w->data + w->size, v);
+	return 0;
+}
+
+static int otw_flush(struct ot_writer *w)
+{
+	size_t n = w->run - 1;
+	int error;
+
+	if (!w->run)
+		return 0;
+
+	w->run = 0;
+
+	if ((error = otw_byte(w, OTF_UNIFORM | (n < 63 ? n : 63) << 2)))
+		return error;
+
+	if (n >= 63 && (error = otw_varint(w, n - 63)))
+		return error;
+
+	return otw_varint(w, w->id);
+}
+
+static int ot_save_node(const struct ot_pool *o, struct ot_writer *w, const struct ot_node *n)
+{
+	const struct ot_node *children;
+	int error;
+
+	if ((n->type & ONT_TYPE_MASK) == ONT_SPLIT) {
+		if ((error = otw_flush(w)) || (error = otw_byte(w, OTF_SPLIT)))
+			return error;
+
+		++w->groups;
+		children = ot_children(o, n);
+
+		for (unsigned i = 0; i < 8; ++i)
+			if ((error = ot_save_node(o, w, &children[i])))
+				return error;
+
+		return 0;
+	}
+
+	if (cells_uniform(n)) {
+		if (w->run && w->id == n->data.cells[0]) {
+			++w->run;
+			return 0;
+		}
+
+		if ((error = otw_flush(w)))
+			return error;
+
+		w->run = 1;
+		w->id = n->data.cells[0];
+		return 0;
+	}
+
+	if ((error = otw_flush(w)) || (error = otw_byte(w, OTF_CELLS)))
+		return error;
+
+	for (unsigned i = 0, j; i < 8; i = j) {
+		for (j = i + 1; j < 8 && n->data.cells[j] == n->data.cells[i]; ++j)
+			;
+
+		if ((error = otw_varint(w, (uint64_t)n->data.cells[i] << 3 | (j - i - 1))))
+			return error;
+	}
+
+	return 0;
+}
+
+static void put_le(unsigned char *p, uint64_t v, unsigned n)
+{
+	for (unsigned i = 0; i < n; ++i, v >>= 8)
+		p[i] = (unsigned char)v;
+}
+
+static uint64_t get_le(const unsigned char *p, unsigned n)
+{
+	uint64_t v = 0;
+
+	for (unsigned i = n; i-- > 0;)
+		v = v << 8 | p[i];
+
+	return v;
+}
+
+/* Store the whole tree in a new buffer of *size bytes, in the same format as ot_save. */
+int ot_encode(const struct ot_pool *o, unsigned char **data, size_t *size)
+{
+	struct ot_writer w = {NULL, 0, 0, 0, 0, 1};
+	unsigned char *hdr;
+	int error;
+
+	// room for header, which is filled in at the end
+	if ((error = otw_reserve(&w, OTF_HEADER)))
+		return error;
+
+	w.size = OTF_HEADER;
+
+	if ((error = ot_save_node(o, &w, &o->nodes[o->root])) || (error = otw_flush(&w))) {
+		free(w.data);
+		return error;
+	}
+
+	hdr = w.data;
+	memcpy(hdr, OTF_MAGIC, 4);
+	put_le(hdr + 4, OTF_VERSION, 2);
+	put_le(hdr + 6, 0, 2);
+	put_le(hdr + 8, o->root_size, 4);
+	put_le(hdr + 12, w.groups, 4);
+	put_le(hdr + 16, o->blocks, 8);
+	put_le(hdr + 24, w.size - OTF_HEADER, 8);
+
+	*data = w.data;
+	*size = w.size;
+	return 0;
+}
+
+/* Write the whole tree to path. The file is replaced atomically. */
+int ot_save(const struct ot_pool *o, const char *path)
+{
+	unsigned char *data = NULL;
+	size_t size;
+	char *tmp = NULL;
+	FILE *f = NULL;
+	int error;
+
+	if ((error = ot_encode(o, &data, &size)))
+		return error;
+
+	if (!(tmp = malloc(strlen(path) + 5))) {
+		error = ENOMEM;
+		goto fail;
+	}
+
+	strcat(strcpy(tmp, path), ".tmp");
+
+	if (!(f = fopen(tmp, "wb"))) {
+		error = errno;
+		goto fail;
+	}
+
+	if (fwrite(data, 1, size, f) != size) {
+		error = errno ? errno : EIO;
+		goto fail;
+	}
+
+	if (fclose(f)) {
+		f = NULL;
+		error = errno;
+		goto fail;
+	}
+
+	f = NULL;
+
+	if (rename(tmp, path))
+		error = errno;
+fail:
+	if (f)
+		fclose(f);
+	if (error && tmp)
+		unlink(tmp);
+
+	free(tmp);
+	free(data);
+	return error;
+}
+
+struct ot_reader {
+	const unsigned char *pos, *end;
+	// pending uniform nodes
+	uint64_t run;
+	block_t id;
+	uint32_t next, groups;
+};
+
+static int otr_varint(struct ot_reader *r, uint64_t *v)
+{
+	return varint_get(&r->pos, r->end, v);
+}
+
+static void ot_load_cells(struct ot_pool *o, struct ot_node *n, unsigned size)
+{
+	size_t hvol = (size_t)(size >> 1) * (size >> 1) * (size >> 1);
+
+	for (unsigned i = 0; i < 8; ++i)
+		if (n->data.cells[i])
+			o->blocks += hvol;
+
+	node_retype(n);
+}
+
+static int ot_load_node(struct ot_pool *o, struct ot_reader *r, size_t n, unsigned size)
+{
+	struct ot_node *node = &o->nodes[n];
+	uint64_t v;
+	uint32_t g;
+	int error;
+
+	if (r->run) {
+		--r->run;
+		goto uniform;
+	}
+
+	if (r->pos == r->end)
+		return EINVAL;
+
+	unsigned char b = *r->pos++;
+
+	switch (b & 3) {
+	case OTF_SPLIT:
+		// cells of a size 2 node are single blocks already
+		if (size <= 2 || r->next >= r->groups)
+			return EINVAL;
+
+		g = r->next++;
+		o->parents[g] = (uint32_t)n;
+		o->gens[g] = o->gen;
+		o->epochs[g] = o->epoch;
+
+		// representatives are computed by ot_update_reps
+		node->type = (node->type & ONT_SIDE_MASK) | ONT_SPLIT | ONT_STALE;
+		node->data.children = g;
+
+		for (unsigned i = 0; i < 8; ++i) {
+			o->nodes[((size_t)g << 3) + i].type = i;
+
+			if ((error = ot_load_node(o, r, ((size_t)g << 3) + i, size >> 1)))
+				return error;
+		}
+		return 0;
+	case OTF_UNIFORM:
+		r->run = b >> 2;
+
+		if (r->run == 63) {
+			if ((error = otr_varint(r, &v)) || v > UINT64_MAX - 63)
+				return EINVAL;
+
+			r->run += v;
+		}
+
+		if ((error = otr_varint(r, &v)) || v > (block_t)-1)
+			return EINVAL;
+
+		r->id = (block_t)v;
+		goto uniform;
+	case OTF_CELLS:
+		for (unsigned i = 0; i < 8;) {
+			unsigned len;
+
+			if ((error = otr_varint(r, &v)))
+				return error;
+
+			len = (unsigned)(v & 7) + 1;
+
+			if (i + len > 8 || v >> 3 > (block_t)-1)
+				return EINVAL;
+
+			while (len--)
+				node->data.cells[i++] = (block_t)(v >> 3);
+		}
+
+		ot_load_cells(o, node, size);
+		return 0;
+	}
+
+	return EINVAL;
+uniform:
+	for (unsigned i = 0; i < 8; ++i)
+		node->data.cells[i] = r->id;
+
+	ot_load_cells(o, node, size);
+	return 0;
+}
+
+/* Initialise o with the tree in the size bytes at data, see ot_encode. */
+int ot_decode(struct ot_pool *o, const void *data, size_t size)
+{
+	const unsigned char *p = data;
+	struct ot_pool t;
+	struct ot_reader r;
+	uint64_t groups, blocks, payload;
+	unsigned root_size;
+	int error;
+
+	if (size < OTF_HEADER || memcmp(p, OTF_MAGIC, 4))
+		return EINVAL;
+
+	if (get_le(p + 4, 2) != OTF_VERSION || get_le(p + 6, 2))
+		return ENOTSUP;
+
+	root_size = (unsigned)get_le(p + 8, 4);
+	groups = get_le(p + 12, 4);
+	blocks = get_le(p + 16, 8);
+	payload = get_le(p + 24, 8);
+
+	if (!groups || groups > OT_MAXCAP >> 3 || payload != (uint64_t)size - OTF_HEADER)
+		return EINVAL;
+
+	if ((error = ot_init(&t, groups < 2 ? 16 : (size_t)groups << 3, OT_RCAP, root_size)))
+		return error;
+
+	r.pos = p + OTF_HEADER;
+	r.end = p + size;
+	r.run = 0;
+	r.id = ID_AIR;
+	r.next = 1;
+	r.groups = (uint32_t)groups;
+
+	t.gens[0] = t.gen;
+
+	if ((error = ot_load_node(&t, &r, t.root, root_size)))
+		goto fail;
+
+	if (r.pos != r.end || r.run || r.next != groups || t.blocks != blocks) {
+		error = EINVAL;
+		goto fail;
+	}
+
+	t.count = (size_t)groups << 3;
+	*o = t;
+	return 0;
+fail:
+	ot_free(&t);
+	return error;
+}
+
+/*
+ * Initialise o with the tree in path, see ot_save. The file is mapped and
+ * decoded in one pass straight into a pool of the right size. Everything in
+ * it counts as changed for ot_dirty.
+ */
+int ot_load(struct ot_pool *o, const char *path)
+{
+	const unsigned char *data = MAP_FAILED;
+	struct stat st;
+	int fd, error;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return errno;
+
+	if (fstat(fd, &st)) {
+		error = errno;
+		goto fail;
+	}
+
+	if (st.st_size < OTF_HEADER) {
+		error = EINVAL;
+		goto fail;
+	}
+
+	if ((data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		error = errno;
+		goto fail;
+	}
+
+	madvise((void*)data, (size_t)st.st_size, MADV_SEQUENTIAL);
+	error = ot_decode(o, data, (size_t)st.st_size);
+fail:
+	if (data != MAP_FAILED)
+		munmap((void*)data, (size_t)st.st_size);
+
+	close(fd);
+	return error;
+}
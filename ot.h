@@ -0,0 +1,204 @@
+#ifndef OT_H
+#define OT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint16_t block_t;
+// must match sizeof(block_t)
+typedef uint16_t meta_t;
+
+#define ID_AIR 0
+#define ID_STONE 1
+#define ID_GRASS 2
+
+#define ONT_SIDE_MASK 0x000f
+#define ONT_TYPE_MASK 0x00f0
+
+// set for each non-air cell
+#define ONT_CELL_MASK 0xff00
+// split nodes have no cells, so they use the cell mask to mark an outdated representative
+#define ONT_STALE 0x0100
+// representative block id of split nodes, see ot_rep
+#define ONT_REP_SHIFT 16
+#define ONT_REP_MASK 0xffff0000u
+
+#define ONT_CELL 0x10
+#define ONT_SPLIT 0x20
+// cell node whose cells all hold the same non-air block id
+#define ONT_UNIFORM 0x30
+
+#define OT_CAP 1024
+#define OT_RCAP 32
+#define OT_SIZE 32
+// morton codes are limited to 21 bits per axis
+#define OT_SIZE_MAX (1u << 21)
+// number of levels below the root in the biggest tree
+#define OT_DEPTH_MAX 21
+
+/*
+ * Nodes are allocated in groups of 8 siblings. Nodes refer to each other by
+ * group index rather than by pointer, so the pool can be moved around freely.
+ * Group 0 is reserved for the root and is never handed out by ot_split.
+ *
+ * A cell node stores one block id per octant, so a cell node above the bottom
+ * level describes 8 uniformly filled cubes. If all 8 octants hold the same
+ * non-air id, the node is marked uniform and can be treated as a single block.
+ *
+ * Every node has a representative id: the most common non-air id of its
+ * octants, where octants of a split node count as the representative id of the
+ * child. It is only air if the whole subtree is air, so it can be used to draw
+ * a subtree as one block. Split nodes cache it in the upper bits of their type
+ * and only mark it stale on change, ot_update_reps brings them up to date.
+ */
+struct ot_node {
+	// lower nibble indicates which child this is
+	// upper nibble indicates node type
+	uint32_t type;
+	union {
+		// group index of children
+		uint32_t children;
+		block_t cells[8];
+	} data;
+};
+
+struct ot_snap;
+
+/* Group or node array that snapshots may still read, see ot_reclaim. */
+struct ot_retired {
+	// only snapshots taken before this epoch can see it
+	uint32_t epoch;
+	uint32_t group;
+	// array to free instead of a group, NULL otherwise
+	void *mem;
+};
+
+struct ot_pool {
+	struct ot_node *nodes;
+	// node index of parent for each group
+	uint32_t *parents;
+	// generation of the last change in each group or below, see ot_dirty
+	uint32_t *gens;
+	// generation that changes are stamped with
+	uint32_t gen;
+	// epoch in which each group was allocated, see ot_snapshot
+	uint32_t *epochs;
+	// bumped by each snapshot
+	uint32_t epoch;
+	// snapshots that have not been reclaimed yet from oldest to newest
+	struct ot_snap *snaps, *snaps_tail;
+	// waiting for snapshots to be released, in order of epoch
+	struct ot_retired *retired;
+	size_t nretired, retcap;
+	// index to first node.
+	size_t root;
+	// number of nodes and total capacity.
+	size_t count, cap;
+	// list that keeps track of free groups
+	uint32_t *rpop;
+	size_t rcount, rcap;
+	// block count
+	size_t blocks;
+	// Size of root node in blocks, must be power of 2 and at least 2.
+	// Writes outside the root make it grow, see ot_grow.
+	unsigned root_size;
+	// Called after cells with min <= (x,y,z) < max have changed, may be NULL.
+	void (*touch)(struct ot_pool *o, const int min[3], const int max[3]);
+};
+
+/*
+ * Read-only view of a pool at the time of ot_snapshot, which any thread may
+ * read while the pool keeps changing. Groups that a snapshot can see are never
+ * changed in place: writers copy them and the path up to the root instead, and
+ * the old ones are only reused once all snapshots that can see them have been
+ * released.
+ */
+struct ot_snap {
+	// only functions that take a const pool may be used on it
+	struct ot_pool ot;
+	uint32_t epoch;
+	// dropped by ot_snap_release, the pool frees it in ot_reclaim
+	unsigned refs;
+	struct ot_snap *next;
+};
+
+struct ot_cell {
+	int x, y, z;
+	block_t id;
+};
+
+/* First non-air cell along a ray, see ot_raycast. */
+struct ot_hit {
+	int pos[3];
+	// outward normal of the face the ray entered through, zero if it started inside
+	int normal[3];
+	// distance from the origin in blocks
+	float dist;
+	block_t id;
+};
+
+struct ot_iter_node {
+	size_t n;
+	int lo[3];
+	unsigned size;
+	// octant to look at next
+	unsigned next;
+};
+
+/* Cursor over the non-air cells in a box, see ot_iter_next. */
+struct ot_iter {
+	const struct ot_pool *o;
+	int min[3], max[3];
+	// path from the root to the current node
+	struct ot_iter_node path[OT_DEPTH_MAX + 1];
+	unsigned depth;
+};
+
+#define ot_group(o, g) (&(o)->nodes[(size_t)(g) << 3])
+#define ot_children(o, n) ot_group(o, (n)->data.children)
+#define ot_parent(o, i) ((o)->parents[(size_t)(i) >> 3])
+
+int ot_init(struct ot_pool *o, size_t cap, size_t rcap, unsigned size);
+void ot_free(struct ot_pool *o);
+
+int ot_copy(struct ot_pool *dst, const struct ot_pool *src);
+int ot_replace(struct ot_pool *o, struct ot_pool *src);
+int ot_reserve(struct ot_pool *o, size_t cap);
+
+int ot_split(struct ot_pool *o, size_t n);
+int ot_unsplit(struct ot_pool *o, size_t n);
+int ot_compact(struct ot_pool *o);
+int ot_grow(struct ot_pool *o);
+int ot_shrink(struct ot_pool *o, unsigned size);
+
+block_t ot_get_cell(const struct ot_pool *o, int x, int y, int z);
+int ot_set_cell(struct ot_pool *o, int x, int y, int z, block_t id);
+int ot_get_cells(const struct ot_pool *o, struct ot_cell *cells, size_t n);
+int ot_set_cells(struct ot_pool *o, const struct ot_cell *cells, size_t n);
+int ot_fill_box(struct ot_pool *o, const int min[3], const int max[3], block_t id);
+void ot_get_box(const struct ot_pool *o, const int min[3], const int max[3], block_t *buf);
+int ot_set_box(struct ot_pool *o, const int min[3], const int max[3], const block_t *buf);
+int ot_box_solid(const struct ot_pool *o, const int min[3], const int max[3]);
+
+void ot_iter_init(struct ot_iter *it, const struct ot_pool *o, const int min[3], const int max[3]);
+int ot_iter_next(struct ot_iter *it, int min[3], int max[3], block_t *id);
+int ot_for_each_in_box(const struct ot_pool *o, const int min[3], const int max[3], int (*cb)(void *arg, const int min[3], const int max[3], block_t id), void *arg);
+
+block_t ot_rep(const struct ot_node *n);
+void ot_update_reps(struct ot_pool *o);
+
+int ot_encode(const struct ot_pool *o, unsigned char **data, size_t *size);
+int ot_decode(struct ot_pool *o, const void *data, size_t size);
+int ot_save(const struct ot_pool *o, const char *path);
+int ot_load(struct ot_pool *o, const char *path);
+
+int ot_snapshot(struct ot_pool *o, struct ot_snap **snap);
+void ot_snap_ref(struct ot_snap *s);
+void ot_snap_release(struct ot_snap *s);
+void ot_reclaim(struct ot_pool *o);
+
+int ot_raycast(const struct ot_pool *o, const float origin[3], const float dir[3], float max_dist, struct ot_hit *hit);
+
+uint32_t ot_dirty(struct ot_pool *o, unsigned level, uint32_t since, void (*cb)(void *arg, const int pos[3], unsigned size), void *arg);
+
+#endif
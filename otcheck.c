@@ -0,0 +1,277 @@
+/*
+ * Randomized octree check.
+ *
+ * Made by Folkert van Verseveld
+ *
+ * Copyright Folkert van Verseveld. All rights reserved.
+ *
+ * Applies random edits, resizes, compactions and snapshots to a pool and the
+ * same edits to a dense array. Every so often the pool must match the array,
+ * and every live snapshot must still match the array as it was when the
+ * snapshot was taken. Run with make check.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ot.h"
+
+// cells in -CHECK_R <= (x,y,z) < CHECK_R are edited
+#define CHECK_R 24
+#define CHECK_N (2 * CHECK_R)
+#define CHECK_STEPS 200000
+// steps between full comparisons
+#define CHECK_EVERY 997
+#define CHECK_SNAPS 16
+#define CHECK_BOX 8
+
+static uint64_t seed = 88172645463325252ULL;
+
+static unsigned rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return (unsigned)seed;
+}
+
+static int rnd_pos(void)
+{
+	return (int)(rnd() % CHECK_N) - CHECK_R;
+}
+
+static inline size_t at(int x, int y, int z)
+{
+	return ((size_t)(z + CHECK_R) * CHECK_N + (size_t)(y + CHECK_R)) * CHECK_N + (size_t)(x + CHECK_R);
+}
+
+static const size_t ncells = (size_t)CHECK_N * CHECK_N * CHECK_N;
+
+static void dump(const struct ot_pool *o, block_t *buf)
+{
+	int min[3] = {-CHECK_R, -CHECK_R, -CHECK_R}, max[3] = {CHECK_R, CHECK_R, CHECK_R};
+
+	ot_get_box(o, min, max, buf);
+}
+
+/* Compare o with cells and its block count, returns 0 if they match. */
+static int same(const struct ot_pool *o, const block_t *cells, block_t *buf)
+{
+	size_t blocks = 0;
+
+	dump(o, buf);
+
+	for (size_t i = 0; i < ncells; ++i)
+		blocks += cells[i] != ID_AIR;
+
+	return memcmp(buf, cells, ncells * sizeof *buf) || o->blocks != blocks;
+}
+
+struct check_snap {
+	struct ot_snap *s;
+	// what the pool looked like when s was taken
+	block_t *cells;
+};
+
+/* Do one random operation on o and truth. Returns -1 if a released snapshot had changed. */
+static int step(struct ot_pool *o, block_t *truth, struct check_snap *snaps, unsigned *nsnaps, block_t *buf)
+{
+	unsigned op = rnd() % 100;
+	int min[3], max[3];
+	block_t id = rnd() % 3;
+
+	if (op < 60) {
+		int x = rnd_pos(), y = rnd_pos(), z = rnd_pos();
+
+		truth[at(x, y, z)] = id;
+		return ot_set_cell(o, x, y, z, id);
+	}
+
+	if (op < 70) {
+		struct ot_cell c[16];
+
+		for (unsigned i = 0; i < 16; ++i) {
+			c[i].x = rnd_pos();
+			c[i].y = rnd_pos();
+			c[i].z = rnd_pos();
+			c[i].id = rnd() % 3;
+			truth[at(c[i].x, c[i].y, c[i].z)] = c[i].id;
+		}
+
+		return ot_set_cells(o, c, 16);
+	}
+
+	if (op < 76) {
+		for (unsigned i = 0; i < 3; ++i) {
+			min[i] = rnd_pos();
+			max[i] = min[i] + 1 + (int)(rnd() % 9);
+
+			if (max[i] > CHECK_R)
+				max[i] = CHECK_R;
+		}
+
+		for (int z = min[2]; z < max[2]; ++z)
+			for (int y = min[1]; y < max[1]; ++y)
+				for (int x = min[0]; x < max[0]; ++x)
+					truth[at(x, y, z)] = id;
+
+		return ot_fill_box(o, min, max, id);
+	}
+
+	if (op < 80) {
+		block_t box[CHECK_BOX * CHECK_BOX * CHECK_BOX];
+
+		for (unsigned i = 0; i < 3; ++i) {
+			min[i] = (int)(rnd() % (CHECK_N - CHECK_BOX)) - CHECK_R;
+			max[i] = min[i] + CHECK_BOX;
+		}
+
+		// mostly solid, so whole octants become uniform
+		for (unsigned i = 0; i < CHECK_BOX * CHECK_BOX * CHECK_BOX; ++i)
+			box[i] = rnd() % 4 ? ID_STONE : rnd() % 3;
+
+		for (int z = 0; z < CHECK_BOX; ++z)
+			for (int y = 0; y < CHECK_BOX; ++y)
+				for (int x = 0; x < CHECK_BOX; ++x)
+					truth[at(x + min[0], y + min[1], z + min[2])] = box[(z * CHECK_BOX + y) * CHECK_BOX + x];
+
+		return ot_set_box(o, min, max, box);
+	}
+
+	if (op < 82)
+		return ot_shrink(o, 2);
+
+	if (op < 83)
+		return ot_compact(o);
+
+	if (op < 84) {
+		struct ot_pool copy;
+		int error;
+
+		// same tree in new memory, while snapshots still read the old one
+		if ((error = ot_copy(&copy, o)))
+			return error;
+
+		if ((error = ot_replace(o, &copy)))
+			ot_free(&copy);
+
+		return error;
+	}
+
+	if (op < 87) {
+		ot_update_reps(o);
+		return 0;
+	}
+
+	if (op < 93) {
+		struct check_snap *s = &snaps[*nsnaps];
+		int error;
+
+		if (*nsnaps == CHECK_SNAPS)
+			return 0;
+
+		if (!(s->cells = malloc(ncells * sizeof *s->cells)))
+			return ENOMEM;
+
+		if ((error = ot_snapshot(o, &s->s))) {
+			free(s->cells);
+			return error;
+		}
+
+		memcpy(s->cells, truth, ncells * sizeof *truth);
+		++*nsnaps;
+		return 0;
+	}
+
+	if (op < 99) {
+		unsigned i;
+
+		if (!*nsnaps)
+			return 0;
+
+		i = rnd() % *nsnaps;
+
+		if (same(&snaps[i].s->ot, snaps[i].cells, buf))
+			return -1;
+
+		ot_snap_release(snaps[i].s);
+		free(snaps[i].cells);
+		snaps[i] = snaps[--*nsnaps];
+		return 0;
+	}
+
+	ot_reclaim(o);
+	return 0;
+}
+
+int main(void)
+{
+	struct ot_pool o;
+	struct check_snap snaps[CHECK_SNAPS];
+	unsigned nsnaps = 0;
+	block_t *truth, *buf;
+	int error = 1;
+
+	truth = calloc(ncells, sizeof *truth);
+	buf = malloc(ncells * sizeof *buf);
+
+	if (!truth || !buf || ot_init(&o, OT_CAP, OT_RCAP, 8)) {
+		fputs("otcheck: out of memory\n", stderr);
+		goto fail;
+	}
+
+	for (unsigned i = 0; i < CHECK_STEPS; ++i) {
+		if ((error = step(&o, truth, snaps, &nsnaps, buf))) {
+			fprintf(stderr, "otcheck: step %u: %s\n", i, error < 0 ? "snapshot has changed" : strerror(error));
+			error = 1;
+			goto fail_ot;
+		}
+
+		if (i % CHECK_EVERY)
+			continue;
+
+		if (same(&o, truth, buf)) {
+			fprintf(stderr, "otcheck: step %u: pool differs\n", i);
+			error = 1;
+			goto fail_ot;
+		}
+
+		for (unsigned j = 0; j < nsnaps; ++j)
+			if (same(&snaps[j].s->ot, snaps[j].cells, buf)) {
+				fprintf(stderr, "otcheck: step %u: snapshot %u has changed\n", i, j);
+				error = 1;
+				goto fail_ot;
+			}
+	}
+
+	while (nsnaps) {
+		--nsnaps;
+		ot_snap_release(snaps[nsnaps].s);
+		free(snaps[nsnaps].cells);
+	}
+
+	// nothing can be left waiting once all snapshots are gone
+	ot_reclaim(&o);
+
+	if (o.nretired || o.snaps || same(&o, truth, buf)) {
+		fputs("otcheck: pool not reclaimed\n", stderr);
+		error = 1;
+		goto fail_ot;
+	}
+
+	printf("otcheck: %u steps ok, %zu blocks, %zu nodes\n", CHECK_STEPS, o.blocks, o.count);
+	error = 0;
+fail_ot:
+	while (nsnaps) {
+		--nsnaps;
+		ot_snap_release(snaps[nsnaps].s);
+		free(snaps[nsnaps].cells);
+	}
+
+	ot_free(&o);
+fail:
+	free(buf);
+	free(truth);
+	return error;
+}
@@ -8,16 +8,23 @@
  */
 #include <stdio.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
 
 // sdl stuff
+#define GL_GLEXT_PROTOTYPES
 #include <GL/gl.h>
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_image.h>
@@ -25,60 +32,53 @@
 #include <SDL2/SDL_keycode.h>
 
 #include "dbg.h"
+#include "gen.h"
+#include "mesh.h"
+#include "mesher.h"
+#include "net.h"
+#include "ot.h"
+#include "trace.h"
+#include "world.h"
 
 #define ARRAY_SIZE(a) (sizeof(a)/sizeof(a[0]))
 
 // TODO reuse hlist.c
 // TODO reuse daemon.c
 
-typedef uint16_t block_t;
-// must match sizeof(block_t)
-typedef uint16_t meta_t;
-
-#define ID_AIR 0
-#define ID_STONE 1
-#define ID_GRASS 2
-
-#define ONT_SIDE_MASK 0x000f
-#define ONT_TYPE_MASK 0x00f0
-
-// TODO use for (un)marking blocks
-// TODO use for unsplit
-#define ONT_CELL_MASK 0x0f00
-
-#define ONT_CELL 0x10
-#define ONT_SPLIT 0x20
-
-#define OT_CAP 1024
-#define OT_RCAP 32
-#define OT_SIZE 32
-
-struct ot_node {
-	struct ot_node *parent;
-	// lower nibble indicates which child this is
-	// upper nibble indicates node type
-	unsigned type;
-	union {
-		struct ot_node *children;
-		block_t cells[8];
-	} data;
-};
-
-// TODO add cap, flags for resize
-struct ot_pool {
-	struct ot_node *nodes;
-	// index to first node.
-	size_t root;
-	// number of nodes and total capacity.
-	size_t count, cap;
-	// list that keeps track of first free slots
-	size_t *rpop;
-	size_t rcount, rcap;
-	// block count
-	size_t blocks;
-	// Size of root node in blocks, must be power of 2 and at least 2.
-	unsigned root_size;
-} ot_pool;
+struct ot_pool ot_pool;
+struct mesh_cache mesh_cache;
+// world that is streamed around the player, used instead of ot_pool if paged is set
+struct world map;
+int paged = 0;
+// replicate ot_pool to clients, or mirror ot_pool from a server
+struct net_server net_server;
+struct net_client net_client;
+int listening = 0, connected = 0;
+
+// cleared to leave the main loop, read by both the main and simulation thread
+static volatile sig_atomic_t running = 1;
+
+// ticks run on their own thread while the main thread draws, see sim_loop
+int threaded = 0;
+pthread_t sim_thread;
+// time between ticks in ns
+uint64_t tick_period;
+
+// size of subtrees that get their own vertex buffer
+unsigned chunk_size = MESH_CHUNK;
+// merge coplanar faces of chunks
+int greedy = 0;
+// draw split nodes as one block if they are smaller than this many pixels, 0 to disable
+float lod_pixels = 0;
+
+#define UPLOAD_BUDGET 16
+
+// background mesh threads, 0 builds meshes on the main thread
+unsigned workers;
+// maximum number of chunks uploaded per frame
+unsigned upload_budget = UPLOAD_BUDGET;
+// show timings on screen, toggled with F3
+int hud = 0;
 
 SDL_Window *win;
 SDL_GLContext gl;
@@ -86,6 +86,11 @@ SDL_GLContext gl;
 #define INIT_OT 1
 #define INIT_IMG 2
 #define INIT_SDL 4
+#define INIT_MESH 8
+#define INIT_MESHER 16
+#define INIT_WORLD 32
+#define INIT_NET 64
+#define INIT_SIM 128
 
 unsigned init_mask = 0;
 
@@ -102,6 +107,10 @@ unsigned init_mask = 0;
 #define TEX_FONT 0
 #define TEX_TERRAIN 1
 
+// terrain atlas is a grid of 16x16 tiles
+#define TILE_SIZE 16
+#define TILE_COUNT 256
+
 struct texture {
 	GLuint id;
 	unsigned w, h;
@@ -111,6 +120,9 @@ struct texture {
 	{(GLuint)-1, TERRAIN_WIDTH, TERRAIN_HEIGHT, "terrain.png"},
 };
 
+// separate repeating texture for each terrain tile, used by greedy meshes
+GLuint tiles[TILE_COUNT];
+
 struct player {
 	// fractional position
 	float pos[3];
@@ -119,6 +131,13 @@ struct player {
 
 int mouse_ignore = 1, mouse_pos[2], mouse_d[2];
 
+// block under the crosshair, valid if aiming is set
+struct ot_hit aim;
+int aiming;
+
+// how far away blocks can be picked
+#define REACH 8.0f
+
 #define KEY_Z_UP   1
 #define KEY_Z_DOWN 2
 #define KEY_Y_UP   4
@@ -128,272 +147,106 @@ int mouse_ignore = 1, mouse_pos[2], mouse_d[2];
 
 static unsigned keys = 0;
 
-int ot_init(struct ot_pool *o, size_t cap, size_t rcap, unsigned size)
-{
-	struct ot_node *nodes;
-	size_t *rpop;
-
-	if (cap < 8 || size < 2 || (size & (size - 1)))
-		return EINVAL;
-
-	if (!(nodes = malloc(cap * sizeof *nodes)))
-		return ENOMEM;
-	if (!(rpop = malloc(rcap * sizeof *rpop))) {
-		free(nodes);
-		return ENOMEM;
-	}
-
-	o->nodes = nodes;
-	o->count = 0;
-	o->cap = cap;
-	o->root_size = size;
-
-	o->rpop = rpop;
-	o->rcount = 0;
-	o->rcap = rcap;
-
-	return 0;
-}
-
-void ot_free(struct ot_pool *o)
-{
-	free(o->rpop);
-	free(o->nodes);
-}
-
-int ot_split(struct ot_pool *o, struct ot_node *n)
-{
-	struct ot_node *children;
-
-	assert((n->type & ONT_TYPE_MASK) == ONT_CELL);
-
-	// check for resize
-	if (o->count >= o->cap - 8) {
-		size_t maxcap, newcap;
-
-		maxcap = SIZE_MAX / sizeof(struct ot_node);
-
-		if (o->cap >= maxcap)
-			return EOVERFLOW;
-
-		newcap = o->cap > maxcap >> 1 ? maxcap : o->cap << 1;
-		children = realloc(o->nodes, newcap * sizeof(struct ot_node));
-
-		if (!children)
-			return ENOMEM;
-
-		o->nodes = children;
-		o->cap = newcap;
-	}
-
-	children = &o->nodes[o->rcount ? o->rpop[--o->rcount] : o->count];
-	o->count += 8;
-
-	for (unsigned i = 0; i < 8; ++i) {
-		children[i].parent = n;
-		children[i].type = ONT_CELL | i;
-
-		for (unsigned j = 0; j < 8; ++j)
-			children[i].data.cells[j] = 0;
-	}
-
-	n->data.children = children;
-	n->type = (n->type & ONT_SIDE_MASK) | ONT_SPLIT;
-
-	return 0;
-}
-
-int ot_unsplit(struct ot_pool *o, struct ot_node *n)
-{
-#if 0
-	struct ot_node *root = &o->nodes[o->root];
-
-	// check for resize
-	if (o->rcount == o->rcap) {
-		size_t maxcap, newcap;
-		size_t *data;
-
-		maxcap = SIZE_MAX / sizeof(size_t);
-
-		if (o->rcap >= maxcap)
-			// can't resize anymore, should never happen
-			return EOVERFLOW;
-
-		newcap = o->rcap > maxcap >> 1 ? maxcap : o->rcap << 1;
-		data = realloc(o->rpop, newcap * sizeof(size_t));
-
-		if (!data)
-			return 1;
-
-		o->rpop = data;
-		o->rcap = newcap;
-	}
-
-	if (root == n) {
-		o->count = 0;
-		o->rcount = 0;
-		return 0;
-	}
+// mouse buttons that may wait for the next tick
+#define INPUT_CLICKS 16
 
-	assert(o->count > 8);
-
-	for (; n->parent; n = n->parent) {
-		unsigned side = n->type & ONT_SIDE_MASK;
+/* Input gathered by the main thread for the next tick. */
+struct input {
+	unsigned keys;
+	// mouse motion since the last tick
+	int mouse_d[2];
+	unsigned clicks[INPUT_CLICKS], nclicks;
+	int reset;
+};
 
-		// ignore if the parent has more children
-		if (side != (n->parent->type & ONT_SIDE_MASK))
-			continue;
+/* Box min <= (x,y,z) < max of cached meshes that are outdated. */
+struct dirty_box {
+	int min[3], max[3];
+};
 
-		dbgf("unsplit %u\n", side);
-	}
+// outdated boxes per frame, more are merged with the last one
+#define DIRTY_MAX 256
+
+// protects input and dirty, which are passed between the main and simulation thread
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct input input;
+static struct dirty_box dirty[DIRTY_MAX];
+static unsigned ndirty;
+
+// held by whoever touches map, a paged world can't be snapshotted
+static pthread_mutex_t world_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Everything the main thread needs to draw a tick. */
+struct sim_state {
+	// player after the previous tick and this one, frames are drawn in between
+	struct player prev, cur;
+	// CLOCK_MONOTONIC in ns when this tick was due
+	uint64_t time;
+	// time spent in tick in ms, NAN if unknown
+	float tick_ms;
+	struct ot_hit aim;
+	int aiming;
+	// ot_pool as of this tick, NULL if paged
+	struct ot_snap *snap;
+};
 
-	return 0;
-#else
-	(void)o;
-	(void)n;
+// set in state_ready if the simulation has put a tick there the main thread hasn't taken yet
+#define STATE_NEW 4
 
-	dbgs("todo unsplit");
-	return 0;
-#endif
-}
+/*
+ * Triple buffer of ticks. The simulation fills back and swaps it with ready,
+ * the main thread swaps front with ready if STATE_NEW is set. Neither side
+ * ever waits for the other, and the main thread always draws the newest tick.
+ */
+static struct sim_state states[3];
+static unsigned state_back = 0, state_front = 1, state_ready = 2;
+// player as of the last tick that has been put
+static struct player state_last;
 
-static inline unsigned cell_get_pos(int cx, int cy, int cz, int x, int y, int z)
+/* Take the newest tick the simulation has put. Main thread only. */
+static const struct sim_state *state_take(void)
 {
-	int dx, dy, dz;
+	if (__atomic_load_n(&state_ready, __ATOMIC_ACQUIRE) & STATE_NEW)
+		state_front = __atomic_exchange_n(&state_ready, state_front, __ATOMIC_ACQ_REL) & 3;
 
-	dx = x >= cx;
-	dy = y >= cy;
-	dz = z >= cz;
-
-	return (dz << 2) + (dy << 1) + dx;
+	return &states[state_front];
 }
 
-static inline void cell_pos_update(int *size, int *cx, int *cy, int *cz, int x, int y, int z)
+/* Hand the back buffer to the main thread. Simulation only. */
+static void state_put(void)
 {
-	*size >>= 1;
-
-	*cx = x >= *cx ? *cx + *size : *cx - *size;
-	*cy = y >= *cy ? *cy + *size : *cy - *size;
-	*cz = z >= *cz ? *cz + *size : *cz - *size;
+	state_back = __atomic_exchange_n(&state_ready, state_back | STATE_NEW, __ATOMIC_ACQ_REL) & 3;
 }
 
-block_t ot_get_cell(const struct ot_pool *o, int x, int y, int z)
+/* Append box to dirty, sim_lock must be held. */
+static void dirty_push(const int min[3], const int max[3])
 {
-	assert(o->count);
-
-	// ignore if position out of boundaries
-	int size = (int)(o->root_size >> 1);
-
-	if (z < -size || y < -size || x < -size || z >= size || y >= size || x >= size)
-		return ID_AIR;
+	struct dirty_box *b;
 
-	int cx = 0, cy = 0, cz = 0;
-	unsigned pos;
+	// too many, so make the last one cover this one too
+	if (ndirty == DIRTY_MAX) {
+		b = &dirty[DIRTY_MAX - 1];
 
-	struct ot_node *node = &o->nodes[o->root];
-
-	while (size > 1) {
-		pos = cell_get_pos(cx, cy, cz, x, y, z);
-
-		if ((node->type & ONT_TYPE_MASK) == ONT_CELL)
-			return node->data.cells[pos];
-
-		node = &node->data.children[pos];
-		cell_pos_update(&size, &cx, &cy, &cz, x, y, z);
+		for (unsigned i = 0; i < 3; ++i) {
+			if (min[i] < b->min[i])
+				b->min[i] = min[i];
+			if (max[i] > b->max[i])
+				b->max[i] = max[i];
+		}
+		return;
 	}
 
-	pos = cell_get_pos(cx, cy, cz, x, y, z);
-	return node->data.cells[pos];
+	b = &dirty[ndirty++];
+	memcpy(b->min, min, sizeof b->min);
+	memcpy(b->max, max, sizeof b->max);
 }
 
-int ot_set_cell(struct ot_pool *o, int x, int y, int z, block_t id)
+/* Tell the main thread that cached meshes in min <= (x,y,z) < max are outdated. */
+static void sim_touch(const int min[3], const int max[3])
 {
-	// TODO merge blocks where are cells are set to ID_AIR
-	int error;
-
-	// ignore if position out of boundaries
-	int size = (int)(o->root_size >> 1);
-
-	if (z < -size || y < -size || x < -size || z >= size || y >= size || x >= size)
-		// TODO resize
-		return ERANGE;
-
-	int cx = 0, cy = 0, cz = 0;
-	unsigned pos;
-
-	// ensure there's an initial node
-	if (!o->count) {
-		o->count = 1;
-		o->nodes[o->root = 0].type = ONT_CELL;
-	}
-
-	struct ot_node *node = &o->nodes[o->root];
-
-	// if root node is a cell, keep splitting if size > 2
-	if ((node->type & ONT_TYPE_MASK) == ONT_CELL) {
-		if (size == 1) {
-			pos = ((z + 1) << 2) + ((y + 1) << 1) + (x + 1);
-			goto put_pos;
-		} else {
-			while (size > 1) {
-				error = ot_split(o, node);
-				if (error)
-					return error;
-
-				pos = cell_get_pos(cx, cy, cz, x, y, z);
-				node = &node->data.children[pos];
-
-				cell_pos_update(&size, &cx, &cy, &cz, x, y, z);
-			}
-
-			// node has been split into size 2, now put block there
-			goto put;
-		}
-		return 0;
-	}
-
-	// strategy: find closest node, split if bigger than 2, put block
-
-	while (size > 1) {
-		if ((node->type & ONT_TYPE_MASK) == ONT_CELL) {
-			while (size > 1) {
-				error = ot_split(o, node);
-				if (error)
-					return error;
-
-				pos = cell_get_pos(cx, cy, cz, x, y, z);
-				node = &node->data.children[pos];
-
-				cell_pos_update(&size, &cx, &cy, &cz, x, y, z);
-			}
-			break;
-		}
-
-		pos = cell_get_pos(cx, cy, cz, x, y, z);
-		node = &node->data.children[pos];
-
-		cell_pos_update(&size, &cx, &cy, &cz, x, y, z);
-	}
-
-put:
-	pos = cell_get_pos(cx, cy, cz, x, y, z);
-put_pos:
-	if (id && !node->data.cells[pos])
-		++o->blocks;
-
-	node->data.cells[pos] = id;
-
-	if (id)
-		node->type |= 0x100 << pos;
-	else {
-		--o->blocks;
-		node->type &= ~(0x100 << pos);
-
-		if (!(node->type & ONT_CELL_MASK))
-			return ot_unsplit(o, node);
-	}
-
-	return 0;
+	pthread_mutex_lock(&sim_lock);
+	dirty_push(min, max);
+	pthread_mutex_unlock(&sim_lock);
 }
 
 static int tex_map(GLuint tex, SDL_Surface *surf)
@@ -426,6 +279,7 @@ static int tex_map(GLuint tex, SDL_Surface *surf)
 static int tex_init(GLuint tex, const char *path, unsigned w, unsigned h)
 {
 	SDL_Surface *surf;
+	uint64_t t = trace_start();
 	int error = 1;
 
 	surf = IMG_Load(path);
@@ -450,6 +304,59 @@ static int tex_init(GLuint tex, const char *path, unsigned w, unsigned h)
 fail:
 	if (surf)
 		SDL_FreeSurface(surf);
+
+	trace_span("tex_init", t);
+	return error;
+}
+
+/* Cut the terrain atlas in separate textures, so they can be repeated. */
+static int tiles_init(const char *path)
+{
+	SDL_Surface *surf;
+	unsigned bpp;
+	GLenum format;
+	uint64_t t = trace_start();
+	int error = 1;
+
+	if (!(surf = IMG_Load(path))) {
+		fprintf(stderr, "tiles_init: failed to load %s: %s\n", path, IMG_GetError());
+		return 1;
+	}
+
+	bpp = surf->format->BytesPerPixel;
+
+	if (surf->format->palette || (bpp != 3 && bpp != 4)
+		|| surf->w != TERRAIN_WIDTH || surf->h != TERRAIN_HEIGHT)
+	{
+		fprintf(stderr, "tiles_init: unsupported image %s\n", path);
+		goto fail;
+	}
+
+	format = bpp == 3 ? GL_RGB : GL_RGBA;
+
+	glGenTextures(TILE_COUNT, tiles);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, surf->pitch / bpp);
+
+	for (unsigned i = 0; i < TILE_COUNT; ++i) {
+		const unsigned char *p = surf->pixels;
+
+		p += (i / 16) * TILE_SIZE * surf->pitch + (i % 16) * TILE_SIZE * bpp;
+
+		glBindTexture(GL_TEXTURE_2D, tiles[i]);
+		glTexImage2D(GL_TEXTURE_2D, 0, format, TILE_SIZE, TILE_SIZE, 0, format, GL_UNSIGNED_BYTE, p);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	}
+
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	error = 0;
+fail:
+	SDL_FreeSurface(surf);
+	trace_span("tiles_init", t);
 	return error;
 }
 
@@ -471,6 +378,9 @@ int game_init(void)
 		t->id = tex[i];
 	}
 
+	if (greedy && (error = tiles_init(textures[TEX_TERRAIN].path)))
+		goto fail;
+
 	error = 0;
 fail:
 	if (error)
@@ -529,20 +439,30 @@ static void keydown(const SDL_Event *ev)
 	if (virt > 0xff) {
 		switch (virt) {
 		case SDLK_HOME:
-			player_reset(&you);
+			pthread_mutex_lock(&sim_lock);
+			input.reset = 1;
+			pthread_mutex_unlock(&sim_lock);
+			break;
+		case SDLK_F3:
+			hud = !hud;
 			break;
 		}
 		return;
 	}
+
+	pthread_mutex_lock(&sim_lock);
+
 	// TODO add keys
 	switch (virt) {
-	case 'q': keys |= KEY_Z_UP;   break;
-	case 'e': keys |= KEY_Z_DOWN; break;
-	case 'w': keys |= KEY_Y_UP;   break;
-	case 's': keys |= KEY_Y_DOWN; break;
-	case 'd': keys |= KEY_X_UP;   break;
-	case 'a': keys |= KEY_X_DOWN; break;
+	case 'q': input.keys |= KEY_Z_UP;   break;
+	case 'e': input.keys |= KEY_Z_DOWN; break;
+	case 'w': input.keys |= KEY_Y_UP;   break;
+	case 's': input.keys |= KEY_Y_DOWN; break;
+	case 'd': input.keys |= KEY_X_UP;   break;
+	case 'a': input.keys |= KEY_X_DOWN; break;
 	}
+
+	pthread_mutex_unlock(&sim_lock);
 }
 
 static void keyup(const SDL_Event *ev)
@@ -554,15 +474,20 @@ static void keyup(const SDL_Event *ev)
 
 	if (virt > 0xff)
 		return;
+
+	pthread_mutex_lock(&sim_lock);
+
 	// TODO add keys
 	switch (virt) {
-	case 'q': keys &= ~KEY_Z_UP;   break;
-	case 'e': keys &= ~KEY_Z_DOWN; break;
-	case 'w': keys &= ~KEY_Y_UP;   break;
-	case 's': keys &= ~KEY_Y_DOWN; break;
-	case 'd': keys &= ~KEY_X_UP;   break;
-	case 'a': keys &= ~KEY_X_DOWN; break;
+	case 'q': input.keys &= ~KEY_Z_UP;   break;
+	case 'e': input.keys &= ~KEY_Z_DOWN; break;
+	case 'w': input.keys &= ~KEY_Y_UP;   break;
+	case 's': input.keys &= ~KEY_Y_DOWN; break;
+	case 'd': input.keys &= ~KEY_X_UP;   break;
+	case 'a': input.keys &= ~KEY_X_DOWN; break;
 	}
+
+	pthread_mutex_unlock(&sim_lock);
 }
 
 #define MOUSESPEED 0.01
@@ -610,13 +535,135 @@ void player_move(struct player *p, unsigned ms)
 		p->pos[0] += cos(angle) * MOVESPEED * ms;
 		p->pos[1] += sin(angle) * MOVESPEED * ms;
 	}
+
+	// look direction, must match the rotation in draw_world
+	double pitch = p->rot[0] / 180.0 * M_PI, yaw = p->rot[2] / 180.0 * M_PI;
+	float org[3] = {p->pos[0], p->pos[1], p->pos[2] + 0.5f + 1.7f};
+	float dir[3] = {-cos(pitch) * sin(yaw), cos(pitch) * cos(yaw), sin(pitch)};
+
+	aiming = paged ? world_raycast(&map, org, dir, REACH, &aim) : ot_raycast(&ot_pool, org, dir, REACH, &aim);
+}
+
+/* Break the block under the crosshair or place one against the face we look at. */
+static void mouse_click(unsigned button)
+{
+	int error;
+
+	if (!aiming)
+		return;
+
+	switch (button) {
+	case SDL_BUTTON_LEFT:
+		if (paged)
+			error = world_set_cell(&map, aim.pos[0], aim.pos[1], aim.pos[2], ID_AIR);
+		else if (connected)
+			error = net_client_set_cell(&net_client, aim.pos[0], aim.pos[1], aim.pos[2], ID_AIR);
+		// give back space at the border that has become empty
+		else if (!(error = ot_set_cell(&ot_pool, aim.pos[0], aim.pos[1], aim.pos[2], ID_AIR)))
+			error = ot_shrink(&ot_pool, OT_SIZE);
+		break;
+	case SDL_BUTTON_RIGHT:
+		if (paged)
+			error = world_set_cell(&map, aim.pos[0] + aim.normal[0], aim.pos[1] + aim.normal[1], aim.pos[2] + aim.normal[2], ID_STONE);
+		else if (connected)
+			error = net_client_set_cell(&net_client, aim.pos[0] + aim.normal[0], aim.pos[1] + aim.normal[1], aim.pos[2] + aim.normal[2], ID_STONE);
+		else
+			error = ot_set_cell(&ot_pool, aim.pos[0] + aim.normal[0], aim.pos[1] + aim.normal[1], aim.pos[2] + aim.normal[2], ID_STONE);
+		break;
+	default:
+		return;
+	}
+
+	// the world can't grow any further or the chunk isn't there yet, not an error worth reporting
+	if (error && error != ERANGE && error != EAGAIN)
+		fprintf(stderr, "mouse_click: %s\n", strerror(error));
+
+	// the world changed under the crosshair
+	aiming = 0;
+}
+
+// generation of the world the mesh cache has seen
+static uint32_t mesh_gen;
+// snapshots from the server the mesh cache has seen
+static unsigned long mesh_snapshots;
+
+/* Apply changes from the server and send ours. Returns ECONNRESET once the server is gone. */
+static int client_tick(void)
+{
+	int error, size;
+
+	if ((error = net_client_poll(&net_client)) || (error = net_client_flush(&net_client)))
+		return error;
+
+	// a new snapshot has replaced the whole world, so no cached mesh is any good
+	if (net_client.snapshots != mesh_snapshots && (init_mask & INIT_MESH)) {
+		int min[3], max[3];
+
+		size = (int)(ot_pool.root_size >> 1);
+		min[0] = min[1] = min[2] = -size - 1;
+		max[0] = max[1] = max[2] = size + 1;
+
+		sim_touch(min, max);
+		mesh_gen = ot_pool.gen;
+	}
+
+	mesh_snapshots = net_client.snapshots;
+	return 0;
+}
+
+/* Apply what the player has done since the last tick. */
+static void input_apply(void)
+{
+	unsigned clicks[INPUT_CLICKS], nclicks;
+	int reset;
+
+	pthread_mutex_lock(&sim_lock);
+
+	keys = input.keys;
+	mouse_d[0] += input.mouse_d[0];
+	mouse_d[1] += input.mouse_d[1];
+	input.mouse_d[0] = input.mouse_d[1] = 0;
+
+	nclicks = input.nclicks;
+	memcpy(clicks, input.clicks, nclicks * sizeof *clicks);
+	input.nclicks = 0;
+
+	reset = input.reset;
+	input.reset = 0;
+
+	pthread_mutex_unlock(&sim_lock);
+
+	if (reset)
+		player_reset(&you);
+
+	for (unsigned i = 0; i < nclicks; ++i)
+		mouse_click(clicks[i]);
 }
 
 /* Perform game tick. */
 static void tick(unsigned ms)
 {
+	int error;
+
+	input_apply();
+
+	if (listening && (error = net_server_poll(&net_server)))
+		fprintf(stderr, "net_server_poll: %s\n", strerror(error));
+
+	if (connected && (error = client_tick())) {
+		fprintf(stderr, "server: %s\n", strerror(error == ECONNRESET ? ENOTCONN : error));
+		__atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+	}
+
 	// TODO game tick
 	player_move(&you, ms);
+
+	if (paged && (error = world_update(&map, you.pos)))
+		fprintf(stderr, "world_update: %s\n", strerror(error));
+
+	// everything that has changed during this tick goes out as one message
+	if (listening && (error = net_server_flush(&net_server)))
+		fprintf(stderr, "net_server_flush: %s\n", strerror(error));
 }
 
 static void mouse_move(SDL_Event *ev)
@@ -630,8 +677,12 @@ static void mouse_move(SDL_Event *ev)
 		mouse_ignore = 0;
 		goto update;
 	}
-	mouse_d[0] = mx - mouse_pos[0];
-	mouse_d[1] = my - mouse_pos[1];
+
+	// there may be several frames per tick
+	pthread_mutex_lock(&sim_lock);
+	input.mouse_d[0] += mx - mouse_pos[0];
+	input.mouse_d[1] += my - mouse_pos[1];
+	pthread_mutex_unlock(&sim_lock);
 
 	SDL_WarpMouseInWindow(win, WIDTH / 2, HEIGHT / 2);
 
@@ -640,6 +691,17 @@ update:
 	mouse_pos[1] = my;
 }
 
+static void mouse_down(const SDL_Event *ev)
+{
+	pthread_mutex_lock(&sim_lock);
+
+	// nobody clicks this fast, drop the rest
+	if (input.nclicks < INPUT_CLICKS)
+		input.clicks[input.nclicks++] = ev->button.button;
+
+	pthread_mutex_unlock(&sim_lock);
+}
+
 #define CAM_FOVY 45.0
 #define CAM_ZNEAR 0.05
 #define CAM_ZFAR 1000.0
@@ -654,192 +716,854 @@ static void cam_perspective(GLdouble fovy, GLdouble aspect, GLdouble znear, GLdo
 	glFrustum(-fw, fw, -fh, fh, znear, zfar);
 }
 
-static void draw_block(unsigned size, int x, int y, int z, block_t id)
+static inline double ts_diff(const struct timespec *a, const struct timespec *b)
 {
-	if (!id)
-		return;
+	return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) * 1e-9;
+}
 
-	GLfloat x0 = (GLfloat)x, x1 = (GLfloat)x + size;
-	GLfloat y0 = (GLfloat)y, y1 = (GLfloat)y + size;
-	GLfloat z0 = (GLfloat)z, z1 = (GLfloat)z + size;
-	unsigned idx, idy;
-	idx = id % 16;
-	idy = id / 16;
-	GLfloat tx0 = idx / 16.0f, tx1 = (idx + 1) / 16.0f;
-	GLfloat ty0 = idy / 16.0f, ty1 = (idy + 1) / 16.0f;
+static inline uint64_t ts_ns(const struct timespec *t)
+{
+	return (uint64_t)t->tv_sec * 1000000000ULL + (uint64_t)t->tv_nsec;
+}
 
-	glBegin(GL_QUADS);
-#define pp(x,y,z,s,t) glTexCoord2f(s,t);glVertex3f(x,y,z)
-// z1
-	pp(x0, y0, z1, tx0, ty1);
-	pp(x1, y0, z1, tx1, ty1);
-	pp(x1, y1, z1, tx1, ty0);
-	pp(x0, y1, z1, tx0, ty0);
-// z0
-	pp(x0, y1, z0, tx0, ty1);
-	pp(x1, y1, z0, tx1, ty1);
-	pp(x1, y0, z0, tx1, ty0);
-	pp(x0, y0, z0, tx0, ty0);
-// y1
-	pp(x1, y1, z0, tx0, ty1);
-	pp(x0, y1, z0, tx1, ty1);
-	pp(x0, y1, z1, tx1, ty0);
-	pp(x1, y1, z1, tx0, ty0);
-// y0
-	pp(x0, y0, z0, tx0, ty1);
-	pp(x1, y0, z0, tx1, ty1);
-	pp(x1, y0, z1, tx1, ty0);
-	pp(x0, y0, z1, tx0, ty0);
-// x1
-	pp(x1, y0, z1, tx0, ty0);
-	pp(x1, y0, z0, tx0, ty1);
-	pp(x1, y1, z0, tx1, ty1);
-	pp(x1, y1, z1, tx1, ty0);
-// x0
-	pp(x0, y1, z1, tx0, ty0);
-	pp(x0, y1, z0, tx0, ty1);
-	pp(x0, y0, z0, tx1, ty1);
-	pp(x0, y0, z1, tx1, ty0);
+// scratch buffer for meshes that are drawn right away
+static struct mesh mesh_tmp;
+
+struct mesher mesher;
+// id of last background job
+static unsigned mesh_jobs;
+// finished jobs that did not fit in the upload budget yet
+static struct mesh_job *uploads, *uploads_tail;
+// faces drawn and culled this frame
+static struct mesh_stats frame_stats;
+
+// octree nodes visited, skipped because they are out of view, drawn and drawn as one block this frame
+static struct node_stats {
+	unsigned long visited, culled, drawn, lod;
+} node_stats;
+// glDrawArrays calls this frame
+static unsigned long draw_calls;
+
+// what is measured each frame, durations are in ms
+#define M_FRAME 0
+#define M_EVENTS 1
+#define M_TICK 2
+#define M_WORLD 3
+#define M_OT 4
+#define M_SWAP 5
+#define M_NODES 6
+#define M_FACES 7
+#define M_CALLS 8
+#define M_COUNT 9
+
+static const char *const metric_names[M_COUNT] = {
+	"frame", "events", "tick", "world", "ot", "swap", "nodes", "faces", "calls",
+};
 
-	glEnd();
+// frames that min, avg and p99 are taken over
+#define TIMING_SAMPLES 240
+
+/* Last TIMING_SAMPLES values of a metric. */
+struct timing {
+	float samples[TIMING_SAMPLES];
+	unsigned head, count;
+};
+
+// metrics of recent frames, only touched by the main thread
+static struct timing timings[M_COUNT];
+// metrics of this frame, NAN if there is nothing to add
+static double frame_metrics[M_COUNT];
+// one line per frame with all metrics, NULL to disable
+static FILE *timings_csv;
+static unsigned long frame_count;
+
+static void timing_add(struct timing *t, float v)
+{
+	t->samples[t->head] = v;
+	t->head = (t->head + 1) % TIMING_SAMPLES;
+
+	if (t->count < TIMING_SAMPLES)
+		++t->count;
 }
 
-// TODO optimize
-void draw_node(const struct ot_node *n, unsigned size, int x, int y, int z)
+static int float_cmp(const void *a, const void *b)
 {
-	unsigned hsize = size >> 1;
+	float x = *(const float*)a, y = *(const float*)b;
+	return (x > y) - (x < y);
+}
 
-#ifdef DEBUG
-	GLfloat f = (GLfloat)size / OT_SIZE;
-	glColor3f(f, f, f);
-	glBegin(GL_LINES);
-	glVertex3f(x - size * .5f, y - size * .5f, z - size * .5f);
-	glVertex3f(x + size * .5f, y - size * .5f, z - size * .5f);
-	glVertex3f(x + size * .5f, y - size * .5f, z - size * .5f);
-	glVertex3f(x + size * .5f, y + size * .5f, z - size * .5f);
-	glVertex3f(x + size * .5f, y + size * .5f, z - size * .5f);
-	glVertex3f(x - size * .5f, y + size * .5f, z - size * .5f);
-	glVertex3f(x - size * .5f, y + size * .5f, z - size * .5f);
-	glVertex3f(x - size * .5f, y - size * .5f, z - size * .5f);
+/* Compute min, average and 99th percentile of t. Returns 0 if there are no samples. */
+static int timing_summary(const struct timing *t, float *min, float *avg, float *p99)
+{
+	float sorted[TIMING_SAMPLES];
+	double sum = 0;
 
-	glVertex3f(x - size * .5f, y - size * .5f, z + size * .5f);
-	glVertex3f(x + size * .5f, y - size * .5f, z + size * .5f);
-	glVertex3f(x + size * .5f, y - size * .5f, z + size * .5f);
-	glVertex3f(x + size * .5f, y + size * .5f, z + size * .5f);
-	glVertex3f(x + size * .5f, y + size * .5f, z + size * .5f);
-	glVertex3f(x - size * .5f, y + size * .5f, z + size * .5f);
-	glVertex3f(x - size * .5f, y + size * .5f, z + size * .5f);
-	glVertex3f(x - size * .5f, y - size * .5f, z + size * .5f);
+	if (!t->count)
+		return 0;
 
-	glVertex3f(x - size * .5f, y - size * .5f, z - size * .5f);
-	glVertex3f(x - size * .5f, y - size * .5f, z + size * .5f);
-	glVertex3f(x + size * .5f, y - size * .5f, z - size * .5f);
-	glVertex3f(x + size * .5f, y - size * .5f, z + size * .5f);
-	glVertex3f(x - size * .5f, y + size * .5f, z - size * .5f);
-	glVertex3f(x - size * .5f, y + size * .5f, z + size * .5f);
-	glVertex3f(x + size * .5f, y + size * .5f, z - size * .5f);
-	glVertex3f(x + size * .5f, y + size * .5f, z + size * .5f);
-	glEnd();
-#endif
+	memcpy(sorted, t->samples, t->count * sizeof *sorted);
+	qsort(sorted, t->count, sizeof *sorted, float_cmp);
 
-	switch (n->type & ONT_TYPE_MASK) {
-	case ONT_CELL:
-		//dbgf("cell (%d,%d,%d): size=%u\n", x, y, z, size);
-		glColor3f(1, 1, 1);
-		draw_block(hsize, x - hsize, y - hsize, z - hsize, n->data.cells[0]);
-		draw_block(hsize, x, y - hsize, z - hsize, n->data.cells[1]);
-		draw_block(hsize, x - hsize, y, z - hsize, n->data.cells[2]);
-		draw_block(hsize, x, y, z - hsize, n->data.cells[3]);
-		draw_block(hsize, x - hsize, y - hsize, z, n->data.cells[4]);
-		draw_block(hsize, x, y - hsize, z, n->data.cells[5]);
-		draw_block(hsize, x - hsize, y, z, n->data.cells[6]);
-		draw_block(hsize, x, y, z, n->data.cells[7]);
-		break;
-	case ONT_SPLIT:
-		draw_node(&n->data.children[0], size / 2, x - size / 4, y - size / 4, z - size / 4);
-		draw_node(&n->data.children[1], size / 2, x + size / 4, y - size / 4, z - size / 4);
-		draw_node(&n->data.children[2], size / 2, x - size / 4, y + size / 4, z - size / 4);
-		draw_node(&n->data.children[3], size / 2, x + size / 4, y + size / 4, z - size / 4);
-		draw_node(&n->data.children[4], size / 2, x - size / 4, y - size / 4, z + size / 4);
-		draw_node(&n->data.children[5], size / 2, x + size / 4, y - size / 4, z + size / 4);
-		draw_node(&n->data.children[6], size / 2, x - size / 4, y + size / 4, z + size / 4);
-		draw_node(&n->data.children[7], size / 2, x + size / 4, y + size / 4, z + size / 4);
-		break;
-	}
+	for (unsigned i = 0; i < t->count; ++i)
+		sum += sorted[i];
+
+	*min = sorted[0];
+	*avg = (float)(sum / t->count);
+	*p99 = sorted[(t->count - 1) * 99 / 100];
+	return 1;
 }
 
-void draw_ot(const struct ot_pool *o)
+static uint64_t timer_start(void)
 {
-	if (!o->count)
-		return;
+	struct timespec t;
 
-	const struct ot_node *root = &o->nodes[o->root];
-	draw_node(root, o->root_size, 0, 0, 0);
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return ts_ns(&t);
 }
 
-void draw_world(void)
+/* Add the time since start to metric m of this frame. */
+static void timer_stop(unsigned m, uint64_t start)
 {
-	glMatrixMode(GL_PROJECTION);
-	glLoadIdentity();
+	frame_metrics[m] += (timer_start() - start) * 1e-6;
+	trace_span(metric_names[m], start);
+}
 
-	cam_perspective(CAM_FOVY, (GLdouble)WIDTH / HEIGHT, CAM_ZNEAR, CAM_ZFAR);
+static void frame_begin(void)
+{
+	for (unsigned i = 0; i < M_COUNT; ++i)
+		frame_metrics[i] = 0;
+
+	// only frames that get a new tick have one to report
+	frame_metrics[M_TICK] = NAN;
+	frame_stats.faces = frame_stats.culled = 0;
+	node_stats.visited = node_stats.culled = node_stats.drawn = node_stats.lod = 0;
+	draw_calls = 0;
+}
 
-	glMatrixMode(GL_MODELVIEW);
-	glLoadIdentity();
-	glEnable(GL_BLEND);
-	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+/* Keep this frame's metrics and write them to timings_csv. */
+static void frame_end(void)
+{
+	frame_metrics[M_NODES] = node_stats.visited;
+	frame_metrics[M_FACES] = frame_stats.faces;
+	frame_metrics[M_CALLS] = draw_calls;
 
-	const struct player *p = &you;
+	for (unsigned i = 0; i < M_COUNT; ++i)
+		if (!isnan(frame_metrics[i]))
+			timing_add(&timings[i], (float)frame_metrics[i]);
 
-	glRotatef(-p->rot[0] - 90, 1, 0, 0);
-	glRotatef(-p->rot[2], 0, 0, 1);
+	++frame_count;
+
+	if (!timings_csv)
+		return;
+
+	fprintf(timings_csv, "%lu", frame_count);
+
+	for (unsigned i = 0; i < M_COUNT; ++i)
+		if (isnan(frame_metrics[i]))
+			fputs(",", timings_csv);
+		else
+			fprintf(timings_csv, i < M_NODES ? ",%.3f" : ",%.0f", frame_metrics[i]);
+
+	fputc('\n', timings_csv);
+}
+
+// camera position in world coordinates
+static float eye[3];
+// pixels per block at a distance of one block
+static float lod_scale;
+// world coordinates of cell (0,0,0) of the octree that is being drawn
+static int draw_off[3];
+
+/* Check whether a node with size and centre (x,y,z) is small enough on screen to draw as a single block. */
+static int lod_test(unsigned size, int x, int y, int z)
+{
+	GLfloat h = size * .5f, c[3] = {x, y, z}, d2 = 0;
+
+	if (lod_pixels <= 0)
+		return 0;
+
+	// squared distance from eye to closest point of the cube
+	for (unsigned i = 0; i < 3; ++i) {
+		GLfloat d = fabsf(eye[i] - c[i]) - h;
+
+		if (d > 0)
+			d2 += d * d;
+	}
+
+	return size * lod_scale < lod_pixels * sqrtf(d2);
+}
+
+#define FRUSTUM_ALL 0x3f
+
+// planes a*x + b*y + c*z + d >= 0 that enclose the view frustum in world coordinates
+static GLfloat frustum[6][4];
+
+/* Extract frustum planes from the current projection and modelview matrix. */
+static void frustum_update(void)
+{
+	GLfloat p[16], mv[16], m[16];
+
+	glGetFloatv(GL_PROJECTION_MATRIX, p);
+	glGetFloatv(GL_MODELVIEW_MATRIX, mv);
+
+	// m = p * mv, both column major
+	for (unsigned c = 0; c < 4; ++c)
+		for (unsigned r = 0; r < 4; ++r) {
+			m[c * 4 + r] = 0;
+
+			for (unsigned k = 0; k < 4; ++k)
+				m[c * 4 + r] += p[k * 4 + r] * mv[c * 4 + k];
+		}
+
+	// left, right, bottom, top, near, far
+	for (unsigned i = 0; i < 3; ++i)
+		for (unsigned c = 0; c < 4; ++c) {
+			frustum[2 * i][c] = m[c * 4 + 3] + m[c * 4 + i];
+			frustum[2 * i + 1][c] = m[c * 4 + 3] - m[c * 4 + i];
+		}
+}
+
+/*
+ * Test cube with centre (x,y,z) against the frustum planes in mask. Returns
+ * the planes the cube still crosses, so children only have to be tested
+ * against those, or -1 if it is completely outside.
+ */
+static int frustum_test(unsigned mask, unsigned size, int x, int y, int z)
+{
+	GLfloat h = size * .5f;
+
+	for (unsigned i = 0; i < 6; ++i) {
+		const GLfloat *f = frustum[i];
+		GLfloat d, r;
+
+		if (!(mask & (1 << i)))
+			continue;
+
+		d = f[0] * x + f[1] * y + f[2] * z + f[3];
+		r = h * (fabsf(f[0]) + fabsf(f[1]) + fabsf(f[2]));
+
+		if (d < -r)
+			return -1;
+
+		if (d >= r)
+			mask &= ~(1u << i);
+	}
+
+	return (int)mask;
+}
+
+/* Draw count vertices at data, or per block id if there are any ranges. */
+static void draw_quads(const void *data, size_t count, const struct mesh_range *r, size_t nranges)
+{
+	if (!count)
+		return;
+
+	glInterleavedArrays(GL_T2F_V3F, 0, data);
+
+	if (!nranges) {
+		glDrawArrays(GL_QUADS, 0, (GLsizei)count);
+		++draw_calls;
+	} else {
+		draw_calls += nranges;
+
+		for (size_t i = 0; i < nranges; ++i) {
+			glBindTexture(GL_TEXTURE_2D, tiles[r[i].id % TILE_COUNT]);
+			glDrawArrays(GL_QUADS, (GLint)r[i].first, (GLsizei)r[i].count);
+		}
+
+		glBindTexture(GL_TEXTURE_2D, textures[TEX_TERRAIN].id);
+	}
+
+	glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+	glDisableClientState(GL_VERTEX_ARRAY);
+}
+
+static void draw_mesh(const struct mesh *m)
+{
+	draw_quads(m->data, m->count, m->ranges, m->nranges);
+}
+
+static void chunk_release(struct mesh_chunk *ch)
+{
+	GLuint vbo = ch->vbo;
+
+	if (vbo)
+		glDeleteBuffers(1, &vbo);
+
+	ch->vbo = 0;
+}
+
+/* Draw chunk with size and centre (x,y,z) from the mesh cache, rebuild it in the background if it has changed. */
+static void draw_chunk(const struct ot_pool *o, unsigned size, int x, int y, int z)
+{
+	int hsize = (int)(size >> 1);
+	int pos[3] = {x - hsize, y - hsize, z - hsize};
+	// cached by world coordinates, so chunks of different octrees don't mix
+	struct mesh_chunk *ch = mesh_cache_get(&mesh_cache,
+		mesh_chunk_coord(pos[0] + draw_off[0], mesh_cache.chunk_size),
+		mesh_chunk_coord(pos[1] + draw_off[1], mesh_cache.chunk_size),
+		mesh_chunk_coord(pos[2] + draw_off[2], mesh_cache.chunk_size)
+	);
+
+	if (!ch) {
+		// no room in cache, draw it the slow way
+		mesh_clear(&mesh_tmp);
+
+		if (!(greedy ? mesh_chunk_greedy : mesh_chunk)(&mesh_tmp, o, pos, size, &frame_stats))
+			draw_mesh(&mesh_tmp);
+		return;
+	}
+
+	// keep drawing the old mesh until the new one is uploaded
+	if ((ch->flags & (MESH_DIRTY | MESH_QUEUED)) == MESH_DIRTY) {
+		struct mesh_job *j = mesher_job(&mesher, o, pos, size);
+
+		if (j) {
+			j->x = ch->x;
+			j->y = ch->y;
+			j->z = ch->z;
+			j->seq = ch->job = ++mesh_jobs;
+
+			ch->flags = (ch->flags & ~MESH_DIRTY) | MESH_QUEUED;
+			mesher_submit(&mesher, j);
+		}
+	}
+
+	ch->flags |= MESH_USED;
+	frame_stats.faces += ch->stats.faces;
+	frame_stats.culled += ch->stats.culled;
+
+	if (ch->vbo) {
+		glBindBuffer(GL_ARRAY_BUFFER, ch->vbo);
+		draw_quads(NULL, ch->count, ch->ranges, ch->nranges);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+}
+
+/* Upload finished job to its chunk. Returns 0 if it was outdated. */
+static int chunk_upload(struct mesh_job *j)
+{
+	struct mesh_chunk *ch = mesh_cache_find(&mesh_cache, j->x, j->y, j->z);
+
+	// chunk has been dropped or queued again since
+	if (!ch || ch->job != j->seq)
+		return 0;
+
+	ch->flags &= ~MESH_QUEUED;
+
+	if (j->error || mesh_chunk_set_ranges(ch, &j->mesh)) {
+		ch->flags |= MESH_DIRTY;
+		return 0;
+	}
+
+	if (!ch->vbo) {
+		GLuint vbo;
+
+		glGenBuffers(1, &vbo);
+		ch->vbo = vbo;
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, ch->vbo);
+	glBufferData(GL_ARRAY_BUFFER, j->mesh.count * sizeof *j->mesh.data, j->mesh.data, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	ch->count = j->mesh.count;
+	ch->stats = j->stats;
+	return 1;
+}
+
+/* Upload at most upload_budget finished chunks, the rest waits for the next frame. */
+static void mesh_upload(void)
+{
+	struct mesh_job *j = mesher_poll(&mesher);
+	unsigned n = 0;
+
+	if (j) {
+		if (uploads_tail)
+			uploads_tail->next = j;
+		else
+			uploads = j;
+
+		while (j->next)
+			j = j->next;
+
+		uploads_tail = j;
+	}
+
+	while ((j = uploads) && n < upload_budget) {
+		if (!(uploads = j->next))
+			uploads_tail = NULL;
+
+		n += chunk_upload(j);
+		mesher_release(&mesher, j);
+	}
+}
+
+void draw_node(const struct ot_pool *o, const struct ot_node *n, unsigned size, int x, int y, int z, unsigned planes)
+{
+	const struct ot_node *children;
+	int mask;
+
+	++node_stats.visited;
+
+	if ((mask = frustum_test(planes, size, x + draw_off[0], y + draw_off[1], z + draw_off[2])) < 0) {
+		++node_stats.culled;
+		return;
+	}
+
+	planes = (unsigned)mask;
+
+#ifdef DEBUG
+	GLfloat f = (GLfloat)size / OT_SIZE;
+	glColor3f(f, f, f);
+	glBegin(GL_LINES);
+	glVertex3f(x - size * .5f, y - size * .5f, z - size * .5f);
+	glVertex3f(x + size * .5f, y - size * .5f, z - size * .5f);
+	glVertex3f(x + size * .5f, y - size * .5f, z - size * .5f);
+	glVertex3f(x + size * .5f, y + size * .5f, z - size * .5f);
+	glVertex3f(x + size * .5f, y + size * .5f, z - size * .5f);
+	glVertex3f(x - size * .5f, y + size * .5f, z - size * .5f);
+	glVertex3f(x - size * .5f, y + size * .5f, z - size * .5f);
+	glVertex3f(x - size * .5f, y - size * .5f, z - size * .5f);
+
+	glVertex3f(x - size * .5f, y - size * .5f, z + size * .5f);
+	glVertex3f(x + size * .5f, y - size * .5f, z + size * .5f);
+	glVertex3f(x + size * .5f, y - size * .5f, z + size * .5f);
+	glVertex3f(x + size * .5f, y + size * .5f, z + size * .5f);
+	glVertex3f(x + size * .5f, y + size * .5f, z + size * .5f);
+	glVertex3f(x - size * .5f, y + size * .5f, z + size * .5f);
+	glVertex3f(x - size * .5f, y + size * .5f, z + size * .5f);
+	glVertex3f(x - size * .5f, y - size * .5f, z + size * .5f);
+
+	glVertex3f(x - size * .5f, y - size * .5f, z - size * .5f);
+	glVertex3f(x - size * .5f, y - size * .5f, z + size * .5f);
+	glVertex3f(x + size * .5f, y - size * .5f, z - size * .5f);
+	glVertex3f(x + size * .5f, y - size * .5f, z + size * .5f);
+	glVertex3f(x - size * .5f, y + size * .5f, z - size * .5f);
+	glVertex3f(x - size * .5f, y + size * .5f, z + size * .5f);
+	glVertex3f(x + size * .5f, y + size * .5f, z - size * .5f);
+	glVertex3f(x + size * .5f, y + size * .5f, z + size * .5f);
+	glEnd();
+#endif
+
+	glColor3f(1, 1, 1);
+
+	if ((n->type & ONT_TYPE_MASK) != ONT_SPLIT) {
+		// blocks this big are rare, so just draw them
+		mesh_clear(&mesh_tmp);
+
+		++node_stats.drawn;
+
+		if (!mesh_node(&mesh_tmp, o, n, size, x, y, z, &frame_stats))
+			draw_mesh(&mesh_tmp);
+		return;
+	}
+
+	if (lod_test(size, x + draw_off[0], y + draw_off[1], z + draw_off[2])) {
+		++node_stats.drawn;
+		++node_stats.lod;
+		mesh_clear(&mesh_tmp);
+
+		if (!mesh_lod(&mesh_tmp, o, n, size, x, y, z, &frame_stats))
+			draw_mesh(&mesh_tmp);
+		return;
+	}
+
+	if (size <= mesh_cache.chunk_size) {
+		++node_stats.drawn;
+		draw_chunk(o, size, x, y, z);
+		return;
+	}
+
+	children = ot_children(o, n);
+	draw_node(o, &children[0], size / 2, x - size / 4, y - size / 4, z - size / 4, planes);
+	draw_node(o, &children[1], size / 2, x + size / 4, y - size / 4, z - size / 4, planes);
+	draw_node(o, &children[2], size / 2, x - size / 4, y + size / 4, z - size / 4, planes);
+	draw_node(o, &children[3], size / 2, x + size / 4, y + size / 4, z - size / 4, planes);
+	draw_node(o, &children[4], size / 2, x - size / 4, y - size / 4, z + size / 4, planes);
+	draw_node(o, &children[5], size / 2, x + size / 4, y - size / 4, z + size / 4, planes);
+	draw_node(o, &children[6], size / 2, x - size / 4, y + size / 4, z + size / 4, planes);
+	draw_node(o, &children[7], size / 2, x + size / 4, y + size / 4, z + size / 4, planes);
+}
+
+/* Draw octree with its origin at draw_off. */
+void draw_ot(const struct ot_pool *o)
+{
+	if (o->blocks) {
+		const struct ot_node *root = &o->nodes[o->root];
+		uint64_t t = timer_start();
+
+		glPushMatrix();
+		glTranslatef(draw_off[0], draw_off[1], draw_off[2]);
+		draw_node(o, root, o->root_size, 0, 0, 0, FRUSTUM_ALL);
+		glPopMatrix();
+		timer_stop(M_OT, t);
+	}
+}
+
+/* Outline the block under the crosshair as of tick st. */
+static void draw_aim(const struct sim_state *st)
+{
+	// slightly bigger than the block so the lines don't fight with its faces
+	const float e = 0.005f;
+	float lo[3], hi[3];
+
+	if (!st->aiming)
+		return;
+
+	for (unsigned i = 0; i < 3; ++i) {
+		lo[i] = st->aim.pos[i] - e;
+		hi[i] = st->aim.pos[i] + 1 + e;
+	}
+
+	glColor3f(0, 0, 0);
+	glBegin(GL_LINES);
+
+	for (unsigned i = 0; i < 4; ++i) {
+		float x = i & 1 ? hi[0] : lo[0], y = i & 2 ? hi[1] : lo[1];
+
+		// vertical edge and the edges along x and y at the bottom and top
+		glVertex3f(x, y, lo[2]); glVertex3f(x, y, hi[2]);
+		glVertex3f(lo[0], y, i & 1 ? hi[2] : lo[2]); glVertex3f(hi[0], y, i & 1 ? hi[2] : lo[2]);
+		glVertex3f(x, lo[1], i & 2 ? hi[2] : lo[2]); glVertex3f(x, hi[1], i & 2 ? hi[2] : lo[2]);
+	}
+
+	glEnd();
+	glColor3f(1, 1, 1);
+}
+
+static void chunk_dirty(void *arg, const int pos[3], unsigned size)
+{
+	// faces of neighbouring blocks may have become visible or hidden too
+	int min[3] = {pos[0] + draw_off[0] - 1, pos[1] + draw_off[1] - 1, pos[2] + draw_off[2] - 1};
+	int max[3] = {
+		pos[0] + draw_off[0] + (int)size + 1,
+		pos[1] + draw_off[1] + (int)size + 1,
+		pos[2] + draw_off[2] + (int)size + 1,
+	};
+
+	mesh_cache_touch(arg, min, max);
+}
+
+/* Mark all cached chunks of octree at draw_off dirty that have changed since generation *seen. */
+static void mesh_update(struct ot_pool *o, uint32_t *seen)
+{
+	unsigned level = 0;
+
+	for (unsigned size = o->root_size; size > mesh_cache.chunk_size; size >>= 1)
+		++level;
+
+	*seen = ot_dirty(o, level, *seen, chunk_dirty, &mesh_cache);
+}
+
+/* Chunks of the world have been loaded or evicted, so their meshes are outdated. */
+static void world_changed(struct world *w, const int min[3], const int max[3])
+{
+	(void)w;
+	mesh_cache_touch(&mesh_cache, min, max);
+}
+
+/* Like chunk_dirty, but for the main thread to pick up. sim_lock must be held. */
+static void sim_chunk_dirty(void *arg, const int pos[3], unsigned size)
+{
+	int min[3] = {pos[0] - 1, pos[1] - 1, pos[2] - 1};
+	int max[3] = {pos[0] + (int)size + 1, pos[1] + (int)size + 1, pos[2] + (int)size + 1};
+
+	(void)arg;
+	dirty_push(min, max);
+}
+
+/*
+ * Hand the tick that was due at time and took tick_ms to the main thread.
+ * Unless paged, it gets a snapshot of ot_pool to draw, together with the
+ * chunks that have changed since the last one. Simulation only, or before it
+ * has started.
+ */
+static int sim_publish(uint64_t time, float tick_ms)
+{
+	struct sim_state *st = &states[state_back];
+	struct ot_snap *snap = NULL;
+	int error;
+
+	if (!paged) {
+		unsigned level = 0;
+
+		if (lod_pixels > 0)
+			ot_update_reps(&ot_pool);
+
+		// the changes are picked up by the next tick that does get through
+		if ((error = ot_snapshot(&ot_pool, &snap)))
+			return error;
+
+		for (unsigned size = ot_pool.root_size; size > mesh_cache.chunk_size; size >>= 1)
+			++level;
+
+		pthread_mutex_lock(&sim_lock);
+		mesh_gen = ot_dirty(&ot_pool, level, mesh_gen, sim_chunk_dirty, NULL);
+		pthread_mutex_unlock(&sim_lock);
+	}
+
+	if (st->snap)
+		ot_snap_release(st->snap);
+
+	st->prev = state_last;
+	st->cur = state_last = you;
+	st->time = time;
+	st->tick_ms = tick_ms;
+	st->aim = aim;
+	st->aiming = aiming;
+	st->snap = snap;
+
+	state_put();
+	return 0;
+}
+
+/* Mark cached meshes dirty that the simulation has changed since the last frame. */
+static void dirty_take(void)
+{
+	pthread_mutex_lock(&sim_lock);
+
+	for (unsigned i = 0; i < ndirty; ++i)
+		mesh_cache_touch(&mesh_cache, dirty[i].min, dirty[i].max);
+
+	ndirty = 0;
+	pthread_mutex_unlock(&sim_lock);
+}
+
+/* Player t of the way from the previous tick to st. */
+static void player_lerp(struct player *p, const struct sim_state *st, float t)
+{
+	for (unsigned i = 0; i < 3; ++i) {
+		float d = st->cur.rot[i] - st->prev.rot[i];
+
+		// go the short way round
+		if (d > 180)
+			d -= 360;
+		else if (d < -180)
+			d += 360;
+
+		p->pos[i] = st->prev.pos[i] + (st->cur.pos[i] - st->prev.pos[i]) * t;
+		p->rot[i] = st->prev.rot[i] + d * t;
+	}
+}
+
+void draw_world(void)
+{
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+
+	cam_perspective(CAM_FOVY, (GLdouble)WIDTH / HEIGHT, CAM_ZNEAR, CAM_ZFAR);
+
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	static const struct sim_state *last;
+	const struct sim_state *st;
+	struct player view, *p = &view;
+	struct timespec now;
+	float t;
+
+	// outdated meshes must be known before we draw the snapshot they came with
+	dirty_take();
+	st = state_take();
+
+	// the front buffer only changes if there is a new tick
+	if (st != last)
+		frame_metrics[M_TICK] = st->tick_ms;
+
+	last = st;
+
+	// the tick has passed at most a period ago, unless the simulation falls behind
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	t = ts_ns(&now) > st->time ? (float)(ts_ns(&now) - st->time) / tick_period : 0;
+	player_lerp(p, st, t < 1 ? t : 1);
+
+	glRotatef(-p->rot[0] - 90, 1, 0, 0);
+	glRotatef(-p->rot[2], 0, 0, 1);
 	glTranslatef(-p->pos[0], -p->pos[1], -p->pos[2] - 0.5 - 1.7);
+	frustum_update();
+
+	eye[0] = p->pos[0];
+	eye[1] = p->pos[1];
+	eye[2] = p->pos[2] + 0.5f + 1.7f;
+	lod_scale = HEIGHT / (2 * tan(CAM_FOVY / 360.0 * M_PI));
+
+	glColor3f(1, 1, 1);
+
+	glEnable(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, textures[TEX_TERRAIN].id);
+
+#if 0
+	// TODO draw terrain
+	glBegin(GL_QUADS);
+	glVertex3f(2, -2, -2); glTexCoord2f(1, 1);
+	glVertex3f(2, 2, -2); glTexCoord2f(1, 0);
+	glVertex3f(-2, 2, -2); glTexCoord2f(0, 0);
+	glVertex3f(-2, -2, -2); glTexCoord2f(0, 1);
+	glEnd();
+#endif
+
+	if (paged) {
+		struct world_chunk *c;
+
+		pthread_mutex_lock(&world_lock);
+
+		for (c = map.newest; c; c = c->older) {
+			world_chunk_origin(&map, c, draw_off);
+			mesh_update(&c->ot, &c->seen);
+		}
+
+		mesh_upload();
+
+		for (c = map.newest; c; c = c->older) {
+			if (lod_pixels > 0)
+				ot_update_reps(&c->ot);
+
+			world_chunk_origin(&map, c, draw_off);
+			draw_ot(&c->ot);
+		}
+
+		mesh_cache_sweep(&mesh_cache, chunk_release);
+		pthread_mutex_unlock(&world_lock);
+	} else {
+		// sim_publish has already done mesh_update and ot_update_reps
+		draw_off[0] = draw_off[1] = draw_off[2] = 0;
+		mesh_upload();
+		draw_ot(&st->snap->ot);
+		mesh_cache_sweep(&mesh_cache, chunk_release);
+	}
+
+	glDisable(GL_TEXTURE_2D);
+	draw_aim(st);
+}
+
+// ms between updates of the numbers, so they can be read
+#define HUD_REFRESH 250
+
+// font.png is a grid of 16x16 glyphs in code page order
+#define GLYPH_WIDTH (FONT_WIDTH / 16)
+#define GLYPH_HEIGHT (FONT_HEIGHT / 16)
+
+static char hud_text[M_COUNT + 1][48];
+static Uint32 hud_time;
+
+/* Draw s with its top left corner at (x,y) in pixels. */
+static void draw_text(int x, int y, const char *s)
+{
+	const GLfloat gw = 1.0f / 16, gh = 1.0f / 16;
+
+	glBegin(GL_QUADS);
+
+	for (; *s; ++s, x += GLYPH_WIDTH) {
+		unsigned char c = *s;
+		GLfloat u = (c % 16) * gw, v = (c / 16) * gh;
+
+		glTexCoord2f(u, v);           glVertex2i(x, y);
+		glTexCoord2f(u, v + gh);      glVertex2i(x, y + GLYPH_HEIGHT);
+		glTexCoord2f(u + gw, v + gh); glVertex2i(x + GLYPH_WIDTH, y + GLYPH_HEIGHT);
+		glTexCoord2f(u + gw, v);      glVertex2i(x + GLYPH_WIDTH, y);
+	}
+
+	glEnd();
+}
+
+static void hud_update(void)
+{
+	snprintf(hud_text[0], sizeof hud_text[0], "%-6s %8s %8s %8s", "", "min", "avg", "p99");
+
+	for (unsigned i = 0; i < M_COUNT; ++i) {
+		char *line = hud_text[i + 1];
+		float min, avg, p99;
+
+		if (!timing_summary(&timings[i], &min, &avg, &p99))
+			snprintf(line, sizeof hud_text[0], "%-6s %8s", metric_names[i], "-");
+		else if (i < M_NODES)
+			snprintf(line, sizeof hud_text[0], "%-6s %8.2f %8.2f %8.2f ms", metric_names[i], min, avg, p99);
+		else
+			snprintf(line, sizeof hud_text[0], "%-6s %8.0f %8.0f %8.0f", metric_names[i], min, avg, p99);
+	}
+}
 
-	glColor3f(1, 1, 1);
+/* Show min, avg and p99 of the last TIMING_SAMPLES frames in the top left corner. */
+static void draw_hud(void)
+{
+	Uint32 now = SDL_GetTicks();
+	int w = 0, h = (M_COUNT + 1) * GLYPH_HEIGHT + 8;
 
-	glEnable(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, textures[TEX_TERRAIN].id);
+	if (!hud_text[0][0] || now - hud_time >= HUD_REFRESH) {
+		hud_update();
+		hud_time = now;
+	}
 
-#if 0
-	// TODO draw terrain
+	for (unsigned i = 0; i <= M_COUNT; ++i) {
+		int lw = (int)strlen(hud_text[i]) * GLYPH_WIDTH;
+
+		if (lw > w)
+			w = lw;
+	}
+
+	glMatrixMode(GL_PROJECTION);
+	glLoadIdentity();
+	glOrtho(0, WIDTH, HEIGHT, 0, -1, 1);
+	glMatrixMode(GL_MODELVIEW);
+	glLoadIdentity();
+
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_CULL_FACE);
+
+	// dark backdrop so the text can be read on anything
+	glColor4f(0, 0, 0, 0.5f);
 	glBegin(GL_QUADS);
-	glVertex3f(2, -2, -2); glTexCoord2f(1, 1);
-	glVertex3f(2, 2, -2); glTexCoord2f(1, 0);
-	glVertex3f(-2, 2, -2); glTexCoord2f(0, 0);
-	glVertex3f(-2, -2, -2); glTexCoord2f(0, 1);
+	glVertex2i(0, 0);
+	glVertex2i(0, h);
+	glVertex2i(w + 8, h);
+	glVertex2i(w + 8, 0);
 	glEnd();
-#endif
 
-	draw_ot(&ot_pool);
+	glEnable(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, textures[TEX_FONT].id);
+	glColor3f(1, 1, 1);
+
+	for (unsigned i = 0; i <= M_COUNT; ++i)
+		draw_text(4, 4 + (int)i * GLYPH_HEIGHT, hud_text[i]);
 
 	glDisable(GL_TEXTURE_2D);
+	glEnable(GL_CULL_FACE);
+	glEnable(GL_DEPTH_TEST);
 }
 
 /* Render all graphics on screen. */
 static void display(void)
 {
+	uint64_t t;
+
 	glClearColor(0, 0.5, 0.5, 0);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+	t = timer_start();
 	draw_world();
+	timer_stop(M_WORLD, t);
 
-	// TODO draw UI
+	if (hud)
+		draw_hud();
 }
 
 #define DT_MAX 500
 
-/* Main thread SDL loop. */
+/* Main thread SDL loop, ticks run in sim_loop on another thread. */
 static int sdl_loop(void)
 {
-	Uint32 ticks, next;
-	unsigned dt;
-
 	gl_init();
 	//SDL_ShowCursor(SDL_DISABLE);
-	ticks = SDL_GetTicks();
 
-	while (1) {
+	while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+		uint64_t t0 = timer_start(), t;
 		SDL_Event ev;
+
+		frame_begin();
+
 		while (SDL_PollEvent(&ev)) {
 			switch (ev.type) {
 			case SDL_QUIT:
@@ -853,38 +1577,29 @@ static int sdl_loop(void)
 			case SDL_MOUSEMOTION:
 				mouse_move(&ev);
 				break;
+			case SDL_MOUSEBUTTONDOWN:
+				mouse_down(&ev);
+				break;
 			}
 		}
 
-		next = SDL_GetTicks();
-		if (next < ticks)
-			next = ticks;
-		dt = next - ticks;
-		if (dt > DT_MAX)
-			dt = DT_MAX;
-		if (dt)
-			tick(dt);
-
+		timer_stop(M_EVENTS, t0);
 		display();
+
+		t = timer_start();
 		SDL_GL_SwapWindow(win);
+		timer_stop(M_SWAP, t);
 
-		ticks = next;
+		timer_stop(M_FRAME, t0);
+		frame_end();
 	}
 end:
 	return 0;
 }
 
-int main(void)
+/* Create initial world. Both the client and headless mode use this. */
+static void world_create(void)
 {
-	int error = 1;
-
-	if (ot_init(&ot_pool, OT_CAP, OT_RCAP, OT_SIZE)) {
-		fputs("ot_init failed\n", stderr);
-		goto fail;
-	}
-
-	init_mask |= INIT_OT;
-
 #if 0
 	ot_set_cell(&ot_pool, -4, 2, -2, ID_STONE);
 	ot_set_cell(&ot_pool, 3, 3, -3, ID_STONE);
@@ -898,15 +1613,475 @@ int main(void)
 
 	ot_set_cell(&ot_pool, -4, 2, -2, ID_AIR);
 #else
-
 	for (int x = -4; x < 4; ++x) {
 		ot_set_cell(&ot_pool, x, 0, -1, ID_STONE + ((x + 4) & 1));
 		printf("cell %d: %u\n", x, ot_get_cell(&ot_pool, x, 0, -1));
 	}
 
 	printf("block count: %zu\n", ot_pool.blocks);
-
 #endif
+}
+
+// default tick rate in Hz for headless mode
+#define TICK_RATE 20
+// interval in seconds for headless tick statistics
+#define TICK_REPORT 10
+
+static void handle_stop(int sig)
+{
+	(void)sig;
+	__atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+}
+
+struct tick_stats {
+	unsigned long count, overruns;
+	// durations in seconds
+	double min, max, sum;
+};
+
+static void tick_stats_reset(struct tick_stats *s)
+{
+	s->count = s->overruns = 0;
+	s->min = s->max = s->sum = 0;
+}
+
+static void tick_stats_add(struct tick_stats *s, double dt)
+{
+	if (!s->count || dt < s->min)
+		s->min = dt;
+	if (dt > s->max)
+		s->max = dt;
+
+	s->sum += dt;
+	++s->count;
+}
+
+static void tick_stats_dump(const struct tick_stats *s, const char *what)
+{
+	if (!s->count)
+		return;
+
+	printf("%s: ticks=%lu min=%.1fus avg=%.1fus max=%.1fus overruns=%lu\n",
+		what, s->count, s->min * 1e6, s->sum / s->count * 1e6, s->max * 1e6, s->overruns
+	);
+	fflush(stdout);
+}
+
+/* Print what has been sent to clients since bytes and messages were last sampled. */
+static void net_stats_dump(uint64_t *bytes, uint64_t *messages, unsigned long ticks)
+{
+	const struct net_stats *s = &net_server.stats;
+
+	if (!listening || !ticks)
+		return;
+
+	printf("net: clients=%u bytes/tick=%.1f messages/tick=%.1f snapshots=%llu dropped=%lu\n",
+		net_server.npeers, (double)(s->bytes - *bytes) / ticks, (double)(s->messages - *messages) / ticks,
+		(unsigned long long)s->snapshots, s->dropped
+	);
+	fflush(stdout);
+
+	*bytes = s->bytes;
+	*messages = s->messages;
+}
+
+/*
+ * Simulation loop, which is the main thread without any graphics. Ticks run at
+ * a fixed rate and we sleep until the next deadline. If a tick takes so long
+ * that we fall more than a whole period behind, we skip ahead instead of
+ * trying to catch up. If threaded, each tick is handed to the main thread.
+ */
+static int sim_loop(unsigned rate)
+{
+	struct tick_stats window, total;
+	struct timespec next, t0, t1;
+	uint64_t period = 1000000000ULL / rate, start, deadline, last_ms = 0;
+	unsigned long report = (unsigned long)rate * TICK_REPORT;
+	uint64_t bytes = net_server.stats.bytes, messages = net_server.stats.messages;
+
+	tick_stats_reset(&window);
+	tick_stats_reset(&total);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	start = deadline = ts_ns(&t0);
+
+	while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+		uint64_t now, ms, dt;
+		int error;
+
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+
+		if (paged)
+			pthread_mutex_lock(&world_lock);
+
+		// game time advances in whole milliseconds, carry the rest to the next tick
+		ms = (deadline - start) / 1000000ULL;
+		dt = ms - last_ms;
+		tick(dt > DT_MAX ? DT_MAX : (unsigned)dt);
+		trace_span("tick", ts_ns(&t0));
+		last_ms = ms;
+
+		if (threaded) {
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+
+			// the main thread keeps drawing the last tick that got through
+			if ((error = sim_publish(deadline, (float)(ts_diff(&t0, &t1) * 1e3))))
+				fprintf(stderr, "sim_publish: %s\n", strerror(error));
+
+			trace_span("sim_publish", ts_ns(&t1));
+		}
+
+		if (paged)
+			pthread_mutex_unlock(&world_lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+
+		tick_stats_add(&window, ts_diff(&t0, &t1));
+		tick_stats_add(&total, ts_diff(&t0, &t1));
+
+		deadline += period;
+		now = ts_ns(&t1);
+
+		if (now > deadline) {
+			++window.overruns;
+			++total.overruns;
+
+			if (now - deadline > period)
+				deadline = now;
+		} else {
+			next.tv_sec = deadline / 1000000000ULL;
+			next.tv_nsec = deadline % 1000000000ULL;
+
+			// interrupted sleeps are fine, running is checked anyway
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		}
+
+		if (window.count == report) {
+			tick_stats_dump(&window, "tick");
+			net_stats_dump(&bytes, &messages, window.count);
+			tick_stats_reset(&window);
+		}
+	}
+
+	tick_stats_dump(&total, "total");
+	net_stats_dump(&bytes, &messages, window.count);
+	return 0;
+}
+
+static void *sim_main(void *arg)
+{
+	trace_thread("sim");
+	sim_loop(*(const unsigned*)arg);
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [--headless] [--rate hz] [--chunk size] [--greedy] [--lod pixels]\n"
+		"\t[--workers n] [--upload chunks] [--world path] [--size blocks] [--seed n]\n"
+		"\t[--stream dir] [--radius chunks] [--budget mib] [--listen port] [--connect host[:port]]\n"
+		"\t[--hud] [--timings csv] [--trace json]\n"
+		"%s may also be set to the trace file\n", prog, TRACE_ENV);
+}
+
+// seconds to wait for the first snapshot from the server
+#define CONNECT_TIMEOUT 30
+
+static void server_touch(struct ot_pool *o, const int min[3], const int max[3])
+{
+	(void)o;
+	net_server_touch(&net_server, min, max);
+}
+
+/* Connect to host, which may end with :port, and wait until we have a copy of its world. */
+static int client_init(const char *host)
+{
+	char name[256], *colon;
+	unsigned long port = NET_PORT;
+	struct pollfd pfd;
+	int error, left = CONNECT_TIMEOUT * 1000;
+
+	if (snprintf(name, sizeof name, "%s", host) >= (int)sizeof name)
+		return ENAMETOOLONG;
+
+	// a single colon separates the port, more than one make an IPv6 address
+	if ((colon = strchr(name, ':')) && colon == strrchr(name, ':')) {
+		char *end;
+
+		*colon = '\0';
+		port = strtoul(colon + 1, &end, 10);
+
+		if (*end || !port || port > 65535)
+			return EINVAL;
+	}
+
+	if ((error = net_client_init(&net_client, &ot_pool, name, (unsigned short)port)))
+		return error;
+
+	pfd.fd = net_client.fd;
+	pfd.events = POLLIN;
+
+	while (!net_client.ready) {
+		int n;
+
+		if (left <= 0) {
+			error = ETIMEDOUT;
+			goto fail;
+		}
+
+		if ((n = poll(&pfd, 1, 100)) == -1 && errno != EINTR) {
+			error = errno;
+			goto fail;
+		}
+
+		if (n > 0 && (error = net_client_poll(&net_client)))
+			goto fail;
+
+		left -= 100;
+	}
+
+	mesh_snapshots = net_client.snapshots;
+	return 0;
+fail:
+	net_client_free(&net_client);
+	return error;
+}
+
+int main(int argc, char **argv)
+{
+	int error = 1, err = 0, headless = 0, generate = 0;
+	const char *world = NULL, *stream = NULL, *host = NULL, *csv = NULL, *trace = getenv(TRACE_ENV);
+	unsigned rate = TICK_RATE, size = 0, radius = WORLD_RADIUS, port = 0;
+	size_t budget = WORLD_BUDGET;
+	uint32_t seed = 0;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	// leave one core for the main thread
+	workers = cpus > 2 ? (cpus - 1 < MESHER_MAX ? (unsigned)cpus - 1 : MESHER_MAX) : 1;
+
+	for (int i = 1; i < argc; ++i) {
+		if (!strcmp(argv[i], "--headless")) {
+			headless = 1;
+		} else if (!strcmp(argv[i], "--rate") && i + 1 < argc) {
+			char *end;
+			unsigned long v = strtoul(argv[++i], &end, 10);
+
+			if (*end || !v || v > 1000) {
+				fprintf(stderr, "%s: bad tick rate: %s\n", argv[0], argv[i]);
+				return 1;
+			}
+
+			rate = (unsigned)v;
+		} else if (!strcmp(argv[i], "--chunk") && i + 1 < argc) {
+			char *end;
+			unsigned long v = strtoul(argv[++i], &end, 10);
+
+			if (*end || v < 2 || v > OT_SIZE_MAX || (v & (v - 1))) {
+				fprintf(stderr, "%s: bad chunk size: %s\n", argv[0], argv[i]);
+				return 1;
+			}
+
+			chunk_size = (unsigned)v;
+		} else if (!strcmp(argv[i], "--greedy")) {
+			greedy = 1;
+		} else if (!strcmp(argv[i], "--lod") && i + 1 < argc) {
+			char *end;
+			double v = strtod(argv[++i], &end);
+
+			if (*end || !(v >= 0)) {
+				fprintf(stderr, "%s: bad lod threshold: %s\n", argv[0], argv[i]);
+				return 1;
+			}
+
+			lod_pixels = (float)v;
+		} else if (!strcmp(argv[i], "--workers") && i + 1 < argc) {
+			char *end;
+			unsigned long v = strtoul(argv[++i], &end, 10);
+
+			if (*end || v > MESHER_MAX) {
+				fprintf(stderr, "%s: bad worker count: %s\n", argv[0], argv[i]);
+				return 1;
+			}
+
+			workers = (unsigned)v;
+		} else if (!strcmp(argv[i], "--upload") && i + 1 < argc) {
+			char *end;
+			unsigned long v = strtoul(argv[++i], &end, 10);
+
+			if (*end || !v || v > UINT_MAX) {
+				fprintf(stderr, "%s: bad upload budget: %s\n", argv[0], argv[i]);
+				return 1;
+			}
+
+			upload_budget = (unsigned)v;
+		} else if (!strcmp(argv[i], "--world") && i + 1 < argc) {
+			world = argv[++i];
+		} else if (!strcmp(argv[i], "--size") && i + 1 < argc) {
+			char *end;
+			unsigned long v = strtoul(argv[++i], &end, 10);
+
+			if (*end || v < 2 || v > OT_SIZE_MAX || (v & (v - 1))) {
+				fprintf(stderr, "%s: bad world size: %s\n", argv[0], argv[i]);
+				return 1;
+			}
+
+			size = (unsigned)v;
+		} else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+			char *end;
+			unsigned long v = strtoul(argv[++i], &end, 0);
+
+			if (*end || v > UINT32_MAX) {
+				fprintf(stderr, "%s: bad seed: %s\n", argv[0], argv[i]);
+				return 1;
+			}
+
+			seed = (uint32_t)v;
+			generate = 1;
+		} else if (!strcmp(argv[i], "--stream") && i + 1 < argc) {
+			stream = argv[++i];
+		} else if (!strcmp(argv[i], "--radius") && i + 1 < argc) {
+			char *end;
+			unsigned long v = strtoul(argv[++i], &end, 10);
+
+			if (*end || v > 64) {
+				fprintf(stderr, "%s: bad radius: %s\n", argv[0], argv[i]);
+				return 1;
+			}
+
+			radius = (unsigned)v;
+		} else if (!strcmp(argv[i], "--budget") && i + 1 < argc) {
+			char *end;
+			unsigned long v = strtoul(argv[++i], &end, 10);
+
+			if (*end || !v || v > SIZE_MAX >> 20) {
+				fprintf(stderr, "%s: bad memory budget: %s\n", argv[0], argv[i]);
+				return 1;
+			}
+
+			budget = (size_t)v << 20;
+		} else if (!strcmp(argv[i], "--listen") && i + 1 < argc) {
+			char *end;
+			unsigned long v = strtoul(argv[++i], &end, 10);
+
+			if (*end || !v || v > 65535) {
+				fprintf(stderr, "%s: bad port: %s\n", argv[0], argv[i]);
+				return 1;
+			}
+
+			port = (unsigned)v;
+		} else if (!strcmp(argv[i], "--connect") && i + 1 < argc) {
+			host = argv[++i];
+		} else if (!strcmp(argv[i], "--hud")) {
+			hud = 1;
+		} else if (!strcmp(argv[i], "--timings") && i + 1 < argc) {
+			csv = argv[++i];
+		} else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+			trace = argv[++i];
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	// only a single octree can be replicated, and a client gets its world from the server
+	if ((stream && (port || host)) || (host && (port || world || generate || size))) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (trace && *trace) {
+		if ((err = trace_init(trace))) {
+			fprintf(stderr, "%s: could not trace: %s\n", trace, strerror(err));
+			return 1;
+		}
+
+		trace_thread("main");
+	}
+
+	if (host) {
+		if ((err = client_init(host))) {
+			fprintf(stderr, "%s: could not join: %s\n", host, strerror(err));
+			goto fail;
+		}
+
+		dbgf("joined %s: %zu blocks, %zu nodes\n", host, ot_pool.blocks, ot_pool.count);
+		connected = 1;
+		// the client owns ot_pool
+		init_mask |= INIT_NET;
+	} else if (stream) {
+		// chunks are loaded by world_update, starting with the first tick
+		if ((err = world_init(&map, stream, seed, size ? size : WORLD_CHUNK, WORLD_IO))) {
+			fprintf(stderr, "%s: could not open world: %s\n", stream, strerror(err));
+			goto fail;
+		}
+
+		map.radius = radius;
+		map.budget = budget;
+		paged = 1;
+		init_mask |= INIT_WORLD;
+	} else if (world && (err = ot_load(&ot_pool, world)) != ENOENT) {
+		// start with a fresh world if there is nothing to load yet
+		if (err) {
+			fprintf(stderr, "%s: could not load world: %s\n", world, strerror(err));
+			goto fail;
+		}
+
+		dbgf("loaded %s: %zu blocks, %zu nodes\n", world, ot_pool.blocks, ot_pool.count);
+		init_mask |= INIT_OT;
+	} else {
+		if (ot_init(&ot_pool, OT_CAP, OT_RCAP, size ? size : OT_SIZE)) {
+			fputs("ot_init failed\n", stderr);
+			goto fail;
+		}
+
+		init_mask |= INIT_OT;
+
+		if (!generate) {
+			world_create();
+		} else if ((err = gen_world(&ot_pool, seed, cpus > 0 ? (unsigned)cpus : 1))) {
+			fprintf(stderr, "gen_world: %s\n", strerror(err));
+			goto fail;
+		} else {
+			dbgf("generated world %u: %zu blocks, %zu nodes\n", seed, ot_pool.blocks, ot_pool.count);
+		}
+	}
+
+	if (port) {
+		if ((err = net_server_init(&net_server, &ot_pool, (unsigned short)port))) {
+			fprintf(stderr, "%s: could not listen on port %u: %s\n", argv[0], port, strerror(err));
+			goto fail;
+		}
+
+		ot_pool.touch = server_touch;
+		listening = 1;
+		init_mask |= INIT_NET;
+	}
+
+	if (headless) {
+		struct sigaction sa;
+
+		memset(&sa, 0, sizeof sa);
+		sa.sa_handler = handle_stop;
+		sigaction(SIGINT, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+
+		error = sim_loop(rate);
+		goto fail;
+	}
+
+	if (csv) {
+		if (!(timings_csv = fopen(csv, "w"))) {
+			fprintf(stderr, "%s: could not create timings: %s\n", csv, strerror(errno));
+			goto fail;
+		}
+
+		fputs("frame", timings_csv);
+
+		for (unsigned i = 0; i < M_COUNT; ++i)
+			fprintf(timings_csv, i < M_NODES ? ",%s_ms" : ",%s", metric_names[i]);
+
+		fputc('\n', timings_csv);
+	}
 
 	if (!(IMG_Init(IMG_INIT_PNG) & IMG_INIT_PNG)) {
 		fprintf(stderr, "IMG_Init: %s\n", IMG_GetError());
@@ -945,8 +2120,61 @@ int main(void)
 	if (error)
 		goto fail;
 
+	// chunks can't be bigger than the world or cross the chunks of a paged world
+	size = paged ? map.chunk_size : ot_pool.root_size;
+	error = mesh_cache_init(&mesh_cache, chunk_size < size ? chunk_size : size);
+	if (error) {
+		fprintf(stderr, "mesh_cache_init: %s\n", strerror(error));
+		goto fail;
+	}
+
+	mesh_init(&mesh_tmp);
+	init_mask |= INIT_MESH;
+
+	// only now there is a mesh cache to tell about changes
+	if (paged)
+		map.touch = world_changed;
+
+	if ((error = mesher_init(&mesher, workers, greedy))) {
+		fprintf(stderr, "mesher_init: %s\n", strerror(error));
+		goto fail;
+	}
+
+	init_mask |= INIT_MESHER;
+
+	// the main thread needs a tick to draw before the first one is due
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	state_last = you;
+	tick_period = 1000000000ULL / rate;
+
+	if ((error = sim_publish(ts_ns(&now), NAN))) {
+		fprintf(stderr, "sim_publish: %s\n", strerror(error));
+		goto fail;
+	}
+
+	state_take();
+	threaded = 1;
+
+	if ((error = pthread_create(&sim_thread, NULL, sim_main, &rate))) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(error));
+		goto fail;
+	}
+
+	init_mask |= INIT_SIM;
+
 	error = sdl_loop();
 fail:
+	if (init_mask & INIT_SIM) {
+		__atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+		pthread_join(sim_thread, NULL);
+	}
+
+	for (unsigned i = 0; i < ARRAY_SIZE(states); ++i)
+		if (states[i].snap)
+			ot_snap_release(states[i].snap);
+
 	if (init_mask & INIT_SDL) {
 		if (gl)
 			SDL_GL_DeleteContext(gl);
@@ -958,8 +2186,65 @@ fail:
 	if (init_mask & INIT_IMG)
 		IMG_Quit();
 
-	if (init_mask & INIT_OT)
+	if (init_mask & INIT_MESHER) {
+		struct mesh_job *j;
+
+		while ((j = uploads)) {
+			uploads = j->next;
+			mesher_release(&mesher, j);
+		}
+
+		mesher_free(&mesher);
+	}
+
+	if (init_mask & INIT_MESH) {
+		mesh_free(&mesh_tmp);
+		mesh_cache_free(&mesh_cache);
+	}
+
+	if (init_mask & INIT_NET) {
+		if (listening) {
+			ot_pool.touch = NULL;
+			net_server_free(&net_server);
+		} else {
+			net_client_free(&net_client);
+		}
+	}
+
+	if (init_mask & INIT_WORLD) {
+		// the mesh cache is gone, but world_sync still picks up finished jobs
+		map.touch = NULL;
+
+		if (!error && (err = world_sync(&map))) {
+			fprintf(stderr, "%s: could not save world: %s\n", stream, strerror(err));
+			error = 1;
+		}
+
+		dbgf("chunks: loaded=%lu generated=%lu stored=%lu evicted=%lu failed=%lu\n",
+			map.stats.loaded, map.stats.generated, map.stats.stored, map.stats.evicted, map.stats.failed);
+		world_free(&map);
+	}
+
+	if (timings_csv && fclose(timings_csv)) {
+		fprintf(stderr, "%s: could not write timings: %s\n", csv, strerror(errno));
+		error = 1;
+	}
+
+	if (init_mask & INIT_OT) {
+		// only store worlds that were left in a sane state
+		if (!error && world && (err = ot_save(&ot_pool, world))) {
+			fprintf(stderr, "%s: could not save world: %s\n", world, strerror(err));
+			error = 1;
+		}
+
 		ot_free(&ot_pool);
+	}
+
+	// all threads are gone by now
+	if ((err = trace_free())) {
+		fprintf(stderr, "%s: could not write trace: %s\n", trace, strerror(err));
+		error = 1;
+	}
 
 	return error;
 }
@@ -0,0 +1,189 @@
+/*
+ * Chrome trace recording.
+ *
+ * Made by Folkert van Verseveld
+ *
+ * Copyright Folkert van Verseveld. All rights reserved.
+ *
+ * A thread gets its buffer on the first event it records and pushes it on a
+ * lock-free list. Only that thread writes to it, and buffers are only read
+ * once all threads are done, so events need no synchronisation at all.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+struct trace_event {
+	const char *name;
+	// CLOCK_MONOTONIC in ns
+	uint64_t start, end;
+};
+
+struct trace_buf {
+	unsigned tid;
+	// set by trace_thread, may be NULL
+	const char *name;
+	size_t count;
+	unsigned long dropped;
+	struct trace_buf *next;
+	struct trace_event events[];
+};
+
+int trace_on = 0;
+
+static char *trace_path;
+static uint64_t trace_origin;
+// all buffers, newest first
+static struct trace_buf *bufs;
+static unsigned tids;
+static __thread struct trace_buf *local;
+// threads that could not get a buffer
+static unsigned long lost;
+
+uint64_t trace_clock(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000ULL + (uint64_t)t.tv_nsec;
+}
+
+/* Start recording to path, which is written by trace_free. */
+int trace_init(const char *path)
+{
+	FILE *f;
+
+	// find out now rather than after a long session
+	if (!(f = fopen(path, "w")))
+		return errno;
+
+	fclose(f);
+
+	if (!(trace_path = malloc(strlen(path) + 1)))
+		return ENOMEM;
+
+	strcpy(trace_path, path);
+	trace_origin = trace_clock();
+	trace_on = 1;
+	return 0;
+}
+
+static struct trace_buf *trace_local(void)
+{
+	struct trace_buf *b, *head;
+
+	if (local)
+		return local;
+
+	if (!(b = malloc(sizeof *b + TRACE_EVENTS * sizeof *b->events))) {
+		__atomic_add_fetch(&lost, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	b->tid = __atomic_add_fetch(&tids, 1, __ATOMIC_RELAXED);
+	b->name = NULL;
+	b->count = 0;
+	b->dropped = 0;
+
+	head = __atomic_load_n(&bufs, __ATOMIC_RELAXED);
+
+	do
+		b->next = head;
+	while (!__atomic_compare_exchange_n(&bufs, &head, b, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	return local = b;
+}
+
+/* Name the calling thread in the trace. name must outlive the trace. */
+void trace_thread(const char *name)
+{
+	struct trace_buf *b;
+
+	if (trace_on && (b = trace_local()))
+		b->name = name;
+}
+
+void trace_add(const char *name, uint64_t start)
+{
+	struct trace_buf *b = trace_local();
+	struct trace_event *e;
+
+	if (!b)
+		return;
+
+	if (b->count == TRACE_EVENTS) {
+		++b->dropped;
+		return;
+	}
+
+	e = &b->events[b->count++];
+	e->name = name;
+	e->start = start;
+	e->end = trace_clock();
+}
+
+/* Stop recording and write everything to the trace file. */
+int trace_free(void)
+{
+	struct trace_buf *b, *next;
+	unsigned long dropped = 0;
+	int pid = (int)getpid(), error = 0, first = 1;
+	FILE *f;
+
+	if (!trace_on)
+		return 0;
+
+	trace_on = 0;
+
+	if (!(f = fopen(trace_path, "w"))) {
+		error = errno;
+		goto fail;
+	}
+
+	fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", f);
+
+	for (b = __atomic_load_n(&bufs, __ATOMIC_ACQUIRE); b; b = b->next) {
+		if (b->name) {
+			fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+				first ? "" : ",\n", pid, b->tid, b->name);
+			first = 0;
+		}
+
+		for (size_t i = 0; i < b->count; ++i) {
+			const struct trace_event *e = &b->events[i];
+
+			// timestamps are in us, which Perfetto takes as fractions too
+			fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+				first ? "" : ",\n", e->name, pid, b->tid,
+				(e->start - trace_origin) * 1e-3, (e->end - e->start) * 1e-3);
+			first = 0;
+		}
+
+		dropped += b->dropped;
+	}
+
+	fputs("\n]}\n", f);
+
+	if (ferror(f))
+		error = EIO;
+	if (fclose(f) && !error)
+		error = errno;
+
+	if (dropped || lost)
+		fprintf(stderr, "trace: dropped %lu events, %lu threads had no buffer\n", dropped, lost);
+fail:
+	for (b = bufs; b; b = next) {
+		next = b->next;
+		free(b);
+	}
+
+	bufs = NULL;
+	free(trace_path);
+	trace_path = NULL;
+	return error;
+}
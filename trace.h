@@ -0,0 +1,39 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// events each thread can record, the rest is dropped
+#define TRACE_EVENTS ((size_t)1 << 20)
+// environment variable with the file to trace to, see trace_init
+#define TRACE_ENV "MULTIVERSE_TRACE"
+
+/*
+ * Opt-in recording of timed spans in the Chrome trace format, which Perfetto
+ * and about:tracing can load. Each thread appends to its own buffer, so
+ * recording never takes a lock. Everything is written by trace_free, which
+ * must run after all threads that have recorded anything are done.
+ */
+extern int trace_on;
+
+int trace_init(const char *path);
+int trace_free(void);
+
+void trace_thread(const char *name);
+void trace_add(const char *name, uint64_t start);
+uint64_t trace_clock(void);
+
+/* Start of a span for trace_span, 0 if tracing is off. */
+static inline uint64_t trace_start(void)
+{
+	return __builtin_expect(trace_on, 0) ? trace_clock() : 0;
+}
+
+/* Record span name from start until now. name must outlive the trace, like a string literal. */
+static inline void trace_span(const char *name, uint64_t start)
+{
+	if (__builtin_expect(trace_on, 0) && start)
+		trace_add(name, start);
+}
+
+#endif
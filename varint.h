@@ -0,0 +1,60 @@
+#ifndef VARINT_H
+#define VARINT_H
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * LEB128 integers as used by both the world format and the network protocol:
+ * 7 bits per byte starting with the lowest, the top bit is set on all bytes
+ * but the last. Signed values are zigzag encoded first.
+ */
+
+// longest encoding of a 64 bit value
+#define VARINT_MAX 10
+
+/* Write v at p, which must have room for VARINT_MAX bytes. Returns the number of bytes written. */
+static inline size_t varint_put(unsigned char *p, uint64_t v)
+{
+	size_t n = 0;
+
+	for (; v >= 0x80; v >>= 7)
+		p[n++] = (unsigned char)(v | 0x80);
+
+	p[n++] = (unsigned char)v;
+	return n;
+}
+
+/* Read a value from *pos before end and move *pos past it. Returns EINVAL if it is cut off or too long. */
+static inline int varint_get(const unsigned char **pos, const unsigned char *end, uint64_t *v)
+{
+	const unsigned char *p = *pos;
+	uint64_t x = 0;
+
+	for (unsigned shift = 0; shift < 64 && p < end; shift += 7) {
+		unsigned char b = *p++;
+
+		x |= (uint64_t)(b & 0x7f) << shift;
+
+		if (!(b & 0x80)) {
+			*pos = p;
+			*v = x;
+			return 0;
+		}
+	}
+
+	return EINVAL;
+}
+
+static inline uint64_t zigzag_encode(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t u)
+{
+	return (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+}
+
+#endif
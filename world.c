@@ -0,0 +1,679 @@
+/*
+ * Paged world of octree chunks.
+ *
+ * Made by Folkert van Verseveld
+ *
+ * Copyright Folkert van Verseveld. All rights reserved.
+ *
+ * Chunks are handed to I/O threads as a whole: while a chunk is loading or
+ * saving, the thread owns its octree and the main thread leaves it alone.
+ * Finished chunks come back through a lock-free stack that world_update
+ * empties, so the main thread never waits for a job. Chunks that are ready
+ * are kept in LRU order, which tells world_update what to evict first.
+ */
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "dbg.h"
+#include "gen.h"
+#include "trace.h"
+#include "world.h"
+
+static inline size_t world_hash(int x, int y, int z)
+{
+	return ((unsigned)x * 73856093u) ^ ((unsigned)y * 19349663u) ^ ((unsigned)z * 83492791u);
+}
+
+/* Chunk coordinate of block coordinate v. Shifts floor negative numbers too. */
+static inline int world_coord(const struct world *w, int v)
+{
+	return v >> w->shift;
+}
+
+static size_t world_chunk_bytes(const struct world_chunk *c)
+{
+	const struct ot_pool *o = &c->ot;
+
+	return sizeof *c + o->cap * sizeof *o->nodes
+		+ (o->cap >> 3) * (sizeof *o->parents + sizeof *o->gens + sizeof *o->epochs)
+		+ o->rcap * sizeof *o->rpop;
+}
+
+/* World coordinates of cell (0,0,0) in the octree of c, which is the middle of the chunk. */
+void world_chunk_origin(const struct world *w, const struct world_chunk *c, int off[3])
+{
+	int size = (int)w->chunk_size;
+
+	off[0] = c->x * size + size / 2;
+	off[1] = c->y * size + size / 2;
+	off[2] = c->z * size + size / 2;
+}
+
+static int world_path(const struct world *w, const struct world_chunk *c, char *buf, size_t n)
+{
+	int len = snprintf(buf, n, "%s/%d_%d_%d.ot", w->dir, c->x, c->y, c->z);
+
+	return len < 0 || (size_t)len >= n ? ENAMETOOLONG : 0;
+}
+
+static inline int world_unsaved(const struct world_chunk *c)
+{
+	return (c->flags & WC_DIRTY) || !(c->flags & WC_STORED);
+}
+
+/* Load, generate or store chunk depending on its state. Runs on an I/O thread. */
+static void world_run(struct world *w, struct world_chunk *c)
+{
+	char path[PATH_MAX];
+	int off[3];
+
+	if ((c->error = world_path(w, c, path, sizeof path)))
+		return;
+
+	if (c->state == WC_SAVING) {
+		c->error = ot_save(&c->ot, path);
+		return;
+	}
+
+	if ((c->error = ot_load(&c->ot, path)) != ENOENT) {
+		// a chunk of another size would end up in the wrong place
+		if (!c->error && c->ot.root_size != w->chunk_size) {
+			ot_free(&c->ot);
+			c->error = EINVAL;
+		}
+
+		if (!c->error)
+			c->flags |= WC_STORED;
+		return;
+	}
+
+	if ((c->error = ot_init(&c->ot, OT_CAP, OT_RCAP, w->chunk_size)))
+		return;
+
+	world_chunk_origin(w, c, off);
+
+	if ((c->error = gen_area(&c->ot, w->seed, off, w->amp, 0))) {
+		ot_free(&c->ot);
+		return;
+	}
+
+	c->flags |= WC_GENERATED;
+}
+
+static void world_done(struct world *w, struct world_chunk *c)
+{
+	struct world_chunk *head = __atomic_load_n(&w->done, __ATOMIC_RELAXED);
+
+	do
+		c->job = head;
+	while (!__atomic_compare_exchange_n(&w->done, &head, c, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void *world_main(void *arg)
+{
+	struct world *w = arg;
+
+	trace_thread("world io");
+
+	for (;;) {
+		struct world_chunk *c;
+		uint64_t t;
+		int stop;
+
+		pthread_mutex_lock(&w->lock);
+
+		while (!w->todo && !w->stop)
+			pthread_cond_wait(&w->cond, &w->lock);
+
+		// finish the queue first, it may hold changes that must be written
+		if (!(c = w->todo)) {
+			pthread_mutex_unlock(&w->lock);
+			break;
+		}
+
+		if (!(w->todo = c->job))
+			w->todo_tail = NULL;
+
+		stop = w->stop;
+		pthread_mutex_unlock(&w->lock);
+
+		t = trace_start();
+
+		if (stop && c->state == WC_LOADING)
+			c->error = ECANCELED;
+		else
+			world_run(w, c);
+
+		trace_span(c->state == WC_LOADING ? "chunk_load" : "chunk_save", t);
+
+		world_done(w, c);
+	}
+
+	return NULL;
+}
+
+/* Hand chunk over to an I/O thread, or do the job right away if there are none. */
+static void world_submit(struct world *w, struct world_chunk *c)
+{
+	++w->pending;
+	c->job = NULL;
+
+	if (!w->nthreads) {
+		world_run(w, c);
+		world_done(w, c);
+		return;
+	}
+
+	pthread_mutex_lock(&w->lock);
+
+	if (w->todo_tail)
+		w->todo_tail->job = c;
+	else
+		w->todo = c;
+
+	w->todo_tail = c;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void world_stop(struct world *w, unsigned n)
+{
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	while (n)
+		pthread_join(w->threads[--n], NULL);
+}
+
+/*
+ * Keep the chunks of the world in dir, which is created if it doesn't exist
+ * yet. Chunks that aren't there are generated from seed. Uses threads I/O
+ * threads, or none to do all I/O on the calling thread in world_update.
+ */
+int world_init(struct world *w, const char *dir, uint32_t seed, unsigned chunk_size, unsigned threads)
+{
+	int error;
+
+	if (chunk_size < 2 || chunk_size > OT_SIZE_MAX || (chunk_size & (chunk_size - 1)) || threads > WORLD_IO_MAX)
+		return EINVAL;
+
+	if (mkdir(dir, 0777) && errno != EEXIST)
+		return errno;
+
+	w->seed = seed;
+	w->chunk_size = chunk_size;
+	for (w->shift = 0; (1u << w->shift) < chunk_size; ++w->shift)
+		;
+	w->amp = WORLD_AMP;
+	w->radius = WORLD_RADIUS;
+	w->bytes = 0;
+	w->budget = WORLD_BUDGET;
+	w->count = 0;
+	w->nbuckets = 64;
+	w->newest = w->oldest = NULL;
+	w->tick = 0;
+	w->pending = 0;
+	w->threads = NULL;
+	w->nthreads = threads;
+	w->todo = w->todo_tail = NULL;
+	w->stop = 0;
+	w->done = NULL;
+	memset(&w->stats, 0, sizeof w->stats);
+	w->touch = NULL;
+
+	if (!(w->dir = strdup(dir)))
+		return ENOMEM;
+
+	if (!(w->buckets = calloc(w->nbuckets, sizeof *w->buckets))) {
+		error = ENOMEM;
+		goto fail;
+	}
+
+	if (threads && !(w->threads = malloc(threads * sizeof *w->threads))) {
+		error = ENOMEM;
+		goto fail;
+	}
+
+	if ((error = pthread_mutex_init(&w->lock, NULL)))
+		goto fail;
+
+	if ((error = pthread_cond_init(&w->cond, NULL))) {
+		pthread_mutex_destroy(&w->lock);
+		goto fail;
+	}
+
+	for (unsigned i = 0; i < threads; ++i)
+		if ((error = pthread_create(&w->threads[i], NULL, world_main, w))) {
+			world_stop(w, i);
+			pthread_cond_destroy(&w->cond);
+			pthread_mutex_destroy(&w->lock);
+			goto fail;
+		}
+
+	return 0;
+fail:
+	free(w->threads);
+	free(w->buckets);
+	free(w->dir);
+	return error;
+}
+
+/* Double the number of hash chains and redistribute all chunks. */
+static int world_rehash(struct world *w)
+{
+	size_t n = w->nbuckets << 1;
+	struct world_chunk **buckets;
+
+	if (!(buckets = calloc(n, sizeof *buckets)))
+		return ENOMEM;
+
+	for (size_t i = 0; i < w->nbuckets; ++i)
+		for (struct world_chunk *c = w->buckets[i], *next; c; c = next) {
+			size_t b = world_hash(c->x, c->y, c->z) & (n - 1);
+
+			next = c->next;
+			c->next = buckets[b];
+			buckets[b] = c;
+		}
+
+	free(w->buckets);
+	w->buckets = buckets;
+	w->nbuckets = n;
+	return 0;
+}
+
+struct world_chunk *world_chunk_find(const struct world *w, int x, int y, int z)
+{
+	struct world_chunk *c;
+
+	for (c = w->buckets[world_hash(x, y, z) & (w->nbuckets - 1)]; c; c = c->next)
+		if (c->x == x && c->y == y && c->z == z)
+			break;
+
+	return c;
+}
+
+static void world_remove(struct world *w, struct world_chunk *c)
+{
+	struct world_chunk **p;
+
+	for (p = &w->buckets[world_hash(c->x, c->y, c->z) & (w->nbuckets - 1)]; *p != c; p = &(*p)->next)
+		assert(*p);
+
+	*p = c->next;
+	--w->count;
+}
+
+static void world_unlink(struct world *w, struct world_chunk *c)
+{
+	if (c->newer)
+		c->newer->older = c->older;
+	else
+		w->newest = c->older;
+
+	if (c->older)
+		c->older->newer = c->newer;
+	else
+		w->oldest = c->newer;
+}
+
+/* Mark ready chunk as wanted by this update. */
+static void world_use(struct world *w, struct world_chunk *c)
+{
+	c->used = w->tick;
+
+	if (w->newest == c)
+		return;
+
+	world_unlink(w, c);
+
+	c->newer = NULL;
+	if ((c->older = w->newest))
+		c->older->newer = c;
+	else
+		w->oldest = c;
+
+	w->newest = c;
+}
+
+static void world_touch(struct world *w, const struct world_chunk *c)
+{
+	int size = (int)w->chunk_size, min[3], max[3];
+
+	if (!w->touch)
+		return;
+
+	min[0] = c->x * size;
+	min[1] = c->y * size;
+	min[2] = c->z * size;
+
+	for (unsigned i = 0; i < 3; ++i)
+		max[i] = min[i] + size;
+
+	w->touch(w, min, max);
+}
+
+static void world_ready(struct world *w, struct world_chunk *c)
+{
+	c->state = WC_READY;
+	c->bytes = world_chunk_bytes(c);
+	w->bytes += c->bytes;
+
+	// new chunks go in front, as if they have been used already
+	c->newer = c->older = NULL;
+	if (w->newest) {
+		w->newest->newer = c;
+		c->older = w->newest;
+	} else {
+		w->oldest = c;
+	}
+
+	w->newest = c;
+	c->used = w->tick;
+	world_touch(w, c);
+}
+
+/* Take care of all finished jobs. */
+static void world_poll(struct world *w)
+{
+	struct world_chunk *c = __atomic_exchange_n(&w->done, NULL, __ATOMIC_ACQUIRE), *next;
+
+	for (; c; c = next) {
+		next = c->job;
+		--w->pending;
+
+		if (c->state == WC_SAVING) {
+			if (c->error) {
+				// keep changes around, eviction tries again later
+				dbgf("world: could not store chunk %d,%d,%d: %s\n", c->x, c->y, c->z, strerror(c->error));
+				world_ready(w, c);
+				continue;
+			}
+
+			++w->stats.stored;
+			world_remove(w, c);
+			ot_free(&c->ot);
+			free(c);
+			continue;
+		}
+
+		if (c->error) {
+			if (c->error != ECANCELED)
+				dbgf("world: could not load chunk %d,%d,%d: %s\n", c->x, c->y, c->z, strerror(c->error));
+
+			c->state = WC_FAILED;
+			++w->stats.failed;
+			continue;
+		}
+
+		if (c->flags & WC_GENERATED)
+			++w->stats.generated;
+		else
+			++w->stats.loaded;
+
+		world_ready(w, c);
+	}
+}
+
+/* Write the chunk back if needed and drop it. */
+static void world_evict(struct world *w, struct world_chunk *c)
+{
+	world_unlink(w, c);
+	w->bytes -= c->bytes;
+	++w->stats.evicted;
+
+	// let the caller forget about it before it is gone
+	world_touch(w, c);
+
+	if (world_unsaved(c)) {
+		c->state = WC_SAVING;
+		world_submit(w, c);
+		return;
+	}
+
+	world_remove(w, c);
+	ot_free(&c->ot);
+	free(c);
+}
+
+static int world_load(struct world *w, int x, int y, int z)
+{
+	struct world_chunk *c;
+	size_t b;
+
+	// keep chains short, chains just get longer if there is no memory for it
+	if (w->count >= w->nbuckets)
+		world_rehash(w);
+
+	if (!(c = malloc(sizeof *c)))
+		return ENOMEM;
+
+	c->x = x;
+	c->y = y;
+	c->z = z;
+	c->state = WC_LOADING;
+	c->flags = 0;
+	c->bytes = 0;
+	c->used = w->tick;
+	c->error = 0;
+	c->seen = 0;
+	c->newer = c->older = NULL;
+
+	b = world_hash(x, y, z) & (w->nbuckets - 1);
+	c->next = w->buckets[b];
+	w->buckets[b] = c;
+	++w->count;
+
+	world_submit(w, c);
+	return 0;
+}
+
+/*
+ * Make sure all chunks within radius chunks of pos get loaded and evict the
+ * least recently used chunks that are further away while the budget is
+ * exceeded. Call it once per tick: it only queues work and picks up what the
+ * I/O threads have finished since the last call.
+ */
+int world_update(struct world *w, const float pos[3])
+{
+	unsigned limit = WORLD_QUEUE * (w->nthreads ? w->nthreads : 1);
+	int r = (int)w->radius, centre[3], error = 0;
+	struct world_chunk *c;
+
+	++w->tick;
+	world_poll(w);
+
+	for (unsigned i = 0; i < 3; ++i)
+		centre[i] = world_coord(w, (int)floorf(pos[i]));
+
+	// shells of increasing distance, so near chunks get queued before far ones
+	for (int d = 0; d <= r; ++d)
+		for (int dz = -d; dz <= d; ++dz)
+			for (int dy = -d; dy <= d; ++dy) {
+				// inside the shell only the first and last x are on it
+				int step = abs(dz) == d || abs(dy) == d ? 1 : 2 * d;
+
+				for (int dx = -d; dx <= d; dx += step) {
+					int x = centre[0] + dx, y = centre[1] + dy, z = centre[2] + dz;
+					int err;
+
+					if (dx * dx + dy * dy + dz * dz > r * r)
+						continue;
+
+					if ((c = world_chunk_find(w, x, y, z))) {
+						if (c->state == WC_READY)
+							world_use(w, c);
+						continue;
+					}
+
+					// the rest is queued once these are done
+					if (w->pending >= limit)
+						continue;
+
+					if ((err = world_load(w, x, y, z)) && !error)
+						error = err;
+				}
+			}
+
+	// chunks that are still wanted this tick stay, even if that exceeds the budget
+	while (w->bytes > w->budget && (c = w->oldest) && c->used != w->tick)
+		world_evict(w, c);
+
+	return error;
+}
+
+/*
+ * Write all changed chunks to disk. Waits for the disk, so it is meant for
+ * shutting down. The I/O threads are stopped first, so chunks that could not
+ * be written back when they were evicted are written here as well. Anything
+ * that is queued after this runs on the calling thread.
+ */
+int world_sync(struct world *w)
+{
+	char path[PATH_MAX];
+	int error = 0, err;
+
+	world_stop(w, w->nthreads);
+	w->nthreads = 0;
+	world_poll(w);
+
+	for (struct world_chunk *c = w->newest; c; c = c->older) {
+		if (!world_unsaved(c))
+			continue;
+
+		if ((err = world_path(w, c, path, sizeof path)) || (err = ot_save(&c->ot, path))) {
+			if (!error)
+				error = err;
+			continue;
+		}
+
+		c->flags = (c->flags & ~WC_DIRTY) | WC_STORED;
+		++w->stats.stored;
+	}
+
+	return error;
+}
+
+/* Stop all I/O threads and free all chunks. Changes that have not been written by world_sync are lost. */
+void world_free(struct world *w)
+{
+	world_stop(w, w->nthreads);
+	world_poll(w);
+
+	for (size_t i = 0; i < w->nbuckets; ++i)
+		for (struct world_chunk *c = w->buckets[i], *next; c; c = next) {
+			next = c->next;
+
+			if (c->state == WC_READY)
+				ot_free(&c->ot);
+
+			free(c);
+		}
+
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+
+	free(w->threads);
+	free(w->buckets);
+	free(w->dir);
+}
+
+/* Ready chunk with block (x,y,z) and its position in the octree of the chunk, NULL if not ready. */
+struct world_chunk *world_chunk_at(const struct world *w, int x, int y, int z, int local[3])
+{
+	struct world_chunk *c = world_chunk_find(w, world_coord(w, x), world_coord(w, y), world_coord(w, z));
+	int off[3];
+
+	if (!c || c->state != WC_READY)
+		return NULL;
+
+	world_chunk_origin(w, c, off);
+	local[0] = x - off[0];
+	local[1] = y - off[1];
+	local[2] = z - off[2];
+	return c;
+}
+
+/* Block at (x,y,z), which is air if its chunk isn't ready. */
+block_t world_get_cell(const struct world *w, int x, int y, int z)
+{
+	struct world_chunk *c;
+	int local[3];
+
+	if (!(c = world_chunk_at(w, x, y, z, local)))
+		return ID_AIR;
+
+	return ot_get_cell(&c->ot, local[0], local[1], local[2]);
+}
+
+/* Change block at (x,y,z). Returns EAGAIN if its chunk isn't ready yet. */
+int world_set_cell(struct world *w, int x, int y, int z, block_t id)
+{
+	struct world_chunk *c;
+	int local[3], error;
+	size_t bytes;
+
+	if (!(c = world_chunk_at(w, x, y, z, local))) {
+		c = world_chunk_find(w, world_coord(w, x), world_coord(w, y), world_coord(w, z));
+		return c && c->state == WC_FAILED ? c->error : EAGAIN;
+	}
+
+	if ((error = ot_set_cell(&c->ot, local[0], local[1], local[2], id)))
+		return error;
+
+	c->flags |= WC_DIRTY;
+
+	// the octree may have grown its pool
+	bytes = world_chunk_bytes(c);
+	w->bytes += bytes - c->bytes;
+	c->bytes = bytes;
+	return 0;
+}
+
+/* Like ot_raycast, but only hits blocks in chunks that are ready. */
+int world_raycast(const struct world *w, const float origin[3], const float dir[3], float max_dist, struct ot_hit *hit)
+{
+	int lo[3], hi[3], found = 0;
+
+	for (unsigned i = 0; i < 3; ++i) {
+		lo[i] = world_coord(w, (int)floorf(origin[i] - max_dist));
+		hi[i] = world_coord(w, (int)floorf(origin[i] + max_dist));
+	}
+
+	for (int z = lo[2]; z <= hi[2]; ++z)
+		for (int y = lo[1]; y <= hi[1]; ++y)
+			for (int x = lo[0]; x <= hi[0]; ++x) {
+				struct world_chunk *c = world_chunk_find(w, x, y, z);
+				struct ot_hit h;
+				float org[3];
+				int off[3];
+
+				if (!c || c->state != WC_READY)
+					continue;
+
+				world_chunk_origin(w, c, off);
+
+				for (unsigned i = 0; i < 3; ++i)
+					org[i] = origin[i] - (float)off[i];
+
+				if (!ot_raycast(&c->ot, org, dir, found ? hit->dist : max_dist, &h) || (found && h.dist >= hit->dist))
+					continue;
+
+				for (unsigned i = 0; i < 3; ++i)
+					h.pos[i] += off[i];
+
+				*hit = h;
+				found = 1;
+			}
+
+	return found;
+}
@@ -0,0 +1,126 @@
+#ifndef WORLD_H
+#define WORLD_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ot.h"
+
+// default edge of a chunk in blocks
+#define WORLD_CHUNK 64
+// default distance in chunks around the player that is kept loaded
+#define WORLD_RADIUS 4
+// default memory budget for chunks in bytes
+#define WORLD_BUDGET ((size_t)128 << 20)
+// default height difference of generated terrain, see gen_area
+#define WORLD_AMP 64
+// default number of I/O threads
+#define WORLD_IO 2
+// upper limit for number of I/O threads
+#define WORLD_IO_MAX 16
+// chunks that may wait for an I/O thread per thread, so nearby ones don't queue up behind far ones
+#define WORLD_QUEUE 4
+
+// waiting for or being loaded or generated by an I/O thread
+#define WC_LOADING 1
+// in memory and only touched by the main thread
+#define WC_READY 2
+// being written back by an I/O thread, freed once it is done
+#define WC_SAVING 3
+// could not be loaded, never touched again so the file is left alone
+#define WC_FAILED 4
+
+// changed since it was last written
+#define WC_DIRTY 1
+// file on disk matches, unless WC_DIRTY is set
+#define WC_STORED 2
+// generated rather than loaded
+#define WC_GENERATED 4
+
+/*
+ * Part of the world that is stored, loaded and evicted as a whole. The octree
+ * has its centre in the middle of the chunk, so the chunk covers
+ * pos <= (x,y,z) < pos + size with pos = (x,y,z) * size.
+ */
+struct world_chunk {
+	// chunk coordinates
+	int x, y, z;
+	unsigned state, flags;
+	struct ot_pool ot;
+	// bytes taken by ot when it was last counted
+	size_t bytes;
+	// last world_update that wanted the chunk
+	unsigned long used;
+	// result of the last job
+	int error;
+	// generation of ot that has been seen by the caller, free for its own use
+	uint32_t seen;
+	// hash chain
+	struct world_chunk *next;
+	// ready chunks from most to least recently used
+	struct world_chunk *newer, *older;
+	// next job in queue or done list
+	struct world_chunk *job;
+};
+
+struct world_stats {
+	unsigned long loaded, generated, stored, evicted, failed;
+};
+
+/*
+ * Unbounded world made of octree chunks in a hash map. world_update keeps the
+ * chunks around the player in memory: missing ones are loaded from dir or
+ * generated from the seed by I/O threads, and the least recently used ones are
+ * written back and dropped when they take more than budget bytes. The main
+ * thread never waits for disk, chunks that aren't ready yet just read as air.
+ */
+struct world {
+	char *dir;
+	uint32_t seed;
+	// chunk size in blocks and its log2
+	unsigned chunk_size, shift;
+	int amp;
+	// distance in chunks around the player that is kept loaded
+	unsigned radius;
+	// bytes taken by ready chunks and how many may be kept without need
+	size_t bytes, budget;
+
+	struct world_chunk **buckets;
+	size_t nbuckets, count;
+	// all ready chunks, see world_chunk.newer
+	struct world_chunk *newest, *oldest;
+	unsigned long tick;
+	// jobs that are queued or running
+	unsigned pending;
+
+	pthread_t *threads;
+	unsigned nthreads;
+	// pending jobs, protected by lock
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct world_chunk *todo, *todo_tail;
+	int stop;
+	// finished jobs, pushed by I/O threads and taken by world_update
+	struct world_chunk *done;
+
+	struct world_stats stats;
+	// Called after chunks in min <= (x,y,z) < max have come or gone, may be NULL.
+	void (*touch)(struct world *w, const int min[3], const int max[3]);
+};
+
+int world_init(struct world *w, const char *dir, uint32_t seed, unsigned chunk_size, unsigned threads);
+void world_free(struct world *w);
+
+int world_update(struct world *w, const float pos[3]);
+int world_sync(struct world *w);
+
+struct world_chunk *world_chunk_find(const struct world *w, int x, int y, int z);
+struct world_chunk *world_chunk_at(const struct world *w, int x, int y, int z, int local[3]);
+void world_chunk_origin(const struct world *w, const struct world_chunk *c, int off[3]);
+
+block_t world_get_cell(const struct world *w, int x, int y, int z);
+int world_set_cell(struct world *w, int x, int y, int z, block_t id);
+int world_raycast(const struct world *w, const float origin[3], const float dir[3], float max_dist, struct ot_hit *hit);
+
+#endif